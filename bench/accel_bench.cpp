@@ -0,0 +1,159 @@
+// Compares the acceleration backends on one scene: build time, memory and
+// nearest-hit rays per second through calculateNearestIntersection(), with
+// brute force as the baseline. Also checks every backend returns the same
+// hits as brute force.
+//
+// Usage: accel_bench <input_file.txt> [--rays N] [--seconds S] [--simd ISA]
+
+#include "raytrace.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Deterministic ray sets: primary rays spread over the image, and secondary
+ * rays from random points inside the scene bounds in random directions.
+ */
+static void generateRays(int count, vector<Ray> &primary, vector<Ray> &secondary) {
+    unsigned int seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1664525u + 1013904223u;
+        return (seed >> 8) / 16777216.0f;
+    };
+
+    float lo[3] = {0, 0, 0};
+    float hi[3] = {0, 0, 0};
+    for (unsigned int i = 0; i < g_spheres.size(); i++)
+        for (int k = 0; k < 3; k++) {
+            float p = g_spheres[i].position[k];
+            lo[k] = i == 0 ? p : fminf(lo[k], p);
+            hi[k] = i == 0 ? p : fmaxf(hi[k], p);
+        }
+
+    for (int i = 0; i < count; i++) {
+        Ray ray;
+        ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        ray.dir = getDir((int) (next() * g_width), (int) (next() * g_height));
+        ray.reflectionLevel = 0;
+        primary.push_back(ray);
+
+        vec4 dir;
+        do {
+            dir = vec4(2 * next() - 1, 2 * next() - 1, 2 * next() - 1, 0.0f);
+        } while (dot(dir, dir) > 1 || dot(dir, dir) < 1e-4f);
+        ray.origin = vec4(lo[0] + next() * (hi[0] - lo[0]), lo[1] + next() * (hi[1] - lo[1]),
+                          lo[2] + next() * (hi[2] - lo[2]), 1.0f);
+        ray.dir = normalize(dir);
+        ray.reflectionLevel = 1;
+        secondary.push_back(ray);
+    }
+}
+
+/**
+ * Trace rays until they run out or the time limit passes. Returns rays per
+ * second and the hits found.
+ */
+static double measure(const vector<Ray> &rays, double seconds, vector<Intersection> &hits) {
+    hits.clear();
+    double start = now();
+    double elapsed = 0;
+    for (unsigned int i = 0; i < rays.size(); i++) {
+        hits.push_back(calculateNearestIntersection(rays[i]));
+        if ((i & 255) == 255) {
+            elapsed = now() - start;
+            if (elapsed > seconds) {
+                break;
+            }
+        }
+    }
+    elapsed = now() - start;
+    return hits.size() / elapsed;
+}
+
+static int countMismatches(const vector<Intersection> &hits, const vector<Intersection> &reference) {
+    int mismatches = 0;
+    for (unsigned int i = 0; i < hits.size() && i < reference.size(); i++) {
+        if (hits[i].distance != reference[i].distance ||
+            (hits[i].distance != -1 && hits[i].sphere != reference[i].sphere)) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    const char *inputFile = NULL;
+    int rayCount = 100000;
+    double seconds = 2.0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc) {
+            rayCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            g_simdISA = argv[++i];
+        } else {
+            inputFile = argv[i];
+        }
+    }
+    if (inputFile == NULL) {
+        cout << "Usage: accel_bench <input_file.txt> [--rays N] [--seconds S] [--simd ISA]" << endl;
+        exit(1);
+    }
+
+    double start = now();
+    loadFile(inputFile);
+    printf("Scene %s: %d spheres, parsed in %.1f ms\n", inputFile, (int) g_spheres.size(), (now() - start) * 1e3);
+
+    g_accelerator = ACCEL_NONE;
+    prepareScene();
+    printf("SIMD kernels: %s\n\n", g_simdKernels != NULL ? g_simdKernels->name : "off");
+
+    vector<Ray> primary, secondary;
+    generateRays(rayCount, primary, secondary);
+
+    const char *names[] = {"brute force", "bvh", "grid"};
+    const Accelerator backends[] = {ACCEL_NONE, ACCEL_BVH, ACCEL_GRID};
+    vector<Intersection> referencePrimary, referenceSecondary;
+
+    printf("%-12s %10s %12s %16s %18s %10s\n", "backend", "build ms", "memory KB", "primary Mrays/s",
+           "secondary Mrays/s", "mismatches");
+    for (int b = 0; b < 3; b++) {
+        g_accelerator = backends[b];
+
+        double buildStart = now();
+        size_t memory = 0;
+        if (g_accelerator == ACCEL_BVH) {
+            buildSceneBVH();
+            memory = g_bvh.nodes.size() * sizeof(BVHNode) + g_bvh.primitives.size() * sizeof(int);
+        } else if (g_accelerator == ACCEL_GRID) {
+            buildSceneGrid();
+            memory = (g_grid.cellStart.size() + g_grid.cellSpheres.size()) * sizeof(int);
+        }
+        double buildTime = now() - buildStart;
+
+        vector<Intersection> hitsPrimary, hitsSecondary;
+        double primaryRate = measure(primary, seconds, hitsPrimary);
+        double secondaryRate = measure(secondary, seconds, hitsSecondary);
+
+        int mismatches = 0;
+        if (b == 0) {
+            referencePrimary = hitsPrimary;
+            referenceSecondary = hitsSecondary;
+        } else {
+            mismatches = countMismatches(hitsPrimary, referencePrimary) +
+                         countMismatches(hitsSecondary, referenceSecondary);
+        }
+
+        printf("%-12s %10.2f %12.1f %16.3f %18.3f %10d\n", names[b], buildTime * 1e3, memory / 1024.0,
+               primaryRate / 1e6, secondaryRate / 1e6, mismatches);
+    }
+    return 0;
+}
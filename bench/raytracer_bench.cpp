@@ -0,0 +1,538 @@
+// Microbenchmarks for the kernels behind every pixel, each on its own over
+// synthetic spheres and rays: nearest-hit queries through
+// calculateNearestIntersection() at chosen hit ratios and from inside
+// spheres, Blinn-Phong shading with its shadow rays, whole trace() calls
+// with up to MAX_REFLECTIONS - 1 bounces, InvertMatrix(), mat4 * vec4, the
+// PPM, PFM and PNG image encoders from each framebuffer format, and whole
+// renders in each pixel order with their cache misses. Results are printed
+// as JSON with ns/op and ops/sec (rays/sec for the ray benchmarks), so
+// builds and machines can be compared by script.
+//
+// Usage: raytracer_bench [--seconds S] [--simd ISA] [--spheres N]
+
+#include "raytrace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Synthetic spheres sit on a square lattice in the plane z = -SPHERE_PLANE,
+// SPHERE_SPACING apart, so points halfway between four of them are misses
+#define SPHERE_PLANE 20.0f
+#define SPHERE_SPACING 4.0f
+#define SPHERE_RADIUS 1.0f
+
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int s_seed = 12345;
+
+static float nextRandom() {
+    s_seed = s_seed * 1664525u + 1013904223u;
+    return (s_seed >> 8) / 16777216.0f;
+}
+
+// Results depend on this, so the compiler cannot drop the measured work
+static volatile float s_sink;
+
+struct BenchResult {
+    string name;
+    string parameters;      // JSON members describing the case, without braces
+    double nsPerOp;
+    double opsPerSec;
+    bool rays;              // ops are rays
+    string counters;        // More JSON members with hardware counts, or empty
+};
+
+static vector<BenchResult> s_results;
+
+/**
+ * Run body(i) for i = 0, 1, ... in batches of batchSize until seconds have
+ * passed, and record the time per call.
+ */
+template<class Body>
+static void measure(const string &name, const string &parameters, bool rays, double seconds, int batchSize,
+                    Body body) {
+    // Warm up caches and branch predictors first
+    for (int i = 0; i < batchSize; i++) {
+        body(i);
+    }
+
+    long long ops = 0;
+    double start = now();
+    double elapsed = 0;
+    do {
+        for (int i = 0; i < batchSize; i++) {
+            body(i);
+        }
+        ops += batchSize;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+
+    BenchResult result;
+    result.name = name;
+    result.parameters = parameters;
+    result.nsPerOp = elapsed * 1e9 / ops;
+    result.opsPerSec = ops / elapsed;
+    result.rays = rays;
+    s_results.push_back(result);
+    fprintf(stderr, "%-10s %-52s %10.1f ns/op\n", name.c_str(), parameters.c_str(), result.nsPerOp);
+}
+
+
+// -------------------------------------------------------------------
+// Synthetic scenes and rays
+
+/**
+ * Replace the scene with sphereCount spheres on the lattice and two lights.
+ * reflectivity is every sphere's Kr.
+ */
+static void buildScene(int sphereCount, float reflectivity) {
+    clearScene();
+    g_near = 1;
+    g_left = -1;
+    g_right = 1;
+    g_bottom = -1;
+    g_top = 1;
+    g_width = 512;
+    g_height = 512;
+    g_backgroundColor = vec4(0.1f, 0.1f, 0.1f, 0.0f);
+    g_ambientIntensity = vec4(0.2f, 0.2f, 0.2f, 0.0f);
+
+    int side = 1;
+    while (side * side < sphereCount) {
+        side++;
+    }
+    for (int i = 0; i < sphereCount; i++) {
+        Sphere sphere;
+        float x = (i % side - (side - 1) * 0.5f) * SPHERE_SPACING;
+        float y = (i / side - (side - 1) * 0.5f) * SPHERE_SPACING;
+        sphere.position = vec4(x, y, -SPHERE_PLANE, 1.0f);
+        sphere.scale = vec3(SPHERE_RADIUS, SPHERE_RADIUS, SPHERE_RADIUS);
+        float r = 0.2f + 0.6f * nextRandom();
+        float g = 0.2f + 0.6f * nextRandom();
+        float b = 0.2f + 0.6f * nextRandom();
+        sphere.color = vec4(r, g, b, 1.0f);
+        sphere.Ka = 0.2f;
+        sphere.Kd = 0.6f;
+        sphere.Ks = 0.4f;
+        sphere.Kr = reflectivity;
+        sphere.specularExponent = 30;
+        g_spheres.push_back(sphere);
+        g_sphereIds.push_back("s" + to_string(i));
+    }
+
+    Light light;
+    light.radius = 0;
+    light.position = vec4(0.0f, 10.0f, 0.0f, 1.0f);
+    light.color = vec4(0.8f, 0.8f, 0.8f, 0.0f);
+    g_lights.push_back(light);
+    g_lightIds.push_back("l1");
+    light.position = vec4(-10.0f, 5.0f, -5.0f, 1.0f);
+    light.color = vec4(0.4f, 0.4f, 0.6f, 0.0f);
+    g_lights.push_back(light);
+    g_lightIds.push_back("l2");
+
+    prepareScene();
+}
+
+/**
+ * Rays from the eye, hitRatio of them aimed near a sphere center and the
+ * rest at points between four spheres that no sphere covers. Interior rays
+ * instead start at a sphere center, as reflection rays, and always hit it
+ * from inside.
+ */
+static vector<Ray> makeRays(int count, float hitRatio, bool interior) {
+    int sphereCount = (int) g_spheres.size();
+    vector<Ray> rays;
+    for (int i = 0; i < count; i++) {
+        const Sphere &sphere = g_spheres[(int) (nextRandom() * sphereCount) % sphereCount];
+        Ray ray;
+        ray.reflectionLevel = 0;
+        ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+        if (interior) {
+            vec4 dir;
+            do {
+                dir = vec4(2 * nextRandom() - 1, 2 * nextRandom() - 1, 2 * nextRandom() - 1, 0.0f);
+            } while (dot(dir, dir) > 1 || dot(dir, dir) < 1e-4f);
+            ray.origin = sphere.position;
+            ray.dir = normalize(dir);
+            ray.reflectionLevel = 1;
+        } else if (nextRandom() < hitRatio) {
+            vec4 target = sphere.position + vec4(0.5f * (nextRandom() - 0.5f), 0.5f * (nextRandom() - 0.5f), 0, 0);
+            ray.dir = normalize(target - ray.origin);
+        } else {
+            vec4 gap = sphere.position + vec4(SPHERE_SPACING * 0.5f, SPHERE_SPACING * 0.5f, 0, 0);
+            ray.dir = normalize(gap - ray.origin);
+        }
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+static string describe(int spheres, float hitRatio, bool interior) {
+    char text[128];
+    snprintf(text, sizeof(text), "\"spheres\": %d, \"hit_ratio\": %.2f, \"interior\": %s", spheres, hitRatio,
+             interior ? "true" : "false");
+    return text;
+}
+
+
+// -------------------------------------------------------------------
+// Hardware counters
+
+#define CACHE_COUNTER_COUNT 2
+
+static const char *const s_cacheCounterNames[CACHE_COUNTER_COUNT] = {"llc_misses", "l1d_read_misses"};
+
+/**
+ * Cache misses of the calling thread, counted by the CPU through
+ * perf_event_open(). A counter is -1 where the kernel or the CPU does not
+ * allow it, as in most containers and everywhere but Linux.
+ */
+struct CacheCounters {
+    int fds[CACHE_COUNTER_COUNT];
+};
+
+static void openCacheCounters(CacheCounters &counters) {
+    for (int c = 0; c < CACHE_COUNTER_COUNT; c++) {
+        counters.fds[c] = -1;
+    }
+#ifdef __linux__
+    for (int c = 0; c < CACHE_COUNTER_COUNT; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        if (c == 0) {
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        } else {
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters.fds[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void startCacheCounters(const CacheCounters &counters) {
+#ifdef __linux__
+    for (int c = 0; c < CACHE_COUNTER_COUNT; c++) {
+        if (counters.fds[c] >= 0) {
+            ioctl(counters.fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters.fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/**
+ * Stop the counters and describe their counts per op as JSON members,
+ * null for counters that are not available.
+ */
+static string stopCacheCounters(const CacheCounters &counters, double ops) {
+    string members;
+    for (int c = 0; c < CACHE_COUNTER_COUNT; c++) {
+        long long count = -1;
+#ifdef __linux__
+        if (counters.fds[c] >= 0) {
+            ioctl(counters.fds[c], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters.fds[c], &count, sizeof(count)) != (ssize_t) sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        char member[64];
+        if (count >= 0) {
+            snprintf(member, sizeof(member), "\"%s_per_op\": %.4f", s_cacheCounterNames[c], count / ops);
+        } else {
+            snprintf(member, sizeof(member), "\"%s_per_op\": null", s_cacheCounterNames[c]);
+        }
+        members += (members.empty() ? "" : ", ") + string(member);
+    }
+    return members;
+}
+
+static void closeCacheCounters(CacheCounters &counters) {
+    for (int c = 0; c < CACHE_COUNTER_COUNT; c++) {
+#ifdef __linux__
+        if (counters.fds[c] >= 0) {
+            close(counters.fds[c]);
+        }
+#endif
+        counters.fds[c] = -1;
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Benchmarks
+
+#define RAY_SET_SIZE 4096
+
+static void benchIntersection(int sphereCount, double seconds) {
+    buildScene(sphereCount, 0);
+    const float hitRatios[] = {0.0f, 0.5f, 1.0f};
+    for (float hitRatio : hitRatios) {
+        vector<Ray> rays = makeRays(RAY_SET_SIZE, hitRatio, false);
+        measure("intersect", describe(sphereCount, hitRatio, false), true, seconds, RAY_SET_SIZE, [&](int i) {
+            s_sink = calculateNearestIntersection(rays[i]).distance;
+        });
+    }
+    vector<Ray> rays = makeRays(RAY_SET_SIZE, 1.0f, true);
+    measure("intersect", describe(sphereCount, 1.0f, true), true, seconds, RAY_SET_SIZE, [&](int i) {
+        s_sink = calculateNearestIntersection(rays[i]).distance;
+    });
+}
+
+/**
+ * Blinn-Phong shading of precomputed hits with both lights' shadow rays,
+ * without reflections.
+ */
+static void benchShading(int sphereCount, double seconds) {
+    buildScene(sphereCount, 0);
+    vector<Ray> rays = makeRays(RAY_SET_SIZE, 1.0f, false);
+    vector<Intersection> hits;
+    for (const Ray &ray : rays) {
+        hits.push_back(calculateNearestIntersection(ray));
+    }
+    measure("shade", describe(sphereCount, 1.0f, false) + ", \"lights\": 2", true, seconds, RAY_SET_SIZE,
+            [&](int i) { s_sink = shade(rays[i], hits[i]).x; });
+}
+
+/**
+ * Whole trace() calls on reflective spheres, allowed up to the given number
+ * of bounces by starting the rays that many levels below MAX_REFLECTIONS.
+ */
+static void benchTrace(int sphereCount, double seconds) {
+    buildScene(sphereCount, 0.5f);
+    for (int bounces = 0; bounces < MAX_REFLECTIONS; bounces++) {
+        vector<Ray> rays = makeRays(RAY_SET_SIZE, 0.5f, false);
+        for (Ray &ray : rays) {
+            ray.reflectionLevel = MAX_REFLECTIONS - 1 - bounces;
+        }
+        char parameters[160];
+        snprintf(parameters, sizeof(parameters), "%s, \"reflection_levels\": %d",
+                 describe(sphereCount, 0.5f, false).c_str(), bounces);
+        measure("trace", parameters, true, seconds, RAY_SET_SIZE, [&](int i) { s_sink = trace(rays[i]).x; });
+    }
+}
+
+#define MATRIX_SET_SIZE 1024
+
+static void benchMatrices(double seconds) {
+    vector<mat4> matrices;
+    vector<vec4> vectors;
+    for (int i = 0; i < MATRIX_SET_SIZE; i++) {
+        matrices.push_back(Translate(nextRandom(), nextRandom(), nextRandom()) * RotateY(360 * nextRandom()) *
+                           Scale(0.5f + nextRandom(), 0.5f + nextRandom(), 0.5f + nextRandom()));
+        vectors.push_back(vec4(nextRandom(), nextRandom(), nextRandom(), 1.0f));
+    }
+
+    mat4 inverse;
+    measure("invert", "\"matrix\": \"affine\"", false, seconds, MATRIX_SET_SIZE, [&](int i) {
+        InvertMatrix(matrices[i], inverse);
+        s_sink = inverse[0][0];
+    });
+    measure("mat4_vec4", "\"matrix\": \"affine\"", false, seconds, MATRIX_SET_SIZE, [&](int i) {
+        s_sink = (matrices[i] * vectors[i]).x;
+    });
+}
+
+/**
+ * Encoding of a rendered image in each output format from each framebuffer
+ * format, per pixel, on one thread and on all of them. PPM from rgb32f on
+ * one thread is the serial baseline; the rgb32f and rgb16f cases include
+ * the quantize kernel, rgb8 ones only copy.
+ */
+static void benchImageOutput(double seconds) {
+    buildScene(256, 0.5f);
+    g_width = 1024;
+    g_height = 1024;
+
+    vector<int> threadCounts = {1};
+    if (renderThreadCount() > 1) {
+        threadCounts.push_back(renderThreadCount());
+    }
+    int pixels = g_width * g_height;
+    vector<unsigned char> image;
+    for (int f = 0; f < FRAMEBUFFER_FORMAT_COUNT; f++) {
+        g_framebufferFormat = (FramebufferFormat) f;
+        render();
+        for (const char *format : {"ppm", "pfm", "png"}) {
+            const ImageEncoder *encoder = findImageEncoder(format);
+            for (int threads : threadCounts) {
+                double start = now();
+                int images = 0;
+                do {
+                    encoder->encode(g_framebuffer, threads, image);
+                    s_sink = image[image.size() / 2];
+                    images++;
+                } while (now() - start < seconds);
+                double elapsed = now() - start;
+
+                BenchResult result;
+                result.name = "encode";
+                result.parameters = string("\"format\": \"") + format + "\", \"framebuffer\": \"" +
+                                    framebufferFormatName(g_framebufferFormat) + "\", \"threads\": " +
+                                    to_string(threads) + ", \"width\": 1024, \"height\": 1024" +
+                                    ", \"framebuffer_bytes\": " + to_string(g_framebuffer.size()) +
+                                    ", \"bytes\": " + to_string(image.size());
+                result.nsPerOp = elapsed * 1e9 / ((double) images * pixels);
+                result.opsPerSec = (double) images * pixels / elapsed;
+                result.rays = false;
+                s_results.push_back(result);
+                fprintf(stderr, "%-10s %-52s %10.1f ns/op\n", result.name.c_str(), result.parameters.c_str(),
+                        result.nsPerOp);
+            }
+        }
+    }
+    g_framebufferFormat = FRAMEBUFFER_RGB32F;
+}
+
+/**
+ * Whole renders of a wide image in each pixel order, on reflective and
+ * matte spheres through the BVH, per primary ray. The frustum takes in the
+ * whole lattice, so rows cross many spheres. One thread is measured with
+ * the cache counters, all of them without: the counters only see the
+ * calling thread.
+ */
+static void benchPixelOrder(int sphereCount, double seconds) {
+    vector<int> threadCounts = {1};
+    int allThreads = renderThreadCount();
+    if (allThreads > 1) {
+        threadCounts.push_back(allThreads);
+    }
+    int savedThreadCount = g_threadCount;
+
+    for (float reflectivity : {0.0f, 0.8f}) {
+        buildScene(sphereCount, reflectivity);
+        g_accelerator = ACCEL_BVH;
+        prepareScene();
+        g_width = 1024;
+        g_height = 1024;
+        int side = 1;
+        while (side * side < sphereCount) {
+            side++;
+        }
+        float extent = (side * SPHERE_SPACING * 0.5f) / SPHERE_PLANE;
+        g_left = g_bottom = -extent;
+        g_right = g_top = extent;
+
+        for (int threads : threadCounts) {
+            g_threadCount = threads;
+            for (int order = 0; order < PIXEL_ORDER_COUNT; order++) {
+                g_pixelOrder = (PixelOrder) order;
+                render(); // Warm up
+
+                CacheCounters counters;
+                if (threads == 1) {
+                    openCacheCounters(counters);
+                    startCacheCounters(counters);
+                }
+                double start = now();
+                int images = 0;
+                do {
+                    render();
+                    images++;
+                } while (now() - start < seconds);
+                double elapsed = now() - start;
+                double rays = (double) images * g_width * g_height;
+
+                BenchResult result;
+                result.name = "render";
+                char parameters[200];
+                snprintf(parameters, sizeof(parameters),
+                         "\"order\": \"%s\", \"spheres\": %d, \"reflectivity\": %.1f, \"max_reflections\": %d, "
+                         "\"threads\": %d, \"width\": %d, \"height\": %d",
+                         pixelOrderName(g_pixelOrder), sphereCount, reflectivity, MAX_REFLECTIONS, threads, g_width,
+                         g_height);
+                result.parameters = parameters;
+                result.nsPerOp = elapsed * 1e9 / rays;
+                result.opsPerSec = rays / elapsed;
+                result.rays = true;
+                if (threads == 1) {
+                    result.counters = stopCacheCounters(counters, rays);
+                    closeCacheCounters(counters);
+                }
+                s_results.push_back(result);
+                fprintf(stderr, "%-10s %-52s %10.1f ns/op %s\n", result.name.c_str(), result.parameters.c_str(),
+                        result.nsPerOp, result.counters.c_str());
+            }
+        }
+    }
+    g_threadCount = savedThreadCount;
+    g_pixelOrder = PIXEL_ORDER_ROWS;
+}
+
+
+// -------------------------------------------------------------------
+// Output
+
+static void printJSON() {
+    printf("{\n");
+    printf("  \"simd\": \"%s\",\n", g_simdKernels != NULL ? g_simdKernels->name : "off");
+    printf("  \"benchmarks\": [\n");
+    for (size_t i = 0; i < s_results.size(); i++) {
+        const BenchResult &result = s_results[i];
+        printf("    {\"name\": \"%s\", %s, \"ns_per_op\": %.3f, \"%s\": %.1f%s%s}%s\n", result.name.c_str(),
+               result.parameters.c_str(), result.nsPerOp, result.rays ? "rays_per_sec" : "ops_per_sec",
+               result.opsPerSec, result.counters.empty() ? "" : ", ", result.counters.c_str(),
+               i + 1 < s_results.size() ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 0.5;
+    vector<int> sphereCounts = {16, 256};
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+            g_simdISA = argv[++i];
+        } else if (strcmp(argv[i], "--spheres") == 0 && i + 1 < argc) {
+            sphereCounts = {max(atoi(argv[++i]), 1)};
+        } else {
+            fprintf(stderr, "Usage: raytracer_bench [--seconds S] [--simd ISA] [--spheres N]\n");
+            exit(1);
+        }
+    }
+
+    for (int sphereCount : sphereCounts) {
+        benchIntersection(sphereCount, seconds);
+    }
+    for (int sphereCount : sphereCounts) {
+        benchShading(sphereCount, seconds);
+    }
+    for (int sphereCount : sphereCounts) {
+        benchTrace(sphereCount, seconds);
+    }
+    benchMatrices(seconds);
+    benchImageOutput(seconds);
+    for (int sphereCount : sphereCounts) {
+        benchPixelOrder(sphereCount, seconds);
+    }
+
+    printJSON();
+    return 0;
+}
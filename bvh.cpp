@@ -0,0 +1,469 @@
+#include "bvh.h"
+#include "render_stats.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// SAH cost of visiting a node relative to testing one sphere
+#define BVH_TRAVERSAL_COST 1.0f
+
+
+// -------------------------------------------------------------------
+// Building
+
+static SphereBounds emptyBounds() {
+    SphereBounds b;
+    for (int k = 0; k < 3; k++) {
+        b.min[k] = INFINITY;
+        b.max[k] = -INFINITY;
+    }
+    return b;
+}
+
+static void growBounds(SphereBounds &b, const SphereBounds &o) {
+    for (int k = 0; k < 3; k++) {
+        b.min[k] = fminf(b.min[k], o.min[k]);
+        b.max[k] = fmaxf(b.max[k], o.max[k]);
+    }
+}
+
+static void growBounds(SphereBounds &b, const float *p) {
+    for (int k = 0; k < 3; k++) {
+        b.min[k] = fminf(b.min[k], p[k]);
+        b.max[k] = fmaxf(b.max[k], p[k]);
+    }
+}
+
+static float surfaceArea(const SphereBounds &b) {
+    float dx = b.max[0] - b.min[0];
+    float dy = b.max[1] - b.min[1];
+    float dz = b.max[2] - b.min[2];
+    if (dx < 0 || dy < 0 || dz < 0) {
+        return 0;
+    }
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+struct BVHBuilder {
+    const vector<SphereBounds> &bounds;
+    vector<float> centroids;        // Three floats per sphere
+    BVH &bvh;
+
+    BVHBuilder(const vector<SphereBounds> &bounds, BVH &bvh) : bounds(bounds), bvh(bvh) { }
+
+    const float *centroid(int sphere) const { return &centroids[sphere * 3]; }
+
+    void makeLeaf(int nodeIndex, int first, int count) {
+        bvh.nodes[nodeIndex].first = first;
+        bvh.nodes[nodeIndex].count = count;
+    }
+
+    /**
+     * Reorder primitives[first .. first + count) around the object median on
+     * the given axis. Returns the size of the left half.
+     */
+    int splitMedian(int first, int count, int axis) {
+        int half = count / 2;
+        vector<int>::iterator begin = bvh.primitives.begin() + first;
+        nth_element(begin, begin + half, begin + count, [&](int a, int b) {
+            return centroid(a)[axis] < centroid(b)[axis];
+        });
+        return half;
+    }
+
+    /**
+     * Find the cheapest binned SAH split. Returns the split cost, or
+     * infinity if the centroids cannot be separated.
+     */
+    float findSAHSplit(int first, int count, const SphereBounds &centroidBounds, int &bestAxis, int &bestBin) {
+        float bestCost = INFINITY;
+
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = centroidBounds.min[axis];
+            float extent = centroidBounds.max[axis] - lo;
+            if (!(extent > 0)) {
+                continue;
+            }
+            float scale = BVH_SAH_BINS / extent;
+
+            int binCount[BVH_SAH_BINS] = {0};
+            SphereBounds binBounds[BVH_SAH_BINS];
+            for (int b = 0; b < BVH_SAH_BINS; b++) {
+                binBounds[b] = emptyBounds();
+            }
+            for (int i = first; i < first + count; i++) {
+                int sphere = bvh.primitives[i];
+                int b = min((int) ((centroid(sphere)[axis] - lo) * scale), BVH_SAH_BINS - 1);
+                binCount[b]++;
+                growBounds(binBounds[b], bounds[sphere]);
+            }
+
+            // Sweep from the right to get the cost of every right side, then
+            // from the left to combine them
+            float rightArea[BVH_SAH_BINS];
+            int rightCount[BVH_SAH_BINS];
+            SphereBounds right = emptyBounds();
+            int n = 0;
+            for (int b = BVH_SAH_BINS - 1; b > 0; b--) {
+                growBounds(right, binBounds[b]);
+                n += binCount[b];
+                rightArea[b] = surfaceArea(right);
+                rightCount[b] = n;
+            }
+
+            SphereBounds left = emptyBounds();
+            n = 0;
+            for (int b = 1; b < BVH_SAH_BINS; b++) {
+                growBounds(left, binBounds[b - 1]);
+                n += binCount[b - 1];
+                if (n == 0 || rightCount[b] == 0) {
+                    continue;
+                }
+                float cost = surfaceArea(left) * n + rightArea[b] * rightCount[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        return bestCost;
+    }
+
+    void build(int nodeIndex, int first, int count, int depth) {
+        SphereBounds nodeBounds = emptyBounds();
+        SphereBounds centroidBounds = emptyBounds();
+        for (int i = first; i < first + count; i++) {
+            int sphere = bvh.primitives[i];
+            growBounds(nodeBounds, bounds[sphere]);
+            growBounds(centroidBounds, centroid(sphere));
+        }
+        BVHNode &node = bvh.nodes[nodeIndex];
+        for (int k = 0; k < 3; k++) {
+            node.bounds[0][k] = nodeBounds.min[k];
+            node.bounds[1][k] = nodeBounds.max[k];
+        }
+
+        if (count <= 1) {
+            makeLeaf(nodeIndex, first, count);
+            return;
+        }
+
+        int leftCount = 0;
+        if (depth < BVH_SAH_MAX_DEPTH) {
+            int axis = 0;
+            int bin = 0;
+            float splitCost = findSAHSplit(first, count, centroidBounds, axis, bin);
+            float area = surfaceArea(nodeBounds);
+            splitCost += BVH_TRAVERSAL_COST * area;
+
+            if (count <= BVH_MAX_LEAF_SIZE && area * count <= splitCost) {
+                makeLeaf(nodeIndex, first, count);
+                return;
+            }
+            if (splitCost < INFINITY) {
+                float lo = centroidBounds.min[axis];
+                float scale = BVH_SAH_BINS / (centroidBounds.max[axis] - lo);
+                vector<int>::iterator begin = bvh.primitives.begin() + first;
+                vector<int>::iterator middle = partition(begin, begin + count, [&](int sphere) {
+                    return min((int) ((centroid(sphere)[axis] - lo) * scale), BVH_SAH_BINS - 1) < bin;
+                });
+                leftCount = (int) (middle - begin);
+            }
+        }
+
+        if (leftCount == 0 || leftCount == count) {
+            if (count <= BVH_MAX_LEAF_SIZE) {
+                makeLeaf(nodeIndex, first, count);
+                return;
+            }
+            // No usable SAH split, or too deep for one: fall back to the median
+            int axis = 0;
+            for (int k = 1; k < 3; k++) {
+                if (centroidBounds.max[k] - centroidBounds.min[k] >
+                    centroidBounds.max[axis] - centroidBounds.min[axis]) {
+                    axis = k;
+                }
+            }
+            leftCount = splitMedian(first, count, axis);
+        }
+
+        int child = (int) bvh.nodes.size();
+        bvh.nodes.push_back(BVHNode());
+        bvh.nodes.push_back(BVHNode());
+        bvh.nodes[nodeIndex].first = child;
+        bvh.nodes[nodeIndex].count = 0;
+
+        build(child, first, leftCount, depth + 1);
+        build(child + 1, first + leftCount, count - leftCount, depth + 1);
+    }
+};
+
+void buildBVH(const vector<SphereBounds> &bounds, BVH &bvh) {
+    int count = (int) bounds.size();
+
+    bvh.nodes.clear();
+    bvh.primitives.resize((unsigned int) count);
+    for (int i = 0; i < count; i++) {
+        bvh.primitives[i] = i;
+    }
+    bvh.nodes.reserve((unsigned int) max(1, 2 * count - 1));
+    bvh.nodes.push_back(BVHNode());
+
+    BVHBuilder builder(bounds, bvh);
+    builder.centroids.resize((unsigned int) count * 3);
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < 3; k++)
+            builder.centroids[i * 3 + k] = 0.5f * (bounds[i].min[k] + bounds[i].max[k]);
+
+    builder.build(0, 0, count, 0);
+}
+
+void refitBVH(const vector<SphereBounds> &bounds, BVH &bvh) {
+    // Children are always stored after their parent, so sweeping backwards
+    // finishes both children of a node before the node itself
+    for (int n = (int) bvh.nodes.size() - 1; n >= 0; n--) {
+        BVHNode &node = bvh.nodes[n];
+        SphereBounds nodeBounds = emptyBounds();
+        // Interior nodes point forward; an empty tree's root is a leaf without spheres
+        bool leaf = node.count > 0 || node.first <= n;
+        if (leaf) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                growBounds(nodeBounds, bounds[bvh.primitives[i]]);
+            }
+        } else {
+            for (int c = node.first; c <= node.first + 1; c++) {
+                SphereBounds child;
+                for (int k = 0; k < 3; k++) {
+                    child.min[k] = bvh.nodes[c].bounds[0][k];
+                    child.max[k] = bvh.nodes[c].bounds[1][k];
+                }
+                growBounds(nodeBounds, child);
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            node.bounds[0][k] = nodeBounds.min[k];
+            node.bounds[1][k] = nodeBounds.max[k];
+        }
+    }
+}
+
+float bvhCost(const BVH &bvh) {
+    if (bvh.nodes.empty()) {
+        return 0;
+    }
+
+    double cost = 0;
+    for (const BVHNode &node : bvh.nodes) {
+        SphereBounds b;
+        for (int k = 0; k < 3; k++) {
+            b.min[k] = node.bounds[0][k];
+            b.max[k] = node.bounds[1][k];
+        }
+        cost += (double) surfaceArea(b) * (node.count > 0 ? node.count : BVH_TRAVERSAL_COST);
+    }
+
+    SphereBounds root;
+    for (int k = 0; k < 3; k++) {
+        root.min[k] = bvh.nodes[0].bounds[0][k];
+        root.max[k] = bvh.nodes[0].bounds[1][k];
+    }
+    float rootArea = surfaceArea(root);
+    return rootArea > 0 ? (float) (cost / rootArea) : 0;
+}
+
+
+// -------------------------------------------------------------------
+// Traversal
+
+bool intersectSphereSlot(const SphereStore &store, const SphereQuery &query, int slot, float &distance,
+                         bool &interiorPoint) {
+    STATS_ADD(sphereTests, 1);
+
+    // S = inverseTransform * (position - origin), C = inverseTransform * dir
+    float isx = store.inverseScale[0][slot];
+    float isy = store.inverseScale[1][slot];
+    float isz = store.inverseScale[2][slot];
+    float sx = isx * (store.center[0][slot] - query.origin[0]);
+    float sy = isy * (store.center[1][slot] - query.origin[1]);
+    float sz = isz * (store.center[2][slot] - query.origin[2]);
+    float cx = isx * query.dir[0];
+    float cy = isy * query.dir[1];
+    float cz = isz * query.dir[2];
+
+    // Quadratic equation: |c|^2t^2 + 2(S.tc) + |S|^2 - 1
+    float a = cx * cx + cy * cy + cz * cz;
+    float b = sx * cx + sy * cy + sz * cz;
+    float c = sx * sx + sy * sy + sz * sz - 1;
+    float discriminant = b * b - a * c;
+
+    if (discriminant < 0) {
+        return false;
+    }
+
+    float solution;
+    interiorPoint = false;
+    if (discriminant == 0) {
+        solution = b / a;
+    } else {
+        float root = sqrtf(discriminant);
+        float solution1 = (b - root) / a;
+        float solution2 = (b + root) / a;
+
+        // Same operand order as minps/maxps in the kernel
+        solution = solution1 < solution2 ? solution1 : solution2;
+        if (solution <= query.minHitTime) {
+            solution = solution1 > solution2 ? solution1 : solution2;
+            interiorPoint = true;
+        }
+    }
+
+    if (solution <= query.minHitTime) {
+        return false;
+    }
+    distance = solution;
+    return true;
+}
+
+/**
+ * Slab test of a node. Returns whether the ray enters the box before
+ * cutoff and after the minimum hit time, and the entry time.
+ */
+static bool intersectNode(const BVHNode &node, const SphereQuery &query, const float *inverseDir, float cutoff,
+                          float &entry) {
+    float tNear = -INFINITY;
+    float tFar = INFINITY;
+    for (int k = 0; k < 3; k++) {
+        float t1 = (node.bounds[0][k] - query.origin[k]) * inverseDir[k];
+        float t2 = (node.bounds[1][k] - query.origin[k]) * inverseDir[k];
+        // Plain compares rather than fminf/fmaxf, which are library calls
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+    entry = tNear;
+    return tNear <= tFar && tFar >= query.minHitTime && tNear <= cutoff;
+}
+
+/**
+ * Reciprocal ray direction for the slab test, keeping zero components away
+ * from 0 * inf.
+ */
+static void inverseDirection(const SphereQuery &query, float *inverseDir) {
+    for (int k = 0; k < 3; k++) {
+        float d = query.dir[k];
+        if (fabsf(d) < 1e-20f) {
+            d = d < 0 ? -1e-20f : 1e-20f;
+        }
+        inverseDir[k] = 1.0f / d;
+    }
+}
+
+void intersectBVH(const BVH &bvh, const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    hit.distance = -1;
+    hit.interiorPoint = false;
+    if (bvh.nodes.empty() || bvh.primitives.empty()) {
+        return;
+    }
+
+    float inverseDir[3];
+    inverseDirection(query, inverseDir);
+
+    const BVHNode *nodes = bvh.nodes.data();
+    int stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int top = 0;
+    float cutoff = INFINITY;
+
+    float entry;
+    if (!intersectNode(nodes[0], query, inverseDir, cutoff, entry)) {
+        return;
+    }
+    stack[top] = 0;
+    stackEntry[top++] = entry;
+
+    while (top > 0) {
+        top--;
+        if (stackEntry[top] > cutoff) {
+            continue;
+        }
+        const BVHNode &node = nodes[stack[top]];
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                int slot = bvh.primitives[i];
+                float distance;
+                bool interiorPoint;
+                if (!intersectSphereSlot(store, query, slot, distance, interiorPoint)) {
+                    continue;
+                }
+                // Ties go to the lowest slot, as in the sphere block kernel
+                if (hit.distance == -1 || distance < hit.distance ||
+                    (distance == hit.distance && slot < hit.slot)) {
+                    hit.distance = distance;
+                    hit.slot = slot;
+                    hit.interiorPoint = interiorPoint;
+                    cutoff = distance;
+                }
+            }
+            continue;
+        }
+
+        float entryLeft, entryRight;
+        bool hitLeft = intersectNode(nodes[node.first], query, inverseDir, cutoff, entryLeft);
+        bool hitRight = intersectNode(nodes[node.first + 1], query, inverseDir, cutoff, entryRight);
+        if (hitLeft && hitRight) {
+            // Push the far child first so the near one is popped next
+            bool leftFirst = entryLeft <= entryRight;
+            stack[top] = leftFirst ? node.first + 1 : node.first;
+            stackEntry[top++] = leftFirst ? entryRight : entryLeft;
+            stack[top] = leftFirst ? node.first : node.first + 1;
+            stackEntry[top++] = leftFirst ? entryLeft : entryRight;
+        } else if (hitLeft) {
+            stack[top] = node.first;
+            stackEntry[top++] = entryLeft;
+        } else if (hitRight) {
+            stack[top] = node.first + 1;
+            stackEntry[top++] = entryRight;
+        }
+    }
+}
+
+int findOccluderBVH(const BVH &bvh, const SphereStore &store, const SphereQuery &query) {
+    if (bvh.nodes.empty() || bvh.primitives.empty()) {
+        return -1;
+    }
+
+    float inverseDir[3];
+    inverseDirection(query, inverseDir);
+
+    const BVHNode *nodes = bvh.nodes.data();
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        const BVHNode &node = nodes[stack[--top]];
+        float entry;
+        if (!intersectNode(node, query, inverseDir, query.maxDistance, entry)) {
+            continue;
+        }
+
+        if (node.count > 0) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                int slot = bvh.primitives[i];
+                float distance;
+                bool interiorPoint;
+                if (intersectSphereSlot(store, query, slot, distance, interiorPoint) &&
+                    distance < query.maxDistance) {
+                    return slot;
+                }
+            }
+        } else {
+            stack[top++] = node.first + 1;
+            stack[top++] = node.first;
+        }
+    }
+    return -1;
+}
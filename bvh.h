@@ -0,0 +1,76 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- bvh.h ---
+//
+//  Bounding volume hierarchy over the spheres, built with the surface area
+//  heuristic, and its nearest-hit traversal for single rays. Primary ray
+//  packets traverse the same nodes in packet_kernel.h.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "simd.h"
+#include <vector>
+
+// Depth after which nodes are split at the object median instead of by SAH,
+// which bounds the depth to this plus log2 of the sphere count
+#define BVH_SAH_MAX_DEPTH 48
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_SAH_BINS 16
+
+struct SphereBounds {
+    float min[3];
+    float max[3];
+};
+
+struct BVH {
+    std::vector<BVHNode> nodes;     // nodes[0] is the root
+    std::vector<int> primitives;    // Sphere indices, grouped by leaf
+};
+
+/**
+ * Build a BVH over the given sphere bounds. bounds[i] must contain every
+ * point where a ray can hit sphere i.
+ */
+void buildBVH(const std::vector<SphereBounds> &bounds, BVH &bvh);
+
+/**
+ * Recompute every node's box from new bounds for the same spheres, keeping
+ * the tree's shape. Much cheaper than a rebuild and traversal stays exact,
+ * but the tree gets slower to traverse as the spheres drift away from where
+ * it was built; compare bvhCost() against the cost after the last build to
+ * decide when to rebuild instead.
+ */
+void refitBVH(const std::vector<SphereBounds> &bounds, BVH &bvh);
+
+/**
+ * Surface area heuristic cost of the tree: the expected number of node
+ * visits and sphere tests for a ray that enters the root.
+ */
+float bvhCost(const BVH &bvh);
+
+/**
+ * Nearest hit of a ray among the spheres of the BVH, tested against the
+ * sphere store. Returns the same hit as testing every sphere with the
+ * sphere block kernel, including its tie-breaking on equal distances.
+ */
+void intersectBVH(const BVH &bvh, const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+/**
+ * Any-hit query: the slot of some sphere hit after query.minHitTime and
+ * before query.maxDistance, or -1. Visits nodes in no particular order and
+ * stops at the first blocker.
+ */
+int findOccluderBVH(const BVH &bvh, const SphereStore &store, const SphereQuery &query);
+
+/**
+ * Scalar test of one store slot, with the same arithmetic as the sphere
+ * block kernel. Returns false if the ray does not hit the sphere after
+ * query.minHitTime.
+ */
+bool intersectSphereSlot(const SphereStore &store, const SphereQuery &query, int slot, float &distance,
+                         bool &interiorPoint);
+
+#endif // __BVH_H__
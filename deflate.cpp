@@ -0,0 +1,511 @@
+#include "deflate.h"
+#include <algorithm>
+#include <cstring>
+#include <queue>
+
+using namespace std;
+
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define HASH_BITS 15
+#define MAX_CHAIN 16            // Candidates tried per position; more compresses a little better, slower
+#define BLOCK_TOKENS 32768      // Literals and matches per Huffman block
+#define MAX_STORED 65535
+
+#define LITERAL_CODES 286
+#define DISTANCE_CODES 30
+#define LENGTH_CODES 19
+#define MAX_CODE_BITS 15
+#define MAX_LENGTH_CODE_BITS 7
+
+static const int s_lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67,
+                                     83, 99, 115, 131, 163, 195, 227, 258};
+static const int s_lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5,
+                                      5, 5, 0};
+static const int s_distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+                                       769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const int s_distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+                                        11, 11, 12, 12, 13, 13};
+// Order in which the code length code lengths are sent
+static const int s_lengthCodeOrder[LENGTH_CODES] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1,
+                                                    15};
+
+/**
+ * Length and distance code of every match length and distance, and the
+ * CRC-32 table.
+ */
+struct CodeTables {
+    unsigned char lengthCode[MAX_MATCH + 1];
+    unsigned char distanceCode[WINDOW_SIZE + 1];
+    unsigned int crc[256];
+
+    CodeTables() {
+        for (int code = 0; code < 29; code++) {
+            int end = code + 1 < 29 ? s_lengthBase[code + 1] : MAX_MATCH + 1;
+            for (int length = s_lengthBase[code]; length < end; length++) {
+                lengthCode[length] = (unsigned char) code;
+            }
+        }
+        for (int code = 0; code < 30; code++) {
+            int end = code + 1 < 30 ? s_distanceBase[code + 1] : WINDOW_SIZE + 1;
+            for (int distance = s_distanceBase[code]; distance < end; distance++) {
+                distanceCode[distance] = (unsigned char) code;
+            }
+        }
+        for (unsigned int n = 0; n < 256; n++) {
+            unsigned int c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc[n] = c;
+        }
+    }
+};
+
+static const CodeTables &codeTables() {
+    static const CodeTables tables;
+    return tables;
+}
+
+
+// -------------------------------------------------------------------
+// Huffman codes
+
+/**
+ * Lengths of an optimal prefix code for freq, none longer than maxBits.
+ * Unused symbols get length 0. A lone used symbol is paired with an unused
+ * one, since decoders reject incomplete code length codes.
+ */
+static void buildCodeLengths(const unsigned int *freq, int count, int maxBits, unsigned char *lengths) {
+    memset(lengths, 0, (size_t) count);
+    vector<int> symbols;
+    for (int s = 0; s < count; s++) {
+        if (freq[s] > 0) {
+            symbols.push_back(s);
+        }
+    }
+    if (symbols.size() <= 1) {
+        if (!symbols.empty()) {
+            lengths[symbols[0]] = 1;
+            lengths[symbols[0] == 0 ? 1 : 0] = 1;
+        }
+        return;
+    }
+
+    // Plain Huffman tree: nodes below symbols.size() are the leaves
+    int leaves = (int) symbols.size();
+    vector<int> parent((size_t) leaves * 2 - 1, -1);
+    typedef pair<unsigned long long, int> Weighted;
+    priority_queue<Weighted, vector<Weighted>, greater<Weighted> > queue;
+    for (int i = 0; i < leaves; i++) {
+        queue.push(Weighted(freq[symbols[i]], i));
+    }
+    int next = leaves;
+    while (queue.size() > 1) {
+        Weighted a = queue.top();
+        queue.pop();
+        Weighted b = queue.top();
+        queue.pop();
+        parent[a.second] = parent[b.second] = next;
+        queue.push(Weighted(a.first + b.first, next++));
+    }
+
+    // Depth of each leaf, then how many leaves end at each depth
+    vector<int> depth(parent.size(), 0);
+    for (int node = next - 2; node >= 0; node--) {
+        depth[node] = depth[parent[node]] + 1;
+    }
+    vector<int> lengthCounts((size_t) max(maxBits, leaves) + 1, 0);
+    for (int i = 0; i < leaves; i++) {
+        lengthCounts[min(depth[i], maxBits)]++;
+    }
+
+    // Clamping made the code oversubscribed: move leaves up until it fits
+    unsigned long long total = 0;
+    for (int bits = 1; bits <= maxBits; bits++) {
+        total += (unsigned long long) lengthCounts[bits] << (maxBits - bits);
+    }
+    while (total > (1ull << maxBits)) {
+        lengthCounts[maxBits]--;
+        for (int bits = maxBits - 1; bits > 0; bits--) {
+            if (lengthCounts[bits] > 0) {
+                lengthCounts[bits]--;
+                lengthCounts[bits + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // The most frequent symbols get the shortest codes
+    stable_sort(symbols.begin(), symbols.end(), [&](int a, int b) { return freq[a] > freq[b]; });
+    int s = 0;
+    for (int bits = 1; bits <= maxBits; bits++) {
+        for (int i = 0; i < lengthCounts[bits]; i++) {
+            lengths[symbols[s++]] = (unsigned char) bits;
+        }
+    }
+}
+
+/**
+ * Canonical codes for the given lengths, bit reversed because deflate sends
+ * Huffman codes starting from their most significant bit.
+ */
+static void buildCodes(const unsigned char *lengths, int count, unsigned short *codes) {
+    int lengthCounts[MAX_CODE_BITS + 1] = {0};
+    for (int s = 0; s < count; s++) {
+        lengthCounts[lengths[s]]++;
+    }
+    lengthCounts[0] = 0;
+    int nextCode[MAX_CODE_BITS + 2];
+    int code = 0;
+    for (int bits = 1; bits <= MAX_CODE_BITS; bits++) {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+    for (int s = 0; s < count; s++) {
+        int length = lengths[s];
+        if (length == 0) {
+            codes[s] = 0;
+            continue;
+        }
+        int value = nextCode[length]++;
+        int reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed = (reversed << 1) | ((value >> i) & 1);
+        }
+        codes[s] = (unsigned short) reversed;
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Block output
+
+struct BitWriter {
+    vector<unsigned char> &out;
+    unsigned long long bits;
+    int count;
+
+    explicit BitWriter(vector<unsigned char> &out) : out(out), bits(0), count(0) {
+    }
+
+    void put(unsigned int value, int n) {
+        bits |= (unsigned long long) value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back((unsigned char) bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() {
+        if (count > 0) {
+            put(0, 8 - count);
+        }
+    }
+};
+
+/**
+ * A literal (distance 0) or a match of length bytes distance back.
+ */
+struct Token {
+    unsigned short length;      // The byte itself for literals
+    unsigned short distance;
+};
+
+static void writeStoredBlocks(BitWriter &writer, const unsigned char *data, size_t size, bool last) {
+    do {
+        size_t chunk = min(size, (size_t) MAX_STORED);
+        writer.put(last && chunk == size ? 1 : 0, 1);
+        writer.put(0, 2);
+        writer.align();
+        writer.put((unsigned int) chunk, 16);
+        writer.put((unsigned int) chunk ^ 0xFFFF, 16);
+        writer.out.insert(writer.out.end(), data, data + chunk);
+        data += chunk;
+        size -= chunk;
+    } while (size > 0);
+}
+
+/**
+ * Write tokens, which encode data[0, size), as one dynamic Huffman block,
+ * or as stored blocks if that is smaller.
+ */
+static void writeBlock(BitWriter &writer, const vector<Token> &tokens, const unsigned char *data, size_t size,
+                       bool last) {
+    const CodeTables &tables = codeTables();
+
+    unsigned int literalFreq[LITERAL_CODES] = {0};
+    unsigned int distanceFreq[DISTANCE_CODES] = {0};
+    for (const Token &token : tokens) {
+        if (token.distance == 0) {
+            literalFreq[token.length]++;
+        } else {
+            literalFreq[257 + tables.lengthCode[token.length]]++;
+            distanceFreq[tables.distanceCode[token.distance]]++;
+        }
+    }
+    literalFreq[256] = 1;
+
+    unsigned char literalLengths[LITERAL_CODES];
+    unsigned char distanceLengths[DISTANCE_CODES];
+    buildCodeLengths(literalFreq, LITERAL_CODES, MAX_CODE_BITS, literalLengths);
+    buildCodeLengths(distanceFreq, DISTANCE_CODES, MAX_CODE_BITS, distanceLengths);
+    // A block of literals still needs distance codes for the header
+    if (*max_element(distanceLengths, distanceLengths + DISTANCE_CODES) == 0) {
+        distanceLengths[0] = distanceLengths[1] = 1;
+    }
+
+    int literalCount = LITERAL_CODES;
+    while (literalCount > 257 && literalLengths[literalCount - 1] == 0) {
+        literalCount--;
+    }
+    int distanceCount = DISTANCE_CODES;
+    while (distanceCount > 1 && distanceLengths[distanceCount - 1] == 0) {
+        distanceCount--;
+    }
+
+    // Run-length code both length lists as one sequence
+    unsigned char lengths[LITERAL_CODES + DISTANCE_CODES];
+    memcpy(lengths, literalLengths, (size_t) literalCount);
+    memcpy(lengths + literalCount, distanceLengths, (size_t) distanceCount);
+    int lengthCount = literalCount + distanceCount;
+    vector<pair<int, int> > runs;   // Code length symbol and the value of its extra bits
+    unsigned int lengthFreq[LENGTH_CODES] = {0};
+    for (int i = 0; i < lengthCount;) {
+        int value = lengths[i];
+        int run = 1;
+        while (i + run < lengthCount && lengths[i + run] == value) {
+            run++;
+        }
+        i += run;
+        if (value == 0) {
+            while (run >= 11) {
+                int n = min(run, 138);
+                runs.push_back(make_pair(18, n - 11));
+                run -= n;
+            }
+            if (run >= 3) {
+                runs.push_back(make_pair(17, run - 3));
+                run = 0;
+            }
+        } else {
+            runs.push_back(make_pair(value, 0));
+            run--;
+            while (run >= 3) {
+                int n = min(run, 6);
+                runs.push_back(make_pair(16, n - 3));
+                run -= n;
+            }
+        }
+        for (; run > 0; run--) {
+            runs.push_back(make_pair(value, 0));
+        }
+    }
+    for (const pair<int, int> &r : runs) {
+        lengthFreq[r.first]++;
+    }
+    unsigned char lengthLengths[LENGTH_CODES];
+    buildCodeLengths(lengthFreq, LENGTH_CODES, MAX_LENGTH_CODE_BITS, lengthLengths);
+    int orderCount = LENGTH_CODES;
+    while (orderCount > 4 && lengthLengths[s_lengthCodeOrder[orderCount - 1]] == 0) {
+        orderCount--;
+    }
+
+    // Compare with storing the bytes as they are
+    unsigned long long bits = 3 + 5 + 5 + 4 + 3 * orderCount;
+    for (const pair<int, int> &r : runs) {
+        bits += lengthLengths[r.first] + (r.first == 16 ? 2 : r.first == 17 ? 3 : r.first == 18 ? 7 : 0);
+    }
+    for (int s = 0; s < LITERAL_CODES; s++) {
+        bits += (unsigned long long) literalFreq[s] * literalLengths[s];
+        if (s > 256) {
+            bits += (unsigned long long) literalFreq[s] * s_lengthExtra[s - 257];
+        }
+    }
+    for (int s = 0; s < DISTANCE_CODES; s++) {
+        bits += (unsigned long long) distanceFreq[s] * (distanceLengths[s] + s_distanceExtra[s]);
+    }
+    unsigned long long storedBits = (size + 5 * ((size + MAX_STORED - 1) / MAX_STORED) + 1) * 8;
+    if (storedBits <= bits) {
+        writeStoredBlocks(writer, data, size, last);
+        return;
+    }
+
+    unsigned short literalCodes[LITERAL_CODES];
+    unsigned short distanceCodes[DISTANCE_CODES];
+    unsigned short lengthCodes[LENGTH_CODES];
+    buildCodes(literalLengths, LITERAL_CODES, literalCodes);
+    buildCodes(distanceLengths, DISTANCE_CODES, distanceCodes);
+    buildCodes(lengthLengths, LENGTH_CODES, lengthCodes);
+
+    writer.put(last ? 1 : 0, 1);
+    writer.put(2, 2);
+    writer.put((unsigned int) (literalCount - 257), 5);
+    writer.put((unsigned int) (distanceCount - 1), 5);
+    writer.put((unsigned int) (orderCount - 4), 4);
+    for (int i = 0; i < orderCount; i++) {
+        writer.put(lengthLengths[s_lengthCodeOrder[i]], 3);
+    }
+    for (const pair<int, int> &r : runs) {
+        writer.put(lengthCodes[r.first], lengthLengths[r.first]);
+        if (r.first >= 16) {
+            writer.put((unsigned int) r.second, r.first == 16 ? 2 : r.first == 17 ? 3 : 7);
+        }
+    }
+
+    for (const Token &token : tokens) {
+        if (token.distance == 0) {
+            writer.put(literalCodes[token.length], literalLengths[token.length]);
+            continue;
+        }
+        int lengthCode = tables.lengthCode[token.length];
+        writer.put(literalCodes[257 + lengthCode], literalLengths[257 + lengthCode]);
+        writer.put((unsigned int) (token.length - s_lengthBase[lengthCode]), s_lengthExtra[lengthCode]);
+        int distanceCode = tables.distanceCode[token.distance];
+        writer.put(distanceCodes[distanceCode], distanceLengths[distanceCode]);
+        writer.put((unsigned int) (token.distance - s_distanceBase[distanceCode]), s_distanceExtra[distanceCode]);
+    }
+    writer.put(literalCodes[256], literalLengths[256]);
+}
+
+
+// -------------------------------------------------------------------
+// Matching
+
+static inline unsigned int hashAt(const unsigned char *p) {
+    unsigned int v = (unsigned int) p[0] << 16 | (unsigned int) p[1] << 8 | p[2];
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void deflatePiece(const unsigned char *data, size_t size, bool last, vector<unsigned char> &out) {
+    BitWriter writer(out);
+    vector<int> head((size_t) 1 << HASH_BITS, -1);
+    vector<int> previous(WINDOW_SIZE, -1);     // Earlier position with the same hash, by position % WINDOW_SIZE
+    vector<Token> tokens;
+    tokens.reserve(BLOCK_TOKENS);
+
+    size_t blockStart = 0;
+    size_t pos = 0;
+    while (pos < size) {
+        int bestLength = 0;
+        int bestDistance = 0;
+        if (pos + MIN_MATCH <= size) {
+            unsigned int hash = hashAt(data + pos);
+            int maxLength = (int) min(size - pos, (size_t) MAX_MATCH);
+            int candidate = head[hash];
+            for (int chain = MAX_CHAIN; candidate >= 0 && (int) pos - candidate <= WINDOW_SIZE && chain > 0;
+                 chain--) {
+                const unsigned char *a = data + candidate;
+                const unsigned char *b = data + pos;
+                if (a[bestLength] == b[bestLength]) {
+                    int length = 0;
+                    while (length < maxLength && a[length] == b[length]) {
+                        length++;
+                    }
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = (int) pos - candidate;
+                        if (length == maxLength) {
+                            break;
+                        }
+                    }
+                }
+                int earlier = previous[candidate % WINDOW_SIZE];
+                candidate = earlier < candidate ? earlier : -1;
+            }
+            previous[pos % WINDOW_SIZE] = head[hash];
+            head[hash] = (int) pos;
+        }
+
+        Token token;
+        if (bestLength >= MIN_MATCH) {
+            token.length = (unsigned short) bestLength;
+            token.distance = (unsigned short) bestDistance;
+            for (size_t p = pos + 1; p < pos + bestLength && p + MIN_MATCH <= size; p++) {
+                unsigned int hash = hashAt(data + p);
+                previous[p % WINDOW_SIZE] = head[hash];
+                head[hash] = (int) p;
+            }
+            pos += bestLength;
+        } else {
+            token.length = data[pos];
+            token.distance = 0;
+            pos++;
+        }
+        tokens.push_back(token);
+
+        if (tokens.size() == BLOCK_TOKENS && pos < size) {
+            writeBlock(writer, tokens, data + blockStart, pos - blockStart, false);
+            tokens.clear();
+            blockStart = pos;
+        }
+    }
+    writeBlock(writer, tokens, data + blockStart, pos - blockStart, last);
+
+    if (!last) {
+        // Empty stored block: byte aligned, so the next piece can simply be appended
+        writer.put(0, 3);
+        writer.align();
+        writer.put(0, 16);
+        writer.put(0xFFFF, 16);
+    }
+    writer.align();
+}
+
+
+// -------------------------------------------------------------------
+// Checksums
+
+#define ADLER_BASE 65521
+
+unsigned int updateAdler32(unsigned int adler, const unsigned char *data, size_t size) {
+    unsigned int a = adler & 0xFFFF;
+    unsigned int b = adler >> 16;
+    while (size > 0) {
+        // The largest run whose sums cannot overflow before the modulo
+        size_t run = min(size, (size_t) 5552);
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+        data += run;
+        size -= run;
+    }
+    return b << 16 | a;
+}
+
+unsigned int combineAdler32(unsigned int first, unsigned int second, size_t secondSize) {
+    unsigned int remainder = (unsigned int) (secondSize % ADLER_BASE);
+    unsigned int a = first & 0xFFFF;
+    unsigned int b = (unsigned int) (((unsigned long long) remainder * a) % ADLER_BASE);
+    a += (second & 0xFFFF) + ADLER_BASE - 1;
+    b += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+    if (a >= ADLER_BASE) {
+        a -= ADLER_BASE;
+    }
+    if (a >= ADLER_BASE) {
+        a -= ADLER_BASE;
+    }
+    if (b >= 2 * ADLER_BASE) {
+        b -= 2 * ADLER_BASE;
+    }
+    if (b >= ADLER_BASE) {
+        b -= ADLER_BASE;
+    }
+    return b << 16 | a;
+}
+
+unsigned int updateCRC32(unsigned int crc, const unsigned char *data, size_t size) {
+    const unsigned int *table = codeTables().crc;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,48 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- deflate.h ---
+//
+//  A small deflate (RFC 1951) compressor for the PNG encoder, so image
+//  output needs no external libraries. Greedy LZ77 matching over hash
+//  chains and dynamic Huffman blocks, falling back to stored blocks for
+//  data that does not compress.
+//
+//  Pieces of one stream can be compressed independently and concatenated:
+//  every piece but the last ends byte aligned on an empty stored block,
+//  the way a zlib sync flush does, and matches never reach back across
+//  pieces.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Compress data as deflate blocks appended to out. last ends the stream
+ * with the final block; otherwise the piece ends byte aligned and another
+ * piece may follow.
+ */
+void deflatePiece(const unsigned char *data, size_t size, bool last, std::vector<unsigned char> &out);
+
+/**
+ * Adler-32 of data continued from adler (1 for a new checksum), as used by
+ * the zlib stream around deflate data.
+ */
+unsigned int updateAdler32(unsigned int adler, const unsigned char *data, size_t size);
+
+/**
+ * Adler-32 of two pieces back to back, given the checksum of each and the
+ * length of the second.
+ */
+unsigned int combineAdler32(unsigned int first, unsigned int second, size_t secondSize);
+
+/**
+ * CRC-32 of data continued from crc (0 for a new checksum), as used by PNG
+ * chunks.
+ */
+unsigned int updateCRC32(unsigned int crc, const unsigned char *data, size_t size);
+
+#endif // __DEFLATE_H__
@@ -0,0 +1,184 @@
+#include "framebuffer.h"
+#include "simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+// Pixels converted per step through the stack buffers below
+#define CONVERT_CHUNK 64
+
+static const char *const s_formatNames[FRAMEBUFFER_FORMAT_COUNT] = {"rgb32f", "rgb16f", "rgb8"};
+
+const char *framebufferFormatName(FramebufferFormat format) {
+    return s_formatNames[format];
+}
+
+bool findFramebufferFormat(const char *name, FramebufferFormat &format) {
+    for (int i = 0; i < FRAMEBUFFER_FORMAT_COUNT; i++) {
+        if (strcmp(s_formatNames[i], name) == 0) {
+            format = (FramebufferFormat) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t framebufferPixelBytes(FramebufferFormat format) {
+    switch (format) {
+        case FRAMEBUFFER_RGB16F:
+            return 3 * sizeof(unsigned short);
+        case FRAMEBUFFER_RGB8:
+            return 3;
+        default:
+            return 3 * sizeof(float);
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Half floats
+
+/**
+ * Round a float to the nearest half float, ties to even. Too large
+ * magnitudes become infinity.
+ */
+static unsigned short floatToHalf(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned short sign = (unsigned short) ((bits >> 16) & 0x8000);
+    unsigned int magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude > 0x7F800000) {
+        return (unsigned short) (sign | 0x7E00);        // NaN
+    }
+    if (magnitude >= 0x47800000) {
+        return (unsigned short) (sign | 0x7C00);        // 65536 and up, infinity included
+    }
+    if (magnitude < 0x38800000) {
+        // Subnormal: a multiple of 2^-24. Scaling by a power of two is exact and rintf() rounds ties to even
+        float scaled;
+        memcpy(&scaled, &magnitude, sizeof(scaled));
+        return (unsigned short) (sign | (unsigned short) rintf(scaled * 16777216.0f));
+    }
+
+    // Rebias the exponent from 127 to 15 and drop 13 mantissa bits; a carry
+    // out of the mantissa correctly bumps the exponent, up to infinity
+    unsigned int half = (magnitude - 0x38000000) >> 13;
+    unsigned int rest = magnitude & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;
+    }
+    return (unsigned short) (sign | half);
+}
+
+static float halfToFloat(unsigned short half) {
+    unsigned int sign = (unsigned int) (half & 0x8000) << 16;
+    unsigned int exponent = (half >> 10) & 0x1F;
+    unsigned int mantissa = half & 0x3FF;
+    unsigned int bits;
+    if (exponent == 0) {
+        float value = mantissa / 16777216.0f;
+        memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+void quantizePixels(FramebufferFormat format, const unsigned char *pixels, int count, unsigned char *out) {
+    if (format == FRAMEBUFFER_RGB32F) {
+        // Already packed RGB: one pass of the kernel over the pixels
+        quantizeKernel()((const float *) pixels, (size_t) count * 3, out);
+    } else if (format == FRAMEBUFFER_RGB16F) {
+        QuantizeFunc quantize = quantizeKernel();
+        const unsigned short *halves = (const unsigned short *) pixels;
+        float rgb[CONVERT_CHUNK * 3];
+        for (int start = 0; start < count; start += CONVERT_CHUNK) {
+            int chunk = min(count - start, CONVERT_CHUNK);
+            for (int i = 0; i < chunk * 3; i++) {
+                rgb[i] = halfToFloat(halves[start * 3 + i]);
+            }
+            quantize(rgb, (size_t) chunk * 3, out + (size_t) start * 3);
+        }
+    } else {
+        memcpy(out, pixels, (size_t) count * 3);
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Framebuffer
+
+void Framebuffer::reset(FramebufferFormat format, int width, int height) {
+    _format = format;
+    _width = width;
+    _height = height;
+    _rowBytes = framebufferPixelBytes(format) * width;
+    // All three formats store black as zero bytes
+    _pixels.assign(_rowBytes * height, 0);
+}
+
+void Framebuffer::storeSpan(int y, int x, const vec4 *colors, int count) {
+    unsigned char *out = row(y) + framebufferPixelBytes(_format) * x;
+    if (_format == FRAMEBUFFER_RGB32F) {
+        for (int i = 0; i < count; i++) {
+            memcpy(out + i * 3 * sizeof(float), (const float *) colors[i], 3 * sizeof(float));
+        }
+    } else if (_format == FRAMEBUFFER_RGB16F) {
+        unsigned short *halves = (unsigned short *) out;
+        for (int i = 0; i < count; i++)
+            for (int k = 0; k < 3; k++) {
+                halves[i * 3 + k] = floatToHalf(colors[i][k]);
+            }
+    } else {
+        // Drop alpha so the kernel sees packed RGB, then quantize a chunk at a time
+        QuantizeFunc quantize = quantizeKernel();
+        float rgb[CONVERT_CHUNK * 3];
+        for (int start = 0; start < count; start += CONVERT_CHUNK) {
+            int chunk = min(count - start, CONVERT_CHUNK);
+            for (int i = 0; i < chunk; i++) {
+                memcpy(&rgb[i * 3], (const float *) colors[start + i], 3 * sizeof(float));
+            }
+            quantize(rgb, (size_t) chunk * 3, out + (size_t) start * 3);
+        }
+    }
+}
+
+void Framebuffer::fillSpan(int y, int x0, int x1, const vec4 &color) {
+    if (x1 <= x0) {
+        return;
+    }
+    storeSpan(y, x0, &color, 1);
+    size_t pixelBytes = framebufferPixelBytes(_format);
+    unsigned char *first = row(y) + pixelBytes * x0;
+    for (int x = x0 + 1; x < x1; x++) {
+        memcpy(first + pixelBytes * (x - x0), first, pixelBytes);
+    }
+}
+
+void Framebuffer::quantizeRow(int y, unsigned char *out) const {
+    quantizePixels(_format, row(y), _width, out);
+}
+
+void Framebuffer::loadRow(int y, float *out) const {
+    if (_format == FRAMEBUFFER_RGB32F) {
+        memcpy(out, row(y), _rowBytes);
+    } else if (_format == FRAMEBUFFER_RGB16F) {
+        const unsigned short *halves = (const unsigned short *) row(y);
+        for (int i = 0; i < _width * 3; i++) {
+            out[i] = halfToFloat(halves[i]);
+        }
+    } else {
+        const unsigned char *bytes = row(y);
+        for (int i = 0; i < _width * 3; i++) {
+            out[i] = bytes[i] / 255.0f;
+        }
+    }
+}
@@ -0,0 +1,107 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- framebuffer.h ---
+//
+//  The rendered image, stored in one of three pixel formats:
+//
+//    - rgb32f: three floats per pixel, exact (12 bytes)
+//    - rgb16f: three half floats per pixel, for HDR output in half the
+//      memory (6 bytes)
+//    - rgb8: the bytes that go into a PPM or PNG, quantized as pixels are
+//      stored (3 bytes)
+//
+//  Renderers trace spans of vec4 colors and store them; conversions to
+//  8-bit channels go through the SIMD quantize kernel.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include "vecm.h"
+#include <cstddef>
+#include <vector>
+
+enum FramebufferFormat {
+    FRAMEBUFFER_RGB32F,
+    FRAMEBUFFER_RGB16F,
+    FRAMEBUFFER_RGB8,
+    FRAMEBUFFER_FORMAT_COUNT
+};
+
+const char *framebufferFormatName(FramebufferFormat format);
+
+/**
+ * The format called name ("rgb32f", "rgb16f" or "rgb8"). Returns false for
+ * any other name.
+ */
+bool findFramebufferFormat(const char *name, FramebufferFormat &format);
+
+size_t framebufferPixelBytes(FramebufferFormat format);
+
+/**
+ * Convert count pixels stored in format to 8-bit RGB, each channel clamped
+ * to [0, 1], like Framebuffer::quantizeRow().
+ */
+void quantizePixels(FramebufferFormat format, const unsigned char *pixels, int count, unsigned char *out);
+
+/**
+ * Rows of pixels, top row first, each pixel framebufferPixelBytes() bytes
+ * with no padding between rows.
+ */
+class Framebuffer {
+public:
+    Framebuffer() : _format(FRAMEBUFFER_RGB32F), _width(0), _height(0), _rowBytes(0) {}
+
+    /**
+     * Resize to width x height pixels of the given format, all black.
+     */
+    void reset(FramebufferFormat format, int width, int height);
+
+    FramebufferFormat format() const { return _format; }
+
+    int width() const { return _width; }
+
+    int height() const { return _height; }
+
+    size_t rowBytes() const { return _rowBytes; }
+
+    size_t size() const { return _pixels.size(); }
+
+    unsigned char *data() { return _pixels.data(); }
+
+    const unsigned char *data() const { return _pixels.data(); }
+
+    unsigned char *row(int y) { return _pixels.data() + _rowBytes * y; }
+
+    const unsigned char *row(int y) const { return _pixels.data() + _rowBytes * y; }
+
+    /**
+     * Store count colors from pixel x of row y on.
+     */
+    void storeSpan(int y, int x, const vec4 *colors, int count);
+
+    /**
+     * Set pixels [x0, x1) of row y to one color.
+     */
+    void fillSpan(int y, int x0, int x1, const vec4 &color);
+
+    /**
+     * Row y as 8-bit RGB, each channel clamped to [0, 1].
+     */
+    void quantizeRow(int y, unsigned char *out) const;
+
+    /**
+     * Row y as float RGB. rgb8 channels come back as value / 255.
+     */
+    void loadRow(int y, float *out) const;
+
+private:
+    FramebufferFormat _format;
+    int _width;
+    int _height;
+    size_t _rowBytes;
+    std::vector<unsigned char> _pixels;
+};
+
+#endif // __FRAMEBUFFER_H__
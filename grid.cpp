@@ -0,0 +1,265 @@
+#include "grid.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+// -------------------------------------------------------------------
+// Building
+
+/**
+ * Cell coordinate of a position along one axis, clamped to the grid.
+ */
+static int cellCoordinate(const Grid &grid, int axis, float position) {
+    int cell = (int) floorf((position - grid.bounds[0][axis]) / grid.cellSize[axis]);
+    return min(max(cell, 0), grid.resolution[axis] - 1);
+}
+
+static int cellIndex(const Grid &grid, int x, int y, int z) {
+    return (z * grid.resolution[1] + y) * grid.resolution[0] + x;
+}
+
+void buildGrid(const vector<SphereBounds> &bounds, Grid &grid) {
+    int count = (int) bounds.size();
+
+    for (int k = 0; k < 3; k++) {
+        grid.bounds[0][k] = INFINITY;
+        grid.bounds[1][k] = -INFINITY;
+    }
+    for (int i = 0; i < count; i++)
+        for (int k = 0; k < 3; k++) {
+            grid.bounds[0][k] = fminf(grid.bounds[0][k], bounds[i].min[k]);
+            grid.bounds[1][k] = fmaxf(grid.bounds[1][k], bounds[i].max[k]);
+        }
+    if (count == 0) {
+        for (int k = 0; k < 3; k++) {
+            grid.bounds[0][k] = 0;
+            grid.bounds[1][k] = 1;
+        }
+    }
+
+    // Pick cubic-ish cells so the grid holds about GRID_CELLS_PER_SPHERE
+    // cells per sphere. Flat scenes get a minimum thickness so the volume
+    // stays meaningful.
+    float extent[3];
+    float largest = 0;
+    for (int k = 0; k < 3; k++) {
+        extent[k] = grid.bounds[1][k] - grid.bounds[0][k];
+        largest = fmaxf(largest, extent[k]);
+    }
+    float volume = 1;
+    for (int k = 0; k < 3; k++) {
+        volume *= fmaxf(extent[k], largest * 1e-3f);
+    }
+    float cellsPerUnit = cbrtf(GRID_CELLS_PER_SPHERE * max(count, 1) / volume);
+
+    long long cells = 1;
+    for (int k = 0; k < 3; k++) {
+        int resolution = (int) ceilf(extent[k] * cellsPerUnit);
+        grid.resolution[k] = min(max(resolution, 1), GRID_MAX_RESOLUTION);
+        cells *= grid.resolution[k];
+    }
+    while (cells > GRID_MAX_CELLS) {
+        cells = 1;
+        for (int k = 0; k < 3; k++) {
+            grid.resolution[k] = max(grid.resolution[k] / 2, 1);
+            cells *= grid.resolution[k];
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        grid.cellSize[k] = fmaxf(extent[k], 1e-6f) / grid.resolution[k];
+    }
+
+    // Two passes: count the spheres overlapping each cell, then fill
+    grid.cellStart.assign((unsigned int) (cells + 1), 0);
+    for (int pass = 0; pass < 2; pass++) {
+        vector<int> fill;
+        if (pass == 1) {
+            for (long long c = 0; c < cells; c++) {
+                grid.cellStart[c + 1] += grid.cellStart[c];
+            }
+            grid.cellSpheres.resize((unsigned int) grid.cellStart[cells]);
+            fill.assign(grid.cellStart.begin(), grid.cellStart.end() - 1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            int lo[3], hi[3];
+            for (int k = 0; k < 3; k++) {
+                lo[k] = cellCoordinate(grid, k, bounds[i].min[k]);
+                hi[k] = cellCoordinate(grid, k, bounds[i].max[k]);
+            }
+            for (int z = lo[2]; z <= hi[2]; z++)
+                for (int y = lo[1]; y <= hi[1]; y++)
+                    for (int x = lo[0]; x <= hi[0]; x++) {
+                        int cell = cellIndex(grid, x, y, z);
+                        if (pass == 0) {
+                            grid.cellStart[cell + 1]++;
+                        } else {
+                            grid.cellSpheres[fill[cell]++] = i;
+                        }
+                    }
+        }
+    }
+}
+
+void findGridCell(const Grid &grid, float x, float y, float z, const int *&begin, const int *&end) {
+    float point[3] = {x, y, z};
+    begin = end = NULL;
+    for (int k = 0; k < 3; k++) {
+        // Written so NaN coordinates are outside too
+        if (!(point[k] >= grid.bounds[0][k] && point[k] <= grid.bounds[1][k])) {
+            return;
+        }
+    }
+    int cell = cellIndex(grid, cellCoordinate(grid, 0, x), cellCoordinate(grid, 1, y), cellCoordinate(grid, 2, z));
+    begin = grid.cellSpheres.data() + grid.cellStart[cell];
+    end = grid.cellSpheres.data() + grid.cellStart[cell + 1];
+}
+
+
+// -------------------------------------------------------------------
+// Traversal
+
+/**
+ * 3D-DDA state (Amanatides & Woo): the current cell and the ray time at
+ * which the next cell boundary is crossed on each axis.
+ */
+struct GridWalk {
+    int cell[3];
+    int step[3];
+    float tMax[3];
+    float tDelta[3];
+    float tFar;
+};
+
+/**
+ * Clip the ray to the grid and find the first cell. Returns false if the
+ * ray misses the grid.
+ */
+static bool startWalk(const Grid &grid, const SphereQuery &query, GridWalk &walk) {
+    float tNear = 0;
+    walk.tFar = INFINITY;
+    for (int k = 0; k < 3; k++) {
+        if (query.dir[k] == 0) {
+            if (query.origin[k] < grid.bounds[0][k] || query.origin[k] > grid.bounds[1][k]) {
+                return false;
+            }
+            continue;
+        }
+        float t1 = (grid.bounds[0][k] - query.origin[k]) / query.dir[k];
+        float t2 = (grid.bounds[1][k] - query.origin[k]) / query.dir[k];
+        tNear = max(tNear, min(t1, t2));
+        walk.tFar = min(walk.tFar, max(t1, t2));
+    }
+    if (tNear > walk.tFar || walk.tFar < query.minHitTime) {
+        return false;
+    }
+
+    for (int k = 0; k < 3; k++) {
+        float entry = query.origin[k] + query.dir[k] * tNear;
+        walk.cell[k] = cellCoordinate(grid, k, entry);
+        if (query.dir[k] > 0) {
+            walk.step[k] = 1;
+            float boundary = grid.bounds[0][k] + (walk.cell[k] + 1) * grid.cellSize[k];
+            walk.tMax[k] = (boundary - query.origin[k]) / query.dir[k];
+            walk.tDelta[k] = grid.cellSize[k] / query.dir[k];
+        } else if (query.dir[k] < 0) {
+            walk.step[k] = -1;
+            float boundary = grid.bounds[0][k] + walk.cell[k] * grid.cellSize[k];
+            walk.tMax[k] = (boundary - query.origin[k]) / query.dir[k];
+            walk.tDelta[k] = -grid.cellSize[k] / query.dir[k];
+        } else {
+            walk.step[k] = 0;
+            walk.tMax[k] = INFINITY;
+            walk.tDelta[k] = INFINITY;
+        }
+    }
+    return true;
+}
+
+/**
+ * Ray time at which the walk leaves the current cell.
+ */
+static float cellExit(const GridWalk &walk) {
+    return min(walk.tMax[0], min(walk.tMax[1], walk.tMax[2]));
+}
+
+/**
+ * Step to the next cell along the axis whose boundary comes first. Returns
+ * false once the walk leaves the grid.
+ */
+static bool stepWalk(const Grid &grid, GridWalk &walk) {
+    int axis = 0;
+    if (walk.tMax[1] < walk.tMax[axis]) axis = 1;
+    if (walk.tMax[2] < walk.tMax[axis]) axis = 2;
+    if (walk.tMax[axis] > walk.tFar) {
+        return false;
+    }
+
+    walk.cell[axis] += walk.step[axis];
+    if (walk.cell[axis] < 0 || walk.cell[axis] >= grid.resolution[axis]) {
+        return false;
+    }
+    walk.tMax[axis] += walk.tDelta[axis];
+    return true;
+}
+
+void intersectGrid(const Grid &grid, const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    hit.distance = -1;
+    hit.interiorPoint = false;
+
+    GridWalk walk;
+    if (grid.cellSpheres.empty() || !startWalk(grid, query, walk)) {
+        return;
+    }
+
+    do {
+        int c = cellIndex(grid, walk.cell[0], walk.cell[1], walk.cell[2]);
+        for (int i = grid.cellStart[c]; i < grid.cellStart[c + 1]; i++) {
+            int slot = grid.cellSpheres[i];
+            float distance;
+            bool interiorPoint;
+            if (!intersectSphereSlot(store, query, slot, distance, interiorPoint)) {
+                continue;
+            }
+            // Ties go to the lowest slot, as in the sphere block kernel
+            if (hit.distance == -1 || distance < hit.distance ||
+                (distance == hit.distance && slot < hit.slot)) {
+                hit.distance = distance;
+                hit.slot = slot;
+                hit.interiorPoint = interiorPoint;
+            }
+        }
+
+        // A hit inside this cell cannot be beaten by a later one
+        if (hit.distance != -1 && hit.distance < cellExit(walk)) {
+            return;
+        }
+    } while (stepWalk(grid, walk));
+}
+
+int findOccluderGrid(const Grid &grid, const SphereStore &store, const SphereQuery &query) {
+    GridWalk walk;
+    if (grid.cellSpheres.empty() || !startWalk(grid, query, walk)) {
+        return -1;
+    }
+
+    do {
+        int c = cellIndex(grid, walk.cell[0], walk.cell[1], walk.cell[2]);
+        for (int i = grid.cellStart[c]; i < grid.cellStart[c + 1]; i++) {
+            int slot = grid.cellSpheres[i];
+            float distance;
+            bool interiorPoint;
+            if (intersectSphereSlot(store, query, slot, distance, interiorPoint) && distance < query.maxDistance) {
+                return slot;
+            }
+        }
+
+        // Cells past the light cannot hold a blocker
+        if (cellExit(walk) >= query.maxDistance) {
+            return -1;
+        }
+    } while (stepWalk(grid, walk));
+    return -1;
+}
@@ -0,0 +1,55 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- grid.h ---
+//
+//  Uniform grid over the spheres with 3D-DDA traversal. Cheaper to build
+//  than the BVH and well suited to dense, evenly spread scenes.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __GRID_H__
+#define __GRID_H__
+
+#include "simd.h"
+#include "bvh.h"
+#include <vector>
+
+// Target number of cells per sphere when picking the resolution
+#define GRID_CELLS_PER_SPHERE 3.0f
+#define GRID_MAX_RESOLUTION 1024
+#define GRID_MAX_CELLS (1 << 24)
+
+struct Grid {
+    float bounds[2][3];             // Min and max corner
+    int resolution[3];
+    float cellSize[3];
+    std::vector<int> cellStart;     // Cell i holds cellSpheres[cellStart[i] .. cellStart[i + 1])
+    std::vector<int> cellSpheres;   // Sphere indices, grouped by cell
+};
+
+/**
+ * Build a grid over the given sphere bounds, choosing the resolution from
+ * the sphere density. bounds[i] must contain every point where a ray can
+ * hit sphere i.
+ */
+void buildGrid(const std::vector<SphereBounds> &bounds, Grid &grid);
+
+/**
+ * The entries of the cell holding point (x, y, z) as [begin, end); none if
+ * the point lies outside the grid.
+ */
+void findGridCell(const Grid &grid, float x, float y, float z, const int *&begin, const int *&end);
+
+/**
+ * Nearest hit of a ray among the spheres of the grid, tested against the
+ * sphere store. Returns the same hit as intersectBVH().
+ */
+void intersectGrid(const Grid &grid, const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+/**
+ * Any-hit query: the slot of some sphere hit after query.minHitTime and
+ * before query.maxDistance, or -1. Stops at the first blocker.
+ */
+int findOccluderGrid(const Grid &grid, const SphereStore &store, const SphereQuery &query);
+
+#endif // __GRID_H__
@@ -0,0 +1,258 @@
+#include "image_encoder.h"
+#include "deflate.h"
+#include "raytrace.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+// Output bytes per strip. Fixed, so the output does not depend on the
+// thread count; large enough that a PNG loses next to nothing by
+// restarting its matches at every strip.
+#define STRIP_BYTES (1 << 18)
+
+/**
+ * Rows per strip for rows of rowBytes each.
+ */
+static int stripRows(size_t rowBytes) {
+    return (int) max((size_t) STRIP_BYTES / max(rowBytes, (size_t) 1), (size_t) 1);
+}
+
+/**
+ * Run body(strip) for every strip, on up to threadCount render threads.
+ */
+template<class Body>
+static void forEachStrip(int stripCount, int threadCount, Body body) {
+    atomic<int> next(0);
+    runOnRenderThreads(max(min(threadCount, stripCount), 1), [&](int) {
+        for (int strip; (strip = next++) < stripCount;) {
+            body(strip);
+        }
+    });
+}
+
+static void appendHeader(vector<unsigned char> &out, const char *header) {
+    out.insert(out.end(), header, header + strlen(header));
+}
+
+
+// -------------------------------------------------------------------
+// PPM and PFM
+
+static void encodePPMImage(const Framebuffer &frame, int threadCount, vector<unsigned char> &out) {
+    int width = frame.width();
+    int height = frame.height();
+    char header[64];
+    snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 255);
+    out.clear();
+    appendHeader(out, header);
+    size_t headerSize = out.size();
+    size_t rowBytes = (size_t) width * 3;
+    out.resize(headerSize + rowBytes * height);
+
+    int rows = stripRows(rowBytes);
+    forEachStrip((height + rows - 1) / rows, threadCount, [&](int strip) {
+        for (int y = strip * rows; y < min(height, (strip + 1) * rows); y++) {
+            frame.quantizeRow(y, &out[headerSize + rowBytes * y]);
+        }
+    });
+}
+
+static void encodePFMImage(const Framebuffer &frame, int threadCount, vector<unsigned char> &out) {
+    int width = frame.width();
+    int height = frame.height();
+    // A negative scale marks little-endian floats
+    unsigned int one = 1;
+    bool littleEndian = *(unsigned char *) &one == 1;
+    char header[64];
+    snprintf(header, sizeof(header), "PF\n%d %d\n%s\n", width, height, littleEndian ? "-1.0" : "1.0");
+    out.clear();
+    appendHeader(out, header);
+    size_t headerSize = out.size();
+    size_t rowBytes = (size_t) width * 3 * sizeof(float);
+    out.resize(headerSize + rowBytes * height);
+
+    // PFM rows go from the bottom of the image up
+    int rows = stripRows(rowBytes);
+    forEachStrip((height + rows - 1) / rows, threadCount, [&](int strip) {
+        vector<float> row((size_t) width * 3);
+        for (int j = strip * rows; j < min(height, (strip + 1) * rows); j++) {
+            frame.loadRow(height - 1 - j, row.data());
+            memcpy(&out[headerSize + rowBytes * j], row.data(), rowBytes);
+        }
+    });
+}
+
+
+// -------------------------------------------------------------------
+// PNG
+
+static inline int paethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+/**
+ * Filter one row of RGB bytes given the row above (zeros for the first),
+ * writing the filter type and the filtered bytes to out. Picks the filter
+ * with the smallest sum of absolute differences, the usual heuristic.
+ * candidate is rowBytes of scratch space, reused from row to row.
+ */
+static void filterRow(const unsigned char *above, const unsigned char *row, size_t rowBytes, unsigned char *candidate,
+                      unsigned char *out) {
+    const size_t bpp = 3;
+    long long bestSum = -1;
+    for (int type = 0; type < 5; type++) {
+        long long sum = 0;
+        for (size_t i = 0; i < rowBytes; i++) {
+            int left = i >= bpp ? row[i - bpp] : 0;
+            int up = above[i];
+            int upLeft = i >= bpp ? above[i - bpp] : 0;
+            int predicted = type == 0 ? 0 : type == 1 ? left : type == 2 ? up : type == 3 ? (left + up) / 2 :
+                            paethPredictor(left, up, upLeft);
+            unsigned char value = (unsigned char) (row[i] - predicted);
+            candidate[i] = value;
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (bestSum < 0 || sum < bestSum) {
+            bestSum = sum;
+            out[0] = (unsigned char) type;
+            memcpy(out + 1, candidate, rowBytes);
+        }
+    }
+}
+
+static void appendBigEndian(vector<unsigned char> &out, unsigned int value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back((unsigned char) (value >> shift));
+    }
+}
+
+static void appendChunk(vector<unsigned char> &out, const char *type, const unsigned char *data, size_t size) {
+    appendBigEndian(out, (unsigned int) size);
+    out.insert(out.end(), type, type + 4);
+    if (size > 0) {
+        out.insert(out.end(), data, data + size);
+    }
+    unsigned int crc = updateCRC32(0, (const unsigned char *) type, 4);
+    appendBigEndian(out, updateCRC32(crc, data, size));
+}
+
+struct PNGStrip {
+    vector<unsigned char> chunk;    // The strip's IDAT chunk
+    unsigned int adler;             // Adler-32 of the filtered rows
+    size_t size;                    // Bytes of filtered rows
+};
+
+/**
+ * Each strip of rows is filtered and deflated on its own and becomes one
+ * IDAT chunk; the chunks concatenate into a single zlib stream, whose
+ * Adler-32 is combined from the strips' and sent in a last, small IDAT.
+ */
+static void encodePNGImage(const Framebuffer &frame, int threadCount, vector<unsigned char> &out) {
+    int width = frame.width();
+    int height = frame.height();
+    size_t rowBytes = (size_t) width * 3;
+    int rows = stripRows(rowBytes + 1);
+    int stripCount = (height + rows - 1) / rows;
+    vector<PNGStrip> strips((size_t) stripCount);
+
+    forEachStrip(stripCount, threadCount, [&](int strip) {
+        int y0 = strip * rows;
+        int y1 = min(height, y0 + rows);
+        // The row above the strip is converted again so the strip can be filtered on its own
+        vector<unsigned char> pixels(rowBytes * (y1 - y0 + 1), 0);
+        for (int y = max(y0 - 1, 0); y < y1; y++) {
+            frame.quantizeRow(y, &pixels[rowBytes * (y - y0 + 1)]);
+        }
+        vector<unsigned char> filtered((rowBytes + 1) * (y1 - y0));
+        vector<unsigned char> candidate(rowBytes);
+        for (int y = y0; y < y1; y++) {
+            filterRow(&pixels[rowBytes * (y - y0)], &pixels[rowBytes * (y - y0 + 1)], rowBytes, candidate.data(),
+                      &filtered[(rowBytes + 1) * (y - y0)]);
+        }
+
+        PNGStrip &result = strips[strip];
+        result.adler = updateAdler32(1, filtered.data(), filtered.size());
+        result.size = filtered.size();
+        vector<unsigned char> compressed;
+        if (strip == 0) {
+            // zlib header: deflate with a 32K window, fast compression
+            compressed.push_back(0x78);
+            compressed.push_back(0x5E);
+        }
+        deflatePiece(filtered.data(), filtered.size(), strip == stripCount - 1, compressed);
+        appendChunk(result.chunk, "IDAT", compressed.data(), compressed.size());
+    });
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    out.assign(signature, signature + 8);
+
+    vector<unsigned char> header;
+    appendBigEndian(header, (unsigned int) width);
+    appendBigEndian(header, (unsigned int) height);
+    header.push_back(8);    // Bits per channel
+    header.push_back(2);    // RGB
+    header.push_back(0);    // Deflate
+    header.push_back(0);    // Adaptive filtering
+    header.push_back(0);    // Not interlaced
+    appendChunk(out, "IHDR", header.data(), header.size());
+
+    unsigned int adler = 1;
+    for (const PNGStrip &strip : strips) {
+        out.insert(out.end(), strip.chunk.begin(), strip.chunk.end());
+        adler = combineAdler32(adler, strip.adler, strip.size);
+    }
+    vector<unsigned char> trailer;
+    appendBigEndian(trailer, adler);
+    appendChunk(out, "IDAT", trailer.data(), trailer.size());
+    appendChunk(out, "IEND", NULL, 0);
+}
+
+
+// -------------------------------------------------------------------
+// Selection
+
+static const ImageEncoder s_encoders[] = {
+    {"ppm", ".ppm", encodePPMImage},
+    {"pfm", ".pfm", encodePFMImage},
+    {"png", ".png", encodePNGImage}
+};
+
+const ImageEncoder *selectImageEncoder(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    if (dot != NULL && (slash == NULL || dot > slash)) {
+        for (const ImageEncoder &encoder : s_encoders) {
+            if (strlen(dot) == strlen(encoder.extension)) {
+                bool same = true;
+                for (size_t i = 0; dot[i] != '\0'; i++) {
+                    same = same && tolower((unsigned char) dot[i]) == encoder.extension[i];
+                }
+                if (same) {
+                    return &encoder;
+                }
+            }
+        }
+    }
+    return &s_encoders[0];
+}
+
+const ImageEncoder *findImageEncoder(const char *name) {
+    for (const ImageEncoder &encoder : s_encoders) {
+        if (strcmp(encoder.name, name) == 0) {
+            return &encoder;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,41 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- image_encoder.h ---
+//
+//  Image file formats, chosen by the extension of the output file: binary
+//  PPM (8 bits per channel), PFM (32-bit floats, not clamped, for HDR
+//  work) and PNG (8 bits per channel, compressed by the built-in deflate).
+//  Encoders split the image into strips of rows and share them out between
+//  the render threads; the bytes do not depend on the thread count.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __IMAGE_ENCODER_H__
+#define __IMAGE_ENCODER_H__
+
+#include "framebuffer.h"
+#include <vector>
+
+struct ImageEncoder {
+    const char *name;
+    const char *extension;
+
+    /**
+     * Encode a framebuffer as a whole file in out, on up to threadCount
+     * threads.
+     */
+    void (*encode)(const Framebuffer &frame, int threadCount, std::vector<unsigned char> &out);
+};
+
+/**
+ * The encoder for a file name's extension, ignoring case. Anything that is
+ * not .pfm or .png, "-" included, is written as PPM.
+ */
+const ImageEncoder *selectImageEncoder(const char *filename);
+
+/**
+ * The encoder called name ("ppm", "pfm" or "png"), or NULL.
+ */
+const ImageEncoder *findImageEncoder(const char *name);
+
+#endif // __IMAGE_ENCODER_H__
@@ -0,0 +1,227 @@
+#include "partial_image.h"
+#include "raytrace.h"
+#include "render_farm.h"
+#include "render_service.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+void printUsage() {
+    cout << "Usage: template-rt [--threads N] [--tile-size N] [--simd auto|avx2|sse|scalar|off] [--wavefront]\n"
+         << "       [--stream] [--band-height N] [--progressive] [--time-budget SECONDS] [--output FILE|-]\n"
+         << "       [--aa DEPTH] [--aa-threshold T] [--incremental CACHE] [--sequence FRAME_LIST]\n"
+         << "       [--refit-threshold R] [--stats=json] [--heatmap FILE] [--heatmap-raw FILE]\n"
+         << "       [--heatmap-metric cycles|work] [--framebuffer rgb32f|rgb16f|rgb8]\n"
+         << "       [--pixel-order rows|morton|hilbert] [--farm ADDRESS] [--farm-workers N]\n"
+         << "       [--region X0 Y0 X1 Y1] <input_file.txt>\n"
+         << "       template-rt [--threads N] [--tile-size N] [--simd ISA] [--max-jobs N] --serve SOCKET\n"
+         << "       template-rt [--threads N] [--tile-size N] [--simd ISA] [--wavefront] [--pixel-order ORDER]\n"
+         << "                   --farm-worker ADDRESS"
+         << endl;
+}
+
+int main(int argc, char *argv[]) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    const char *inputFile = NULL;
+    const char *outputFile = NULL;
+    const char *cacheFile = NULL;
+    const char *sequenceFile = NULL;
+    const char *serviceSocket = NULL;
+    const char *farmAddress = NULL;
+    const char *farmWorkerAddress = NULL;
+    int farmWorkers = -1;
+    bool renderRegionOnly = false;
+    int region[4] = {0, 0, 0, 0};      // x0, y0, x1, y1 from the top left, x1 and y1 exclusive
+    int maxJobs = DEFAULT_MAX_JOBS;
+    bool statsJSON = false;
+    const char *heatmapFile = NULL;
+    const char *rawCostFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            g_threadCount = atoi(argv[++i]);
+        } else if (arg == "--tile-size" && i + 1 < argc) {
+            g_tileSize = atoi(argv[++i]);
+        } else if (arg == "--simd" && i + 1 < argc) {
+            g_simdISA = argv[++i];
+        } else if (arg == "--wavefront") {
+            g_wavefront = true;
+        } else if (arg == "--stream") {
+            g_streamOutput = true;
+        } else if (arg == "--band-height" && i + 1 < argc) {
+            g_bandHeight = atoi(argv[++i]);
+        } else if (arg == "--progressive") {
+            g_progressive = true;
+        } else if (arg == "--time-budget" && i + 1 < argc) {
+            g_timeBudget = atof(argv[++i]);
+            g_progressive = true;
+        } else if (arg == "--aa" && i + 1 < argc) {
+            g_aaDepth = atoi(argv[++i]);
+        } else if (arg == "--aa-threshold" && i + 1 < argc) {
+            g_aaThreshold = (float) atof(argv[++i]);
+        } else if (arg == "--incremental" && i + 1 < argc) {
+            cacheFile = argv[++i];
+        } else if (arg == "--sequence" && i + 1 < argc) {
+            sequenceFile = argv[++i];
+        } else if (arg == "--refit-threshold" && i + 1 < argc) {
+            g_refitThreshold = (float) atof(argv[++i]);
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serviceSocket = argv[++i];
+        } else if (arg == "--farm" && i + 1 < argc) {
+            farmAddress = argv[++i];
+        } else if (arg == "--farm-workers" && i + 1 < argc) {
+            farmWorkers = max(atoi(argv[++i]), 0);
+        } else if (arg == "--farm-worker" && i + 1 < argc) {
+            farmWorkerAddress = argv[++i];
+        } else if (arg == "--region" && i + 4 < argc) {
+            for (int k = 0; k < 4; k++) {
+                region[k] = atoi(argv[++i]);
+            }
+            renderRegionOnly = true;
+        } else if (arg == "--max-jobs" && i + 1 < argc) {
+            maxJobs = max(atoi(argv[++i]), 1);
+        } else if (arg == "--stats=json") {
+            statsJSON = true;
+        } else if (arg == "--heatmap" && i + 1 < argc) {
+            heatmapFile = argv[++i];
+        } else if (arg == "--heatmap-raw" && i + 1 < argc) {
+            rawCostFile = argv[++i];
+        } else if (arg == "--heatmap-metric" && i + 1 < argc && string(argv[i + 1]) == "cycles") {
+            g_costMetric = COST_CYCLES;
+            i++;
+        } else if (arg == "--heatmap-metric" && i + 1 < argc && string(argv[i + 1]) == "work") {
+            g_costMetric = COST_WORK;
+            i++;
+        } else if (arg == "--framebuffer" && i + 1 < argc && findFramebufferFormat(argv[i + 1], g_framebufferFormat)) {
+            i++;
+        } else if (arg == "--pixel-order" && i + 1 < argc && findPixelOrder(argv[i + 1], g_pixelOrder)) {
+            i++;
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (arg[0] == '-') {
+            printUsage();
+            exit(1);
+        } else {
+            inputFile = argv[i];
+        }
+    }
+
+    if (serviceSocket != NULL) {
+        return serveRenders(serviceSocket, maxJobs) ? 0 : 1;
+    }
+    if (farmWorkerAddress != NULL) {
+        return runFarmWorker(farmWorkerAddress) ? 0 : 1;
+    }
+    if (inputFile == NULL) {
+        printUsage();
+        exit(1);
+    }
+    if (g_progressive && g_streamOutput) {
+        cout << "--progressive and --stream cannot be combined" << endl;
+        exit(1);
+    }
+    if (cacheFile != NULL && (g_progressive || g_streamOutput)) {
+        cout << "--incremental cannot be combined with --progressive or --stream" << endl;
+        exit(1);
+    }
+    if (sequenceFile != NULL && (g_progressive || g_streamOutput || cacheFile != NULL)) {
+        cout << "--sequence cannot be combined with --progressive, --stream or --incremental" << endl;
+        exit(1);
+    }
+    g_recordCosts = heatmapFile != NULL || rawCostFile != NULL;
+    if (g_recordCosts && (g_progressive || g_streamOutput || cacheFile != NULL || sequenceFile != NULL)) {
+        cout << "--heatmap cannot be combined with --progressive, --stream, --incremental or --sequence" << endl;
+        exit(1);
+    }
+    if (farmAddress != NULL &&
+        (g_progressive || g_streamOutput || cacheFile != NULL || sequenceFile != NULL || g_recordCosts)) {
+        cout << "--farm cannot be combined with --progressive, --stream, --incremental, --sequence or --heatmap"
+             << endl;
+        exit(1);
+    }
+    if (renderRegionOnly && (g_progressive || g_streamOutput || cacheFile != NULL || sequenceFile != NULL ||
+                             g_recordCosts || farmAddress != NULL)) {
+        cout << "--region cannot be combined with --progressive, --stream, --incremental, --sequence, --heatmap "
+             << "or --farm" << endl;
+        exit(1);
+    }
+#ifndef RT_STATS
+    if (g_costMetric == COST_WORK) {
+        cout << "--heatmap-metric work needs a build configured with -DRT_STATS=ON" << endl;
+        exit(1);
+    }
+#endif
+
+    // When the image goes to stdout, keep messages out of it
+    if (outputFile != NULL && string(outputFile) == "-") {
+        cout.rdbuf(cerr.rdbuf());
+    }
+    loadFile(inputFile);
+    if (outputFile != NULL) {
+        g_outputFilename = outputFile;
+    } else if (g_outputFilename == "-") {
+        cout.rdbuf(cerr.rdbuf());
+    }
+    if (g_streamOutput && strcmp(selectImageEncoder(g_outputFilename.c_str())->name, "ppm") != 0) {
+        cout << "--stream only writes PPM images" << endl;
+        exit(1);
+    }
+    if (renderRegionOnly) {
+        if (region[0] < 0 || region[0] >= region[2] || region[2] > g_width || region[1] < 0 ||
+            region[1] >= region[3] || region[3] > g_height) {
+            cout << "--region " << region[0] << " " << region[1] << " " << region[2] << " " << region[3]
+                 << " is not a window of the " << g_width << " x " << g_height << " image" << endl;
+            exit(1);
+        }
+        if (g_outputFilename == "-") {
+            cout << "--region writes a partial image file, not stdout" << endl;
+            exit(1);
+        }
+    }
+
+    prepareScene();
+    if (g_progressive) {
+        // The budget covers loading the scene too; a spent budget still gets the first pass
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        renderProgressive(g_timeBudget > 0 ? max(g_timeBudget - elapsed, 1e-9) : 0);
+    } else if (sequenceFile != NULL) {
+        renderSequence(sequenceFile);
+    } else if (cacheFile != NULL) {
+        renderIncremental(cacheFile);
+    } else if (g_streamOutput) {
+        renderStreaming();
+    } else if (farmAddress != NULL) {
+        // One process per thread by default
+        if (!renderFarm(farmAddress, inputFile, farmWorkers >= 0 ? farmWorkers : renderThreadCount(), argv[0])) {
+            exit(1);
+        }
+        if (!saveFile()) {
+            exit(1);
+        }
+    } else if (renderRegionOnly) {
+        renderRegion(region[0], region[1], region[2], region[3]);
+        if (!savePartialImage(g_outputFilename.c_str(), g_framebuffer, g_width, g_height, region[0], region[1])) {
+            exit(1);
+        }
+    } else {
+        render();
+        if (!saveFile()) {
+            exit(1);
+        }
+        if (heatmapFile != NULL && !saveHeatmap(heatmapFile)) {
+            exit(1);
+        }
+        if (rawCostFile != NULL && !saveRawCosts(rawCostFile)) {
+            exit(1);
+        }
+    }
+    printAntialiasingStats();
+    if (statsJSON) {
+        writeRenderStatsJSON(cout, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "mapped_file.h"
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+bool mapFile(const char *filename, MappedFile &file) {
+    file.data = NULL;
+    file.size = 0;
+    file.mapped = false;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    file.data = (const char *) data;
+    file.size = (size_t) info.st_size;
+    file.mapped = true;
+    return true;
+}
+
+void adviseSequential(const MappedFile &file) {
+    if (file.mapped) {
+        madvise((void *) file.data, file.size, MADV_SEQUENTIAL);
+    }
+}
+
+void unmapFile(MappedFile &file) {
+    if (file.mapped) {
+        munmap((void *) file.data, file.size);
+    } else {
+        delete[] file.data;
+    }
+    file.data = NULL;
+    file.size = 0;
+    file.mapped = false;
+}
+
+#else
+
+// No mmap: read the whole file into memory instead
+bool mapFile(const char *filename, MappedFile &file) {
+    file.data = NULL;
+    file.size = 0;
+    file.mapped = false;
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size <= 0) {
+        fclose(fp);
+        return size == 0;
+    }
+
+    char *data = new char[size];
+    if (fread(data, 1, (size_t) size, fp) != (size_t) size) {
+        delete[] data;
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    file.data = data;
+    file.size = (size_t) size;
+    return true;
+}
+
+void adviseSequential(const MappedFile &) {
+}
+
+void unmapFile(MappedFile &file) {
+    delete[] file.data;
+    file.data = NULL;
+    file.size = 0;
+}
+
+#endif
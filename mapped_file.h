@@ -0,0 +1,36 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- mapped_file.h ---
+//
+//  Read-only view of a whole file. Uses mmap where available so large scene
+//  files are parsed straight from the page cache without being copied.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <cstddef>
+
+struct MappedFile {
+    const char *data;
+    size_t size;
+    bool mapped;    // data came from mmap rather than a heap copy
+};
+
+/**
+ * Map filename into memory. Returns false if it cannot be opened or read.
+ * An empty file gives data == NULL and size == 0.
+ */
+bool mapFile(const char *filename, MappedFile &file);
+
+/**
+ * Tell the system the file is about to be read front to back exactly once,
+ * as when parsing a text scene, so it reads ahead and drops pages behind.
+ * Files that are read at random, like binary scenes, must not be advised.
+ */
+void adviseSequential(const MappedFile &file);
+
+void unmapFile(MappedFile &file);
+
+#endif // __MAPPED_FILE_H__
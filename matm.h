@@ -39,12 +39,7 @@ public:
         _m[1] = vec2(m10, m11);
     }
 
-    mat2(const mat2 &m) {
-        if (*this != m) {
-            _m[0] = m._m[0];
-            _m[1] = m._m[1];
-        }
-    }
+    mat2(const mat2 &m) = default;
 
     //
     //  --- Indexing Operator ---
@@ -221,13 +216,7 @@ public:
         _m[2] = vec3(m20, m21, m22);
     }
 
-    mat3(const mat3 &m) {
-        if (*this != m) {
-            _m[0] = m._m[0];
-            _m[1] = m._m[1];
-            _m[2] = m._m[2];
-        }
-    }
+    mat3(const mat3 &m) = default;
 
     //
     //  --- Indexing Operator ---
@@ -418,14 +407,7 @@ public:
         _m[3] = vec4(m30, m31, m32, m33);
     }
 
-    mat4(const mat4 &m) {
-        if (*this != m) {
-            _m[0] = m._m[0];
-            _m[1] = m._m[1];
-            _m[2] = m._m[2];
-            _m[3] = m._m[3];
-        }
-    }
+    mat4(const mat4 &m) = default;
 
     //
     //  --- Indexing Operator ---
@@ -597,6 +579,7 @@ mat4 transpose(const mat4 &A) {
 // if (result == false)
 //     printf("Matrix not invertible.\n");
 
+inline
 bool InvertMatrix(const mat4 &m4, mat4 &m4InvOut) {
     const float *m = (const float *) m4;
     float *invOut = (float *) m4InvOut;
@@ -0,0 +1,342 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- packet_kernel.h ---
+//
+//  The packet intersection kernel, written once against a small set of lane
+//  operations and instantiated by each ISA translation unit. Every float
+//  operation mirrors the order used by calculateNearestIntersection() and
+//  the vec4/mat4 operators, which is what keeps the images identical.
+//
+//  Only include this from simd*.cpp, after simd_lanes.h.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PACKET_KERNEL_H__
+#define __PACKET_KERNEL_H__
+
+#include "render_stats.h"
+#include "simd.h"
+
+namespace {
+
+/**
+ * Row r of a row-major 4x4 matrix times (x, y, z, w), summed left to right
+ * like mat4::operator*(const vec4 &).
+ */
+template<class V>
+inline typename V::F matRow(const float *m, int r, typename V::F x, typename V::F y,
+                            typename V::F z, typename V::F w) {
+    return V::add(V::add(V::add(V::mul(V::set1(m[r * 4 + 0]), x),
+                                V::mul(V::set1(m[r * 4 + 1]), y)),
+                         V::mul(V::set1(m[r * 4 + 2]), z)),
+                  V::mul(V::set1(m[r * 4 + 3]), w));
+}
+
+/**
+ * Same as matRow() but with a different matrix per lane, gathered from the
+ * structure-of-arrays matrix elements.
+ */
+template<class V>
+inline typename V::F gatherRow(const float *const *m, int r, const int *idx, typename V::F x,
+                               typename V::F y, typename V::F z, typename V::F w) {
+    return V::add(V::add(V::add(V::mul(V::gather(m[r * 4 + 0], idx), x),
+                                V::mul(V::gather(m[r * 4 + 1], idx), y)),
+                         V::mul(V::gather(m[r * 4 + 2], idx), z)),
+                  V::mul(V::gather(m[r * 4 + 3], idx), w));
+}
+
+template<class V>
+inline typename V::F dot4(typename V::F ax, typename V::F ay, typename V::F az, typename V::F aw,
+                          typename V::F bx, typename V::F by, typename V::F bz, typename V::F bw) {
+    return V::add(V::add(V::add(V::mul(ax, bx), V::mul(ay, by)), V::mul(az, bz)), V::mul(aw, bw));
+}
+
+/**
+ * Directions and running nearest hit of each lane of a packet. Sphere
+ * indices are kept as floats so they can be blended with the distances.
+ */
+template<class V>
+struct PacketState {
+    typename V::F dx, dy, dz, dw;
+    typename V::F distance;
+    typename V::F nearest;
+    typename V::F interior;
+};
+
+/**
+ * Test sphere s against every lane: masked quadratic solve, hit time
+ * validation and nearest-hit selection. On equal distances the lower sphere
+ * index wins, so the result does not depend on the order spheres are tested.
+ */
+template<class V>
+inline void testPacketSphere(const PacketScene &scene, int s, PacketState<V> &state) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    const F zero = V::set1(0.0f);
+    const F one = V::set1(1.0f);
+    const F noHit = V::set1(-1.0f);
+    const F minHitTime = V::set1(scene.minHitTime);
+    const F minReflectHitTime = V::set1(scene.minReflectHitTime);
+
+    float m[16];
+    for (int k = 0; k < 16; k++) {
+        m[k] = scene.inverse[k][s];
+    }
+
+    // C = inverseTransform * dir
+    F cx = matRow<V>(m, 0, state.dx, state.dy, state.dz, state.dw);
+    F cy = matRow<V>(m, 1, state.dx, state.dy, state.dz, state.dw);
+    F cz = matRow<V>(m, 2, state.dx, state.dy, state.dz, state.dw);
+    F cw = matRow<V>(m, 3, state.dx, state.dy, state.dz, state.dw);
+
+    F sx = V::set1(scene.S[0][s]);
+    F sy = V::set1(scene.S[1][s]);
+    F sz = V::set1(scene.S[2][s]);
+    F sw = V::set1(scene.S[3][s]);
+
+    // Quadratic equation: |c|^2t^2 + 2(S.tc) + |S|^2 - 1
+    F a = dot4<V>(cx, cy, cz, cw, cx, cy, cz, cw);
+    F b = dot4<V>(sx, sy, sz, sw, cx, cy, cz, cw);
+    F c = V::set1(scene.c[s]);
+    F discriminant = V::sub(V::mul(b, b), V::mul(a, c));
+
+    M intersects = V::mnot(V::cmplt(discriminant, zero));
+    if (!V::any(intersects)) {
+        return;
+    }
+    M single = V::cmpeq(discriminant, zero);
+
+    // Two solutions: use the smallest valid one, else fall back to the far one
+    F root = V::sqrt(discriminant);
+    F solution1 = V::div(V::sub(b, root), a);
+    F solution2 = V::div(V::add(b, root), a);
+    F solution = V::min(solution1, solution2);
+    M tooClose = V::mor(V::cmple(solution, minReflectHitTime), V::cmple(solution, minHitTime));
+    solution = V::select(tooClose, V::max(solution1, solution2), solution);
+    M interiorPoint = V::mandnot(single, tooClose);
+
+    // Single solution: line touches the sphere
+    solution = V::select(single, V::div(b, a), solution);
+
+    // Validate solution and keep the nearest
+    F index = V::set1((float) s);
+    M valid = V::mandnot(V::mor(V::cmple(solution, minReflectHitTime), V::cmple(solution, minHitTime)),
+                         intersects);
+    M closer = V::mor(V::mor(V::cmpeq(state.distance, noHit), V::cmplt(solution, state.distance)),
+                      V::mand(V::cmpeq(solution, state.distance), V::cmplt(index, state.nearest)));
+    M take = V::mand(valid, closer);
+    if (!V::any(take)) {
+        return;
+    }
+
+    state.distance = V::select(take, solution, state.distance);
+    state.nearest = V::select(take, index, state.nearest);
+    state.interior = V::select(take, V::select(interiorPoint, one, zero), state.interior);
+}
+
+/**
+ * Slab test of a BVH node against every lane. Returns the lanes whose ray
+ * enters the box before their current nearest hit, and the earliest entry
+ * time over those lanes.
+ */
+template<class V>
+inline typename V::M testPacketBox(const PacketScene &scene, const BVHNode &node, const typename V::F *inverseDir,
+                                   const PacketState<V> &state, float &entry) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F tNear = V::set1(-INFINITY);
+    F tFar = V::set1(INFINITY);
+    for (int k = 0; k < 3; k++) {
+        F eye = V::set1(scene.eye[k]);
+        F t1 = V::mul(V::sub(V::set1(node.bounds[0][k]), eye), inverseDir[k]);
+        F t2 = V::mul(V::sub(V::set1(node.bounds[1][k]), eye), inverseDir[k]);
+        tNear = V::max(tNear, V::min(t1, t2));
+        tFar = V::min(tFar, V::max(t1, t2));
+    }
+
+    M noHit = V::cmpeq(state.distance, V::set1(-1.0f));
+    M hit = V::mand(V::cmple(tNear, tFar), V::mnot(V::cmplt(tFar, V::set1(scene.minHitTime))));
+    hit = V::mand(hit, V::mor(noHit, V::cmple(tNear, state.distance)));
+
+    entry = V::any(hit) ? V::hmin(V::select(hit, tNear, V::set1(INFINITY))) : INFINITY;
+    return hit;
+}
+
+/**
+ * Largest current hit distance over the lanes, or infinity while any lane
+ * has not hit anything yet. Nodes entered after this cannot matter.
+ */
+template<class V>
+inline float packetCutoff(const PacketState<V> &state) {
+    typedef typename V::F F;
+
+    F noHit = V::set1(-1.0f);
+    if (V::any(V::cmpeq(state.distance, noHit))) {
+        return INFINITY;
+    }
+    return -V::hmin(V::neg(state.distance));
+}
+
+/**
+ * Walk the BVH with the whole packet, descending while any lane enters a
+ * node, nearer child first.
+ */
+template<class V>
+inline void traversePacketBVH(const PacketScene &scene, PacketState<V> &state) {
+    typedef typename V::F F;
+
+    // Keep zero direction components away from 0 * inf in the slab test
+    const F tiny = V::set1(1e-20f);
+    const F d[3] = {state.dx, state.dy, state.dz};
+    F inverseDir[3];
+    for (int k = 0; k < 3; k++) {
+        F magnitude = V::max(d[k], V::neg(d[k]));
+        F safe = V::select(V::cmplt(magnitude, tiny), V::select(V::cmplt(d[k], V::set1(0.0f)), V::neg(tiny), tiny),
+                           d[k]);
+        inverseDir[k] = V::div(V::set1(1.0f), safe);
+    }
+
+    const BVHNode *nodes = scene.bvhNodes;
+    int stack[BVH_STACK_SIZE];
+    float stackEntry[BVH_STACK_SIZE];
+    int top = 0;
+
+    float entry;
+    if (!V::any(testPacketBox<V>(scene, nodes[0], inverseDir, state, entry))) {
+        return;
+    }
+    stack[top] = 0;
+    stackEntry[top++] = entry;
+
+    while (top > 0) {
+        top--;
+        if (stackEntry[top] > packetCutoff<V>(state)) {
+            continue;
+        }
+        const BVHNode &node = nodes[stack[top]];
+
+        if (node.count > 0) {
+            STATS_ADD(sphereTests, node.count * V::WIDTH);
+            for (int i = node.first; i < node.first + node.count; i++) {
+                testPacketSphere<V>(scene, scene.bvhPrimitives[i], state);
+            }
+            continue;
+        }
+
+        float entryLeft, entryRight;
+        bool hitLeft = V::any(testPacketBox<V>(scene, nodes[node.first], inverseDir, state, entryLeft));
+        bool hitRight = V::any(testPacketBox<V>(scene, nodes[node.first + 1], inverseDir, state, entryRight));
+        if (hitLeft && hitRight) {
+            // Push the far child first so the near one is popped next
+            bool leftFirst = entryLeft <= entryRight;
+            stack[top] = leftFirst ? node.first + 1 : node.first;
+            stackEntry[top++] = leftFirst ? entryRight : entryLeft;
+            stack[top] = leftFirst ? node.first : node.first + 1;
+            stackEntry[top++] = leftFirst ? entryLeft : entryRight;
+        } else if (hitLeft) {
+            stack[top] = node.first;
+            stackEntry[top++] = entryLeft;
+        } else if (hitRight) {
+            stack[top] = node.first + 1;
+            stackEntry[top++] = entryRight;
+        }
+    }
+}
+
+/**
+ * Nearest-hit test of V::WIDTH primary rays against every sphere, or the
+ * spheres of the BVH leaves they reach, followed by the point and normal
+ * of each hit.
+ */
+template<class V>
+void intersectPrimaryPacket(const PacketScene &scene, const PacketRays &rays, PacketHits &hits) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    const F zero = V::set1(0.0f);
+    const F one = V::set1(1.0f);
+    const F noHit = V::set1(-1.0f);
+
+    PacketState<V> state;
+    state.dx = V::load(rays.dir[0]);
+    state.dy = V::load(rays.dir[1]);
+    state.dz = V::load(rays.dir[2]);
+    state.dw = V::load(rays.dir[3]);
+    state.distance = noHit;
+    state.nearest = zero;
+    state.interior = zero;
+
+    if (scene.bvhNodes != NULL) {
+        traversePacketBVH<V>(scene, state);
+    } else {
+        for (int s = 0; s < scene.sphereCount; s++) {
+            testPacketSphere<V>(scene, s, state);
+        }
+        STATS_ADD(sphereTests, scene.sphereCount * V::WIDTH);
+    }
+
+    F dx = state.dx;
+    F dy = state.dy;
+    F dz = state.dz;
+    F dw = state.dw;
+    F distance = state.distance;
+    F nearest = state.nearest;
+    F interior = state.interior;
+
+    V::store(hits.distance, distance);
+    M hit = V::mnot(V::cmpeq(distance, noHit));
+    if (!V::any(hit)) {
+        return;
+    }
+
+    float nearestLanes[PACKET_MAX_WIDTH];
+    float interiorLanes[PACKET_MAX_WIDTH];
+    V::store(nearestLanes, nearest);
+    V::store(interiorLanes, interior);
+    for (int i = 0; i < V::WIDTH; i++) {
+        hits.sphere[i] = (int) nearestLanes[i];
+        hits.interiorPoint[i] = interiorLanes[i] != 0.0f;
+    }
+    const int *idx = hits.sphere;
+
+    // Calculate intersection point and normal
+    F px = V::add(V::set1(scene.eye[0]), V::mul(distance, dx));
+    F py = V::add(V::set1(scene.eye[1]), V::mul(distance, dy));
+    F pz = V::add(V::set1(scene.eye[2]), V::mul(distance, dz));
+    F pw = V::add(V::set1(scene.eye[3]), V::mul(distance, dw));
+
+    F nx = V::sub(px, V::gather(scene.position[0], idx));
+    F ny = V::sub(py, V::gather(scene.position[1], idx));
+    F nz = V::sub(pz, V::gather(scene.position[2], idx));
+    F nw = V::sub(pw, V::gather(scene.position[3], idx));
+
+    // Invert normal for interior points
+    M flip = V::cmpeq(interior, one);
+    nx = V::select(flip, V::neg(nx), nx);
+    ny = V::select(flip, V::neg(ny), ny);
+    nz = V::select(flip, V::neg(nz), nz);
+    nw = V::select(flip, V::neg(nw), nw);
+
+    F mx = gatherRow<V>(scene.normalMatrix, 0, idx, nx, ny, nz, nw);
+    F my = gatherRow<V>(scene.normalMatrix, 1, idx, nx, ny, nz, nw);
+    F mz = gatherRow<V>(scene.normalMatrix, 2, idx, nx, ny, nz, nw);
+    F mw = zero;
+
+    // normalize(): v * (1 / length(v))
+    F r = V::div(one, V::sqrt(dot4<V>(mx, my, mz, mw, mx, my, mz, mw)));
+
+    V::store(hits.point[0], px);
+    V::store(hits.point[1], py);
+    V::store(hits.point[2], pz);
+    V::store(hits.point[3], pw);
+    V::store(hits.normal[0], V::mul(r, mx));
+    V::store(hits.normal[1], V::mul(r, my));
+    V::store(hits.normal[2], V::mul(r, mz));
+    V::store(hits.normal[3], V::mul(r, mw));
+}
+
+} // namespace
+
+#endif // __PACKET_KERNEL_H__
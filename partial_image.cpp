@@ -0,0 +1,93 @@
+#include "partial_image.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace std;
+
+static size_t windowRowBytes(const PartialImageHeader &header) {
+    return framebufferPixelBytes((FramebufferFormat) header.framebufferFormat) * (size_t) (header.x1 - header.x0);
+}
+
+bool savePartialImage(const char *filename, const Framebuffer &frame, int imageWidth, int imageHeight, int x0,
+                      int y0) {
+    PartialImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PARTIAL_IMAGE_MAGIC, sizeof(PARTIAL_IMAGE_MAGIC));
+    header.version = PARTIAL_IMAGE_VERSION;
+    header.byteOrder = PARTIAL_IMAGE_BYTE_ORDER;
+    header.headerSize = sizeof(PartialImageHeader);
+    header.framebufferFormat = frame.format();
+    header.imageWidth = imageWidth;
+    header.imageHeight = imageHeight;
+    header.x0 = x0;
+    header.y0 = y0;
+    header.x1 = x0 + frame.width();
+    header.y1 = y0 + frame.height();
+    header.fileSize = sizeof(PartialImageHeader) + frame.size();
+
+    printf("Saving partial image %s: %d x %d at (%d, %d) of %d x %d\n", filename, frame.width(), frame.height(), x0,
+           y0, imageWidth, imageHeight);
+    string temporary = string(filename) + ".tmp";
+    FILE *fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", temporary.c_str());
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(frame.data(), 1, frame.size(), fp);
+
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(temporary.c_str(), filename) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("Unable to write file '%s'\n", filename);
+    }
+    return ok;
+}
+
+static bool validHeader(const PartialImageHeader &header, size_t fileSize) {
+    if (header.version != PARTIAL_IMAGE_VERSION || header.byteOrder != PARTIAL_IMAGE_BYTE_ORDER ||
+        header.headerSize != sizeof(PartialImageHeader) || header.fileSize != fileSize ||
+        header.framebufferFormat < 0 || header.framebufferFormat >= FRAMEBUFFER_FORMAT_COUNT) {
+        return false;
+    }
+    if (header.x0 < 0 || header.x0 >= header.x1 || header.x1 > header.imageWidth || header.y0 < 0 ||
+        header.y0 >= header.y1 || header.y1 > header.imageHeight) {
+        return false;
+    }
+    return fileSize - header.headerSize == windowRowBytes(header) * (size_t) (header.y1 - header.y0);
+}
+
+bool loadPartialImage(const char *filename, PartialImage &image) {
+    image.header = NULL;
+    image.pixels = NULL;
+    if (!mapFile(filename, image.file)) {
+        printf("Unable to open file '%s'\n", filename);
+        return false;
+    }
+
+    const PartialImageHeader *header = (const PartialImageHeader *) image.file.data;
+    if (image.file.size < sizeof(PartialImageHeader) ||
+        memcmp(header->magic, PARTIAL_IMAGE_MAGIC, sizeof(PARTIAL_IMAGE_MAGIC)) != 0 ||
+        !validHeader(*header, image.file.size)) {
+        printf("%s is not a partial image or was written by an incompatible version\n", filename);
+        unloadPartialImage(image);
+        return false;
+    }
+    image.header = header;
+    image.pixels = (const unsigned char *) image.file.data + header->headerSize;
+    return true;
+}
+
+void unloadPartialImage(PartialImage &image) {
+    unmapFile(image.file);
+    image.header = NULL;
+    image.pixels = NULL;
+}
+
+const unsigned char *partialImageRow(const PartialImage &image, int y) {
+    return image.pixels + windowRowBytes(*image.header) * y;
+}
@@ -0,0 +1,77 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- partial_image.h ---
+//
+//  Partial images for splitting one frame into jobs of an outside
+//  scheduler. Each job renders a window of the frame with --region and
+//  writes it as a partial image; merge_regions then puts the windows
+//  together into the PPM a single render would have written.
+//
+//  A partial image is a header followed by the window's framebuffer rows,
+//  top row first, in the framebuffer format the job rendered with, so a job
+//  run with --framebuffer rgb8 writes 3 bytes per pixel.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PARTIAL_IMAGE_H__
+#define __PARTIAL_IMAGE_H__
+
+#include "framebuffer.h"
+#include "mapped_file.h"
+
+#define PARTIAL_IMAGE_MAGIC "RTPART"
+#define PARTIAL_IMAGE_VERSION 1
+#define PARTIAL_IMAGE_BYTE_ORDER 0x01020304u
+
+/**
+ * File header. The window is columns [x0, x1) and rows [y0, y1) of an
+ * imageWidth x imageHeight frame, rows counted from the top as in the image
+ * file. The pixels start right after the header.
+ */
+struct PartialImageHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder;
+    unsigned int headerSize;
+    int framebufferFormat;
+    int imageWidth;
+    int imageHeight;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    unsigned long long fileSize;
+};
+
+/**
+ * A partial image read back from disk. header and pixels point into the
+ * mapped file, which stays mapped until unloadPartialImage().
+ */
+struct PartialImage {
+    MappedFile file;
+    const PartialImageHeader *header;
+    const unsigned char *pixels;
+};
+
+/**
+ * Write frame as the window of an imageWidth x imageHeight frame whose top
+ * left pixel is (x0, y0). The file is written next to filename and renamed
+ * over it, so a job that dies leaves no partial image behind.
+ */
+bool savePartialImage(const char *filename, const Framebuffer &frame, int imageWidth, int imageHeight, int x0,
+                      int y0);
+
+/**
+ * Map a partial image. Returns false, saying why, if it cannot be read or
+ * is not a partial image of this version and byte order.
+ */
+bool loadPartialImage(const char *filename, PartialImage &image);
+
+void unloadPartialImage(PartialImage &image);
+
+/**
+ * Row y of the window, y counted from the window's top.
+ */
+const unsigned char *partialImageRow(const PartialImage &image, int y);
+
+#endif // __PARTIAL_IMAGE_H__
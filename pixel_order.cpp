@@ -0,0 +1,92 @@
+#include "pixel_order.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+static const char *const s_orderNames[PIXEL_ORDER_COUNT] = {"rows", "morton", "hilbert"};
+
+const char *pixelOrderName(PixelOrder order) {
+    return s_orderNames[order];
+}
+
+bool findPixelOrder(const char *name, PixelOrder &order) {
+    for (int i = 0; i < PIXEL_ORDER_COUNT; i++) {
+        if (strcmp(s_orderNames[i], name) == 0) {
+            order = (PixelOrder) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Spread the low 16 bits of v out to the even bits.
+ */
+static unsigned int spreadBits(unsigned int v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+static unsigned long long mortonIndex(unsigned int x, unsigned int y) {
+    unsigned long long index = 0;
+    for (int shift = 0; shift < 32; shift += 16) {
+        unsigned long long word = spreadBits(x >> shift) | (spreadBits(y >> shift) << 1);
+        index |= word << (2 * shift);
+    }
+    return index;
+}
+
+/**
+ * Distance of (x, y) along the Hilbert curve through a side x side square,
+ * side a power of two.
+ */
+static unsigned long long hilbertIndex(unsigned int side, unsigned int x, unsigned int y) {
+    unsigned long long index = 0;
+    for (unsigned int s = side / 2; s > 0; s /= 2) {
+        unsigned int rx = (x & s) != 0;
+        unsigned int ry = (y & s) != 0;
+        index += (unsigned long long) s * s * ((3 * rx) ^ ry);
+        // Rotate the quadrant so the curve inside it starts and ends where the next level expects
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - (x & (s - 1));
+                y = s - 1 - (y & (s - 1));
+            }
+            swap(x, y);
+        }
+        x &= s - 1;
+        y &= s - 1;
+    }
+    return index;
+}
+
+void orderCells(PixelOrder order, int width, int height, vector<int> &cells) {
+    cells.resize((size_t) max(width, 0) * max(height, 0));
+    for (size_t i = 0; i < cells.size(); i++) {
+        cells[i] = (int) i;
+    }
+    if (order == PIXEL_ORDER_ROWS || cells.empty()) {
+        return;
+    }
+
+    unsigned int side = 1;
+    while (side < (unsigned int) max(width, height)) {
+        side *= 2;
+    }
+    vector<pair<unsigned long long, int>> keyed(cells.size());
+    for (size_t i = 0; i < cells.size(); i++) {
+        unsigned int x = (unsigned int) (i % width);
+        unsigned int y = (unsigned int) (i / width);
+        keyed[i].first = order == PIXEL_ORDER_MORTON ? mortonIndex(x, y) : hilbertIndex(side, x, y);
+        keyed[i].second = (int) i;
+    }
+    sort(keyed.begin(), keyed.end());
+    for (size_t i = 0; i < cells.size(); i++) {
+        cells[i] = keyed[i].second;
+    }
+}
@@ -0,0 +1,44 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- pixel_order.h ---
+//
+//  Orders in which tiles and the pixels within them are traced:
+//
+//    - rows: left to right, top to bottom
+//    - morton: the Z-order curve, interleaving the bits of x and y
+//    - hilbert: the Hilbert curve, which only ever steps to a neighbour
+//
+//  The curves keep consecutive rays close together on screen, so they tend
+//  to hit the same spheres and reach them through the same BVH nodes. The
+//  order never changes a pixel's color.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PIXEL_ORDER_H__
+#define __PIXEL_ORDER_H__
+
+#include <vector>
+
+enum PixelOrder {
+    PIXEL_ORDER_ROWS,
+    PIXEL_ORDER_MORTON,
+    PIXEL_ORDER_HILBERT,
+    PIXEL_ORDER_COUNT
+};
+
+const char *pixelOrderName(PixelOrder order);
+
+/**
+ * The order called name ("rows", "morton" or "hilbert"). Returns false for
+ * any other name.
+ */
+bool findPixelOrder(const char *name, PixelOrder &order);
+
+/**
+ * The cells of a width x height grid in the given order, as offsets
+ * y * width + x. Curves run over the smallest power-of-two square that
+ * holds the grid and skip the cells outside it.
+ */
+void orderCells(PixelOrder order, int width, int height, std::vector<int> &cells);
+
+#endif // __PIXEL_ORDER_H__
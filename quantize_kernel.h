@@ -0,0 +1,42 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- quantize_kernel.h ---
+//
+//  Conversion of float color channels to 8-bit values, V::WIDTH channels
+//  at a time. Channels are clamped to [0, 1] and scaled by 255.9, so every
+//  kernel gives the bytes the scalar tail loop does; NaN comes out as 255,
+//  like the fminf() clamp it replaces.
+//
+//  Only include this from simd*.cpp, after simd_lanes.h.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __QUANTIZE_KERNEL_H__
+#define __QUANTIZE_KERNEL_H__
+
+#include <cstddef>
+
+namespace {
+
+template<class V>
+void quantizeRGB8(const float *values, size_t count, unsigned char *out) {
+    typename V::F one = V::set1(1.0f);
+    typename V::F zero = V::set1(0.0f);
+    typename V::F scale = V::set1(255.9f);
+
+    size_t i = 0;
+    for (; i + V::WIDTH <= count; i += V::WIDTH) {
+        // min() returns its second operand for NaN
+        typename V::F value = V::max(V::min(V::load(values + i), one), zero);
+        V::storeBytes(out + i, V::mul(value, scale));
+    }
+    for (; i < count; i++) {
+        float value = values[i] < 1.0f ? values[i] : 1.0f;
+        value = value > 0.0f ? value : 0.0f;
+        out[i] = (unsigned char) (value * 255.9f);
+    }
+}
+
+} // namespace
+
+#endif // __QUANTIZE_KERNEL_H__
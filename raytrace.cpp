@@ -1,55 +1,26 @@
-#include "matm.h"
-#include <fstream>
+#include "raytrace.h"
+#include "mapped_file.h"
+#include "render_cache.h"
+#include "scene_file.h"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <deque>
+#include <mutex>
 #include <sstream>
-#include <vector>
-#include <map>
+#include <thread>
+#include <unordered_map>
 
 using namespace std;
 
-// Program constants
-#define MAX_SPHERES 5
-#define MAX_LIGHTS 5
-#define MIN_HIT_TIME 1.0f
-#define MIN_RELECT_HIT_TIME 0.0001f
-#define MAX_REFLECTIONS 3
-
-// STRUCTURES
-struct Ray {
-    vec4 origin;
-    vec4 dir;
-    int reflectionLevel;
-};
-
-struct Sphere {
-    string id;
-    vec4 position;
-    vec3 scale;
-    vec4 color;
-    float Ka;
-    float Kd;
-    float Ks;
-    float Kr;
-    float specularExponent;
-    mat4 inverseTransform;
-};
-
-struct Light {
-    string id;
-    vec4 position;
-    vec4 color;
-};
-
-struct Intersection {
-    Ray ray;
-    float distance;
-    vec4 point;
-    bool interiorPoint;
-    Sphere *sphere;
-    vec4 normal;
-};
-
-
-vector<vec4> g_colors;
+Framebuffer g_framebuffer;
+vector<unsigned int> g_costs;
 
 // SCENE DATA
 // Planes
@@ -63,31 +34,147 @@ float g_bottom;
 int g_width;
 int g_height;
 
-vector<Sphere> g_spheres;
-vector<Light> g_lights;
+SceneArray<Sphere> g_spheres;
+SceneArray<Light> g_lights;
+NameTable g_sphereIds;
+NameTable g_lightIds;
 vec4 g_backgroundColor;
 vec4 g_ambientIntensity;
 string g_outputFilename;
 
+// Acceleration structure
+Accelerator g_accelerator = ACCEL_NONE;
+
+// RENDER OPTIONS
+int g_threadCount = 0; // 0 selects the hardware concurrency
+int g_tileSize = DEFAULT_TILE_SIZE;
+bool g_streamOutput = false;
+int g_bandHeight = DEFAULT_BAND_HEIGHT;
+bool g_progressive = false;
+double g_timeBudget = 0; // Seconds; 0 means no limit
+bool g_wavefront = false;
+float g_refitThreshold = DEFAULT_REFIT_THRESHOLD;
+bool g_recordCosts = false;
+CostMetric g_costMetric = COST_CYCLES;
+string g_simdISA = "auto"; // "off" uses the scalar per-ray loops
+FramebufferFormat g_framebufferFormat = FRAMEBUFFER_RGB32F;
+PixelOrder g_pixelOrder = PIXEL_ORDER_ROWS;
+
 
 // -------------------------------------------------------------------
 // Input file parsing
 
-vec4 toVec4(const string &s1, const string &s2, const string &s3) {
-    stringstream ss(s1 + " " + s2 + " " + s3);
+/**
+ * A token of the scene file, pointing into the mapped file.
+ */
+struct Token {
+    const char *begin;
+    const char *end;
+
+    size_t size() const { return (size_t) (end - begin); }
+
+    bool operator==(const char *s) const {
+        return strlen(s) == size() && memcmp(begin, s, size()) == 0;
+    }
+
+    string str() const { return string(begin, end); }
+};
+
+// Powers of ten that are exact in a float
+static const float s_exactPowersOfTen[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+
+/**
+ * Parse a float the way "stringstream >> float" does: the longest prefix of
+ * the form [+-]digits[.digits][(e|E)[+-]digits], correctly rounded, or 0 if
+ * there is none. Short decimals are converted with a single exact float
+ * multiply or divide; anything else goes through strtof().
+ */
+float toFloat(const Token &token) {
+    const char *p = token.begin;
+    const char *end = token.end;
+
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        anyDigits = true;
+        if (mantissa != 0 || *p != '0') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (unsigned long long) (*p - '0');
+            } else {
+                exponent++;
+            }
+            digits++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            anyDigits = true;
+            if (mantissa != 0 || *p != '0') {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (unsigned long long) (*p - '0');
+                    exponent--;
+                }
+                digits++;
+            } else {
+                exponent--;
+            }
+        }
+    }
+    if (!anyDigits) {
+        return 0.0f;
+    }
+    const char *mantissaEnd = p;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExponent = false;
+        if (q < end && (*q == '+' || *q == '-')) {
+            negativeExponent = *q == '-';
+            q++;
+        }
+        if (q < end && *q >= '0' && *q <= '9') {
+            int value = 0;
+            for (; q < end && *q >= '0' && *q <= '9'; q++) {
+                value = min(value * 10 + (*q - '0'), 100000);
+            }
+            exponent += negativeExponent ? -value : value;
+            p = q;
+            mantissaEnd = q;
+        }
+    }
+
+    // Clinger's fast path: both operands are exact, so one rounding is all
+    if (digits <= 19 && mantissa <= (1ULL << 24) && exponent >= -10 && exponent <= 10) {
+        float value = (float) mantissa;
+        value = exponent < 0 ? value / s_exactPowersOfTen[-exponent] : value * s_exactPowersOfTen[exponent];
+        return negative ? -value : value;
+    }
+
+    string text(token.begin, mantissaEnd);
+    float value = strtof(text.c_str(), NULL);
+    // Like the stream, saturate on overflow instead of returning infinity
+    if (isinf(value)) {
+        value = value < 0 ? -FLT_MAX : FLT_MAX;
+    }
+    return value;
+}
+
+vec4 toVec4(const Token &t1, const Token &t2, const Token &t3) {
     vec4 result;
-    ss >> result.x >> result.y >> result.z;
+    result.x = toFloat(t1);
+    result.y = toFloat(t2);
+    result.z = toFloat(t3);
     result.w = 1.0f;
     return result;
 }
 
-float toFloat(const string &s) {
-    stringstream ss(s);
-    float f;
-    ss >> f;
-    return f;
-}
-
 enum Datatypes {
     NEAR,
     LEFT,
@@ -99,30 +186,75 @@ enum Datatypes {
     LIGHT,
     BACK,
     AMBIENT,
-    OUTPUT
+    OUTPUT,
+    ACCEL,
+    UNKNOWN
 };
-static map<string, Datatypes> s_datatypes;
-
-void initializeDatatypes() {
-    s_datatypes["NEAR"] = NEAR;
-    s_datatypes["LEFT"] = LEFT;
-    s_datatypes["RIGHT"] = RIGHT;
-    s_datatypes["TOP"] = TOP;
-    s_datatypes["BOTTOM"] = BOTTOM;
-    s_datatypes["RES"] = RES;
-    s_datatypes["SPHERE"] = SPHERE;
-    s_datatypes["LIGHT"] = LIGHT;
-    s_datatypes["BACK"] = BACK;
-    s_datatypes["AMBIENT"] = AMBIENT;
-    s_datatypes["OUTPUT"] = OUTPUT;
-}
-
-void parseLine(const vector<string> &vs) {
-    if (vs[0].empty()) {
-        return;
+
+/**
+ * Keyword of a line, dispatched on its length.
+ */
+Datatypes toDatatype(const Token &keyword) {
+    switch (keyword.size()) {
+        case 3:
+            if (keyword == "TOP") return TOP;
+            if (keyword == "RES") return RES;
+            break;
+        case 4:
+            if (keyword == "NEAR") return NEAR;
+            if (keyword == "LEFT") return LEFT;
+            if (keyword == "BACK") return BACK;
+            break;
+        case 5:
+            if (keyword == "RIGHT") return RIGHT;
+            if (keyword == "LIGHT") return LIGHT;
+            if (keyword == "ACCEL") return ACCEL;
+            break;
+        case 6:
+            if (keyword == "BOTTOM") return BOTTOM;
+            if (keyword == "SPHERE") return SPHERE;
+            if (keyword == "OUTPUT") return OUTPUT;
+            break;
+        case 7:
+            if (keyword == "AMBIENT") return AMBIENT;
+            break;
     }
+    return UNKNOWN;
+}
+
+/**
+ * isspace() in the "C" locale, without the locale lookup.
+ */
+static inline bool isSpace(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Longest line the parser reads; SPHERE needs 16 tokens
+#define MAX_LINE_TOKENS 16
+
+Sphere parseSphere(const Token *vs) {
+    Sphere sphere;
+    sphere.position = toVec4(vs[2], vs[3], vs[4]);
+    sphere.scale = vec3(toFloat(vs[5]), toFloat(vs[6]), toFloat(vs[7]));
+    sphere.color = toVec4(vs[8], vs[9], vs[10]);
+    sphere.Ka = toFloat(vs[11]);
+    sphere.Kd = toFloat(vs[12]);
+    sphere.Ks = toFloat(vs[13]);
+    sphere.Kr = toFloat(vs[14]);
+    sphere.specularExponent = toFloat(vs[15]);
+    return sphere;
+}
+
+Light parseLight(const Token *vs) {
+    Light light;
+    light.position = toVec4(vs[2], vs[3], vs[4]);
+    light.color = toVec4(vs[5], vs[6], vs[7]);
+    light.radius = vs[8].size() > 0 ? fmaxf(toFloat(vs[8]), 0.0f) : 0.0f;
+    return light;
+}
 
-    switch (s_datatypes[vs[0]]) {
+void parseLine(const Token *vs) {
+    switch (toDatatype(vs[0])) {
         case NEAR:
             g_near = toFloat(vs[1]);
             break;
@@ -141,34 +273,14 @@ void parseLine(const vector<string> &vs) {
         case RES:
             g_width = (int) toFloat(vs[1]);
             g_height = (int) toFloat(vs[2]);
-            g_colors.resize((unsigned int) (g_width * g_height));
             break;
         case SPHERE:
-            if (g_spheres.size() < MAX_SPHERES) {
-                Sphere sphere;
-                sphere.id = vs[1];
-                sphere.position = toVec4(vs[2], vs[3], vs[4]);
-                sphere.scale = vec3(toFloat(vs[5]), toFloat(vs[6]), toFloat(vs[7]));
-                sphere.color = toVec4(vs[8], vs[9], vs[10]);
-                sphere.Ka = toFloat(vs[11]);
-                sphere.Kd = toFloat(vs[12]);
-                sphere.Ks = toFloat(vs[13]);
-                sphere.Kr = toFloat(vs[14]);
-                sphere.specularExponent = toFloat(vs[15]);
-                InvertMatrix(Scale(sphere.scale), sphere.inverseTransform);
-
-                g_spheres.push_back(sphere);
-            }
+            g_sphereIds.push_back(vs[1].begin, vs[1].end);
+            g_spheres.push_back(parseSphere(vs));
             break;
         case LIGHT:
-            if (g_lights.size() < MAX_LIGHTS) {
-                Light light;
-                light.id = vs[1];
-                light.position = toVec4(vs[2], vs[3], vs[4]);
-                light.color = toVec4(vs[5], vs[6], vs[7]);
-
-                g_lights.push_back(light);
-            }
+            g_lightIds.push_back(vs[1].begin, vs[1].end);
+            g_lights.push_back(parseLight(vs));
             break;
         case BACK:
             g_backgroundColor = toVec4(vs[1], vs[2], vs[3]);
@@ -177,257 +289,2403 @@ void parseLine(const vector<string> &vs) {
             g_ambientIntensity = toVec4(vs[1], vs[2], vs[3]);
             break;
         case OUTPUT:
-            g_outputFilename = vs[1];
+            g_outputFilename = vs[1].str();
+            break;
+        case ACCEL:
+            if (vs[1] == "NONE") {
+                g_accelerator = ACCEL_NONE;
+            } else if (vs[1] == "BVH") {
+                g_accelerator = ACCEL_BVH;
+            } else if (vs[1] == "GRID") {
+                g_accelerator = ACCEL_GRID;
+            } else {
+                cout << "Unknown accelerator " << vs[1].str() << ", testing every sphere" << endl;
+                g_accelerator = ACCEL_NONE;
+            }
+            break;
+        case UNKNOWN:
             break;
     }
 }
 
+/**
+ * Split [p, end) into lines of tokens without copying and hand each
+ * non-empty line to handleLine.
+ */
+void parseLines(const char *p, const char *end, void (*handleLine)(const Token *)) {
+    Token vs[MAX_LINE_TOKENS];
+    while (p < end) {
+        // Split one line into whitespace separated tokens; missing ones are empty
+        int count = 0;
+        while (p < end && *p != '\n') {
+            if (isSpace(*p)) {
+                p++;
+                continue;
+            }
+            const char *begin = p;
+            while (p < end && !isSpace(*p)) {
+                p++;
+            }
+            if (count < MAX_LINE_TOKENS) {
+                vs[count].begin = begin;
+                vs[count].end = p;
+                count++;
+            }
+        }
+        p++;
+
+        if (count == 0) {
+            continue;
+        }
+        for (int i = count; i < MAX_LINE_TOKENS; i++) {
+            vs[i].begin = vs[i].end = p;
+        }
+        handleLine(vs);
+    }
+}
+
+/**
+ * Load a scene file. Binary scenes are used straight from the mapped file.
+ * Text scenes are parsed in place: the file is split into tokens without
+ * copying, and only numbers that do not fit the fast float path allocate.
+ */
 void loadFile(const char *filename) {
-    ifstream is(filename);
-    if (is.fail()) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    MappedFile file;
+    if (!mapFile(filename, file)) {
         cout << "Could not open file " << filename << endl;
         exit(1);
     }
-    string s;
-    vector<string> vs;
-    while (!is.eof()) {
-        vs.clear();
-        getline(is, s);
-        istringstream iss(s);
-        while (!iss.eof()) {
-            string sub;
-            iss >> sub;
-            vs.push_back(sub);
+    double megabytes = file.size / (1024.0 * 1024.0);
+
+    if (isBinaryScene(file)) {
+        if (!loadBinaryScene(filename, file)) {
+            exit(1);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        addPhaseTime(PHASE_PARSE, seconds);
+        cout << "Mapped " << filename << ": " << fixed << setprecision(2) << megabytes << " MB, "
+             << g_spheres.size() << " spheres in " << setprecision(1) << seconds * 1e3 << " ms" << defaultfloat
+             << endl;
+        return;
+    }
+
+    adviseSequential(file);
+    const char *p = file.data;
+    const char *end = file.data + file.size;
+
+    // Nearly every line of a big scene is a sphere, so size for one per line
+    size_t lines = 1;
+    for (const char *q = p; (q = (const char *) memchr(q, '\n', (size_t) (end - q))) != NULL; q++) {
+        lines++;
+    }
+    g_spheres.reserve(g_spheres.size() + lines);
+    g_sphereIds.reserve(g_sphereIds.size() + lines);
+
+    parseLines(p, end, parseLine);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    addPhaseTime(PHASE_PARSE, seconds);
+    cout << "Parsed " << filename << ": " << fixed << setprecision(2) << megabytes << " MB in "
+         << setprecision(1) << seconds * 1e3 << " ms (" << (seconds > 0 ? megabytes / seconds : 0.0) << " MB/s)"
+         << defaultfloat << endl;
+    unmapFile(file);
+}
+
+/**
+ * Forget the loaded scene, leaving the scene data as it is at startup.
+ */
+void clearScene() {
+    g_near = g_left = g_right = g_top = g_bottom = 0;
+    g_width = g_height = 0;
+    g_spheres.clear();
+    g_lights.clear();
+    g_sphereIds.clear();
+    g_lightIds.clear();
+    g_backgroundColor = vec4();
+    g_ambientIntensity = vec4();
+    g_outputFilename.clear();
+    g_accelerator = ACCEL_NONE;
+}
+
+/**
+ * Replace the scene with a text or binary scene file held in memory. Takes
+ * over the buffer, which must be heap memory like an unmapped MappedFile.
+ * Returns false, leaving an empty scene, if a binary scene is malformed.
+ */
+bool loadSceneBuffer(const char *name, MappedFile &buffer) {
+    clearScene();
+    if (isBinaryScene(buffer)) {
+        if (loadBinaryScene(name, buffer)) {
+            return true;
         }
-        parseLine(vs);
+        unmapFile(buffer);
+        return false;
     }
+
+    parseLines(buffer.data, buffer.data + buffer.size, parseLine);
+    unmapFile(buffer);
+    return true;
 }
 
 
 // -------------------------------------------------------------------
-// Utilities
+// Scene compilation
+
+void compileSphere(unsigned int i) {
+    Sphere &sphere = g_spheres.owned(i);
+    if (sphere.scale.x == 0 || sphere.scale.y == 0 || sphere.scale.z == 0) {
+        cout << "Sphere " << g_sphereIds[i] << " has a zero scale and cannot be inverted" << endl;
+        sphere.inverseTransform = mat4();
+    } else {
+        sphere.inverseTransform = Scale(1.0f / sphere.scale.x, 1.0f / sphere.scale.y, 1.0f / sphere.scale.z);
+    }
+    sphere.normalMatrix = transpose(sphere.inverseTransform) * sphere.inverseTransform;
 
-void setColor(int ix, int iy, const vec4 &color) {
-    int iy2 = g_height - iy - 1; // Invert iy coordinate.
-    g_colors[iy2 * g_width + ix] = color;
+    sphere.reflective = sphere.Kr != 0;
+    sphere.lit = sphere.Kd != 0 || sphere.Ks != 0;
 }
 
 /**
- * Determine the nearest sphere intersection of a ray.
+ * Derive everything the tracer needs per sphere that only depends on the
+ * scene: the inverse of the diagonal scale matrix in closed form, the
+ * matrix that maps object space normals to world space, and which parts of
+ * the shading the material can actually see.
  */
-Intersection calculateNearestIntersection(const Ray &ray) {
-    Intersection intersection;
-    intersection.ray = ray;
-    intersection.distance = -1;
-    intersection.interiorPoint = false;
-
-    for (Sphere &sphere : g_spheres) {
-        vec4 S = sphere.inverseTransform * (sphere.position - ray.origin); // -(O - C)
-        vec4 C = sphere.inverseTransform * ray.dir;
+void compileScene() {
+    // Binary scenes are stored compiled
+    if (g_spheres.isMapped()) {
+        return;
+    }
 
-        // Quadratic equation: |c|^2t^2 + 2(S.tc) + |S|^2 - 1
-        float a = dot(C, C);
-        float b = dot(S, C);
-        float c = dot(S, S) - 1;
+    for (unsigned int i = 0; i < g_spheres.size(); i++) {
+        compileSphere(i);
+    }
+}
 
-        // Solve equation
-        float solution;
-        float discriminant = b * b - a * c; // Value under the root
 
-        bool interiorPoint = false;
+// -------------------------------------------------------------------
+// Sphere store
 
-        if (discriminant < 0) {
-            // No solutions: line does not intersect
-            continue;
-        } else if (discriminant == 0) {
-            // Single solution: line intersects at one point
-            solution = b / a;
-        } else {
-            // Two solutions: line intersects at two points
-            float root = sqrtf(discriminant);
-            float solution1 = (b - root) / a;
-            float solution2 = (b + root) / a;
+SphereStore g_sphereStore;
 
-            // Use the smallest valid solution
-            solution = fminf(solution1, solution2);
-            if (solution <= MIN_RELECT_HIT_TIME || (ray.reflectionLevel == 0 && solution <= MIN_HIT_TIME)) {
-                solution = fmaxf(solution1, solution2);
-                interiorPoint = true;
-            }
-        }
+// Backing storage for g_sphereStore
+vector<float> s_storeCenter[3];
+vector<float> s_storeInverseScale[3];
+vector<int> s_storeMaterial;
 
-        // Validate solution
-        if (solution <= MIN_RELECT_HIT_TIME || (ray.reflectionLevel == 0 && solution <= MIN_HIT_TIME)) {
-            continue;
-        }
+static void storeSphere(int i) {
+    const Sphere &sphere = g_spheres[i];
+    for (int k = 0; k < 3; k++) {
+        s_storeCenter[k][i] = sphere.position[k];
+        s_storeInverseScale[k][i] = sphere.inverseTransform[k][k];
+    }
+    s_storeMaterial[i] = i;
+}
 
-        if ((intersection.distance == -1 || solution < intersection.distance)) {
-            intersection.distance = solution;
-            intersection.sphere = &sphere;
-            intersection.interiorPoint = interiorPoint;
-        }
+/**
+ * Pack the fields the intersection test reads into g_sphereStore, padded to
+ * a whole number of SPHERE_BLOCKs. The inverse scale is read off the
+ * diagonal of inverseTransform rather than recomputed so the kernel sees the
+ * exact values the scalar path multiplies by.
+ */
+void buildSphereStore() {
+    // Binary scenes carry their store
+    if (g_spheres.isMapped()) {
+        return;
     }
 
-    // Calculate intersection point and normal
-    if (intersection.distance != -1) {
-        intersection.point = ray.origin + ray.dir * intersection.distance;
+    int count = (int) g_spheres.size();
+    int paddedCount = (count + SPHERE_BLOCK - 1) / SPHERE_BLOCK * SPHERE_BLOCK;
 
-        vec4 normal = intersection.point - intersection.sphere->position;
-        // Invert normal for interior points
-        if (intersection.interiorPoint) {
-            normal = -normal;
-        }
+    for (int k = 0; k < 3; k++) {
+        s_storeCenter[k].assign((unsigned int) paddedCount, 0.0f);
+        s_storeInverseScale[k].assign((unsigned int) paddedCount, 0.0f);
+    }
+    s_storeMaterial.assign((unsigned int) paddedCount, 0);
 
-        mat4 trans = transpose(intersection.sphere->inverseTransform);
-        normal = trans * intersection.sphere->inverseTransform * normal;
-        normal.w = 0;
-        intersection.normal = normalize(normal);
+    for (int i = 0; i < count; i++) {
+        storeSphere(i);
     }
 
-    return intersection;
+    g_sphereStore.count = count;
+    g_sphereStore.paddedCount = paddedCount;
+    for (int k = 0; k < 3; k++) {
+        g_sphereStore.center[k] = s_storeCenter[k].data();
+        g_sphereStore.inverseScale[k] = s_storeInverseScale[k].data();
+    }
+    g_sphereStore.material = s_storeMaterial.data();
 }
 
 /**
- * Trace the color of a ray.
+ * Repack the slots of the given spheres after they changed. The sphere count
+ * must be the same as at the last buildSphereStore().
  */
-vec4 trace(const Ray &ray) {
-    // Limit reflection level
-    if (ray.reflectionLevel >= MAX_REFLECTIONS) {
-        return vec4();
+void updateSphereStore(const vector<int> &spheres) {
+    for (int i : spheres) {
+        storeSphere(i);
     }
+}
 
-    // Get the nearest intersecting sphere
-    Intersection intersection = calculateNearestIntersection(ray);
 
-    if (intersection.distance == -1 && ray.reflectionLevel == 0) {
-        // Return background color if no intersection and is an initial ray
-        return g_backgroundColor;
-    } else if (intersection.distance == -1) {
-        // Return no color if no intersection and not an initial ray
-        return vec4();
+// -------------------------------------------------------------------
+// Bounding volume hierarchy
+
+BVH g_bvh;
+
+/**
+ * Axis-aligned bounds of every ellipsoid. The bounds are padded slightly so
+ * that rounding in the hit point never puts a grazing hit outside them.
+ */
+vector<SphereBounds> computeSphereBounds() {
+    vector<SphereBounds> bounds(g_spheres.size());
+    for (unsigned int i = 0; i < g_spheres.size(); i++) {
+        const Sphere &sphere = g_spheres[i];
+        for (int k = 0; k < 3; k++) {
+            float extent = fabsf(sphere.scale[k]);
+            float pad = 1e-4f * (extent + fabsf(sphere.position[k])) + 1e-6f;
+            bounds[i].min[k] = sphere.position[k] - extent - pad;
+            bounds[i].max[k] = sphere.position[k] + extent + pad;
+        }
     }
+    return bounds;
+}
 
-    // Calculate initial intersection color with ambient intensity
-    vec4 color = intersection.sphere->color * intersection.sphere->Ka * g_ambientIntensity;
+void buildSceneBVH() {
+    buildBVH(computeSphereBounds(), g_bvh);
+}
 
-    // Calculate Blinn-Phong shading from light sources
-    vec4 diffusion = vec4(0, 0, 0, 0);
-    vec4 specular = vec4(0, 0, 0, 0);
-    for (Light light : g_lights) {
-        // Generate ray from intersection point to light
-        Ray lightRay;
-        lightRay.origin = intersection.point;
-        lightRay.dir = normalize(light.position - intersection.point);
 
-        // Determine if the light source is not obstructed
-        Intersection lightIntersection = calculateNearestIntersection(lightRay);
-        if (lightIntersection.distance == -1) {
-            // Calculate the intensity of diffuse light
-            float diffusionIntensity = dot(intersection.normal, lightRay.dir);
-            if (diffusionIntensity > 0) {
-                diffusion += diffusionIntensity * light.color * intersection.sphere->color;
+// -------------------------------------------------------------------
+// Uniform grid
 
-                // Calculate the half vector between light vector and the view vector
-                vec4 H = normalize(lightRay.dir - ray.dir);
+Grid g_grid;
 
-                // Calculate the intensity of specular light
-                float specularIntensity = dot(intersection.normal, H);
-                specular += powf(powf(specularIntensity, intersection.sphere->specularExponent), 3) * light.color;
-            }
+void buildSceneGrid() {
+    buildGrid(computeSphereBounds(), g_grid);
+}
+
+
+// -------------------------------------------------------------------
+// Light index
+
+LightIndex g_lightIndex;
+
+void buildLightIndex() {
+    g_lightIndex.unbounded.clear();
+    vector<int> bounded;
+    vector<SphereBounds> bounds;
+    for (unsigned int l = 0; l < g_lights.size(); l++) {
+        const Light &light = g_lights[l];
+        if (light.radius <= 0) {
+            g_lightIndex.unbounded.push_back((int) l);
+            continue;
+        }
+        SphereBounds reach;
+        for (int k = 0; k < 3; k++) {
+            float pad = 1e-4f * (light.radius + fabsf(light.position[k])) + 1e-6f;
+            reach.min[k] = light.position[k] - light.radius - pad;
+            reach.max[k] = light.position[k] + light.radius + pad;
         }
+        bounded.push_back((int) l);
+        bounds.push_back(reach);
     }
 
-    // Apply diffusion and specular values
-    color += diffusion * intersection.sphere->Kd + specular * intersection.sphere->Ks;
+    buildGrid(bounds, g_lightIndex.grid);
+    // The grid lists bounded lights by their position in bounds, which keeps scene order
+    for (int &entry : g_lightIndex.grid.cellSpheres) {
+        entry = bounded[entry];
+    }
+}
 
-    // Calculate reflections
-    Ray reflectRay;
-    reflectRay.origin = intersection.point;
-    reflectRay.dir = normalize(ray.dir - 2.0f * intersection.normal * dot(intersection.normal, ray.dir));
-    reflectRay.reflectionLevel = ray.reflectionLevel + 1;
-    color += trace(reflectRay) * intersection.sphere->Kr;
 
-    return color;
-}
+// -------------------------------------------------------------------
+// Utilities
 
 /**
- * Return the direction from the origin to a pixel.
+ * Destination of a render: columns [x0, x1) of rows [y0, y1) of the image,
+ * stored in frame with column x0 first and the top row (y1 - 1) first, in
+ * the order they appear in the file.
+ * If hits is not NULL it receives, laid out the same way, the index of the
+ * sphere each pixel's primary ray hit, or -1, and refined whether
+ * anti-aliasing took more samples in the pixel. If costs is not NULL it
+ * receives the work spent on each pixel, in g_costMetric units.
  */
-vec4 getDir(int ix, int iy) {
-    float x = g_left + ((float) ix / g_width) * (g_right - g_left);
-    float y = g_bottom + ((float) iy / g_height) * (g_top - g_bottom);
-    return vec4(x, y, -g_near, 0.0f);
-}
+struct RenderTarget {
+    Framebuffer *frame;
+    int *hits;
+    unsigned char *refined;
+    unsigned int *costs;
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+};
 
-void renderPixel(int ix, int iy) {
-    Ray ray;
-    ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
-    ray.dir = getDir(ix, iy);
-    ray.reflectionLevel = 0;
-    vec4 color = trace(ray);
-    setColor(ix, iy, color);
+int targetRow(const RenderTarget &target, int iy) {
+    return target.y1 - iy - 1; // Invert iy coordinate.
 }
 
-void render() {
-    for (int iy = 0; iy < g_height; iy++)
-        for (int ix = 0; ix < g_width; ix++)
-            renderPixel(ix, iy);
+size_t targetOffset(const RenderTarget &target, int iy) {
+    return (size_t) targetRow(target, iy) * (target.x1 - target.x0);
 }
 
+/**
+ * Intersect a ray with one sphere. Returns false if the sphere is missed or
+ * only hit before the ray's minimum hit time.
+ */
+bool intersectSphere(const Sphere &sphere, const Ray &ray, float &solution, bool &interiorPoint) {
+    STATS_ADD(sphereTests, 1);
+    vec4 S = sphere.inverseTransform * (sphere.position - ray.origin); // -(O - C)
+    vec4 C = sphere.inverseTransform * ray.dir;
+
+    // Quadratic equation: |c|^2t^2 + 2(S.tc) + |S|^2 - 1
+    float a = dot(C, C);
+    float b = dot(S, C);
+    float c = dot(S, S) - 1;
+
+    // Solve equation
+    float discriminant = b * b - a * c; // Value under the root
+
+    interiorPoint = false;
+
+    if (discriminant < 0) {
+        // No solutions: line does not intersect
+        return false;
+    } else if (discriminant == 0) {
+        // Single solution: line intersects at one point
+        solution = b / a;
+    } else {
+        // Two solutions: line intersects at two points
+        float root = sqrtf(discriminant);
+        float solution1 = (b - root) / a;
+        float solution2 = (b + root) / a;
+
+        // Use the smallest valid solution
+        solution = fminf(solution1, solution2);
+        if (solution <= MIN_RELECT_HIT_TIME || (ray.reflectionLevel == 0 && solution <= MIN_HIT_TIME)) {
+            solution = fmaxf(solution1, solution2);
+            interiorPoint = true;
+        }
+    }
 
-// -------------------------------------------------------------------
-// PPM saving
+    // Validate solution
+    return !(solution <= MIN_RELECT_HIT_TIME || (ray.reflectionLevel == 0 && solution <= MIN_HIT_TIME));
+}
 
-void savePPM(int Width, int Height, const char *fname, unsigned char *pixels) {
-    FILE *fp;
-    const int maxVal = 255;
+/**
+ * Find the nearest sphere along a ray by testing every sphere in turn.
+ */
+void findNearestSphere(const Ray &ray, Intersection &intersection) {
+    for (const Sphere &sphere : g_spheres) {
+        float solution;
+        bool interiorPoint;
+        if (!intersectSphere(sphere, ray, solution, interiorPoint)) {
+            continue;
+        }
 
-    printf("Saving image %s: %d x %d\n", fname, Width, Height);
-    fp = fopen(fname, "wb");
-    if (!fp) {
-        printf("Unable to open file '%s'\n", fname);
-        return;
+        if ((intersection.distance == -1 || solution < intersection.distance)) {
+            intersection.distance = solution;
+            intersection.sphere = &sphere;
+            intersection.interiorPoint = interiorPoint;
+        }
     }
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n", Width, Height);
-    fprintf(fp, "%d\n", maxVal);
+}
+
+/**
+ * Fill in the sphere kernel query for a ray. The query is unbounded unless
+ * the caller sets maxDistance.
+ */
+void buildSphereQuery(const Ray &ray, SphereQuery &query) {
+    for (int k = 0; k < 3; k++) {
+        query.origin[k] = ray.origin[k];
+        query.dir[k] = ray.dir[k];
+    }
+    // Both hit time limits are inclusive, so only the larger one matters
+    query.minHitTime = ray.reflectionLevel == 0 ? fmaxf(MIN_HIT_TIME, MIN_RELECT_HIT_TIME) : MIN_RELECT_HIT_TIME;
+    query.maxDistance = INFINITY;
+}
 
-    for (int j = 0; j < Height; j++) {
-        fwrite(&pixels[j * Width * 3], 3, Width, fp);
+/**
+ * Find the nearest sphere along a ray with the sphere block kernel.
+ */
+void findNearestSphereBlocks(const Ray &ray, Intersection &intersection) {
+    SphereQuery query;
+    buildSphereQuery(ray, query);
+
+    SphereHit hit;
+    g_simdKernels->intersectSpheres(g_sphereStore, query, hit);
+    if (hit.distance != -1) {
+        intersection.distance = hit.distance;
+        intersection.sphere = &g_spheres[g_sphereStore.material[hit.slot]];
+        intersection.interiorPoint = hit.interiorPoint;
     }
+}
 
-    fclose(fp);
+/**
+ * Find the nearest sphere along a ray through the scene's acceleration
+ * structure.
+ */
+void findNearestSphereAccelerated(const Ray &ray, Intersection &intersection) {
+    SphereQuery query;
+    buildSphereQuery(ray, query);
+
+    SphereHit hit;
+    if (g_accelerator == ACCEL_GRID) {
+        intersectGrid(g_grid, g_sphereStore, query, hit);
+    } else {
+        intersectBVH(g_bvh, g_sphereStore, query, hit);
+    }
+    if (hit.distance != -1) {
+        intersection.distance = hit.distance;
+        intersection.sphere = &g_spheres[g_sphereStore.material[hit.slot]];
+        intersection.interiorPoint = hit.interiorPoint;
+    }
 }
 
-void saveFile() {
-    // Convert color components from floats to unsigned chars.
-    unsigned char *buf = new unsigned char[g_width * g_height * 3];
-    for (int y = 0; y < g_height; y++)
-        for (int x = 0; x < g_width; x++)
-            for (int i = 0; i < 3; i++) {
-                float color = ((float *) g_colors[y * g_width + x])[i];
-                color = fminf(color, 1); // Clamp color value to 1
-                buf[y * g_width * 3 + x * 3 + i] = (unsigned char) (color * 255.9f);
-            }
+/**
+ * Calculate the point and normal of a hit whose sphere and distance are known.
+ */
+void completeIntersection(Intersection &intersection) {
+    if (intersection.distance == -1) {
+        return;
+    }
+    const Ray &ray = intersection.ray;
+    intersection.point = ray.origin + ray.dir * intersection.distance;
 
-    // Use provided output filename
-    savePPM(g_width, g_height, g_outputFilename.c_str(), buf);
-    delete[] buf;
+    vec4 normal = intersection.point - intersection.sphere->position;
+    // Invert normal for interior points
+    if (intersection.interiorPoint) {
+        normal = -normal;
+    }
+
+    normal = intersection.sphere->normalMatrix * normal;
+    normal.w = 0;
+    intersection.normal = normalize(normal);
 }
 
+/**
+ * Determine the nearest sphere intersection of a ray.
+ */
+Intersection calculateNearestIntersection(const Ray &ray) {
+    Intersection intersection;
+    intersection.ray = ray;
+    intersection.distance = -1;
+    intersection.interiorPoint = false;
 
-// -------------------------------------------------------------------
-// Main
+    if (g_accelerator != ACCEL_NONE) {
+        findNearestSphereAccelerated(ray, intersection);
+    } else if (g_simdKernels != NULL) {
+        findNearestSphereBlocks(ray, intersection);
+    } else {
+        findNearestSphere(ray, intersection);
+    }
+    STATS_ADD(primaryRays, ray.reflectionLevel == 0);
+    STATS_ADD(reflectionRays, ray.reflectionLevel != 0);
+    STATS_ADD(hits, intersection.distance != -1);
 
-int main(int argc, char *argv[]) {
-    initializeDatatypes();
+    completeIntersection(intersection);
+    return intersection;
+}
 
-    if (argc < 2) {
-        cout << "Usage: template-rt <input_file.txt>" << endl;
-        exit(1);
+/**
+ * The hit of a ray on one given sphere, as calculateNearestIntersection()
+ * reports it when that sphere is the nearest.
+ */
+Intersection intersectOneSphere(const Ray &ray, const Sphere &sphere) {
+    Intersection intersection;
+    intersection.ray = ray;
+    intersection.distance = -1;
+    intersection.interiorPoint = false;
+
+    float solution;
+    bool interiorPoint;
+    if (intersectSphere(sphere, ray, solution, interiorPoint)) {
+        intersection.distance = solution;
+        intersection.interiorPoint = interiorPoint;
+        intersection.sphere = &sphere;
+    }
+
+    completeIntersection(intersection);
+    return intersection;
+}
+
+/**
+ * Per-thread index of the sphere that last blocked each light, or -1.
+ * Neighbouring shadow rays tend to be blocked by the same sphere, so it is
+ * tested before anything else. The cache is only a hint: a stale entry
+ * costs one sphere test.
+ */
+static thread_local vector<int> s_lastOccluder;
+
+/**
+ * Find any sphere between the origin of a shadow ray and a light. The ray
+ * direction must be normalized so that lightDistance is in ray time.
+ * Returns the sphere index, or -1 if the light is visible.
+ */
+int findOccluder(const Ray &lightRay, float lightDistance) {
+    if (g_simdKernels == NULL && g_accelerator == ACCEL_NONE) {
+        for (unsigned int i = 0; i < g_spheres.size(); i++) {
+            float solution;
+            bool interiorPoint;
+            if (intersectSphere(g_spheres[i], lightRay, solution, interiorPoint) && solution < lightDistance) {
+                return (int) i;
+            }
+        }
+        return -1;
+    }
+
+    SphereQuery query;
+    buildSphereQuery(lightRay, query);
+    query.maxDistance = lightDistance;
+
+    int slot;
+    if (g_accelerator == ACCEL_BVH) {
+        slot = findOccluderBVH(g_bvh, g_sphereStore, query);
+    } else if (g_accelerator == ACCEL_GRID) {
+        slot = findOccluderGrid(g_grid, g_sphereStore, query);
+    } else {
+        slot = g_simdKernels->findOccluder(g_sphereStore, query);
+    }
+    return slot == -1 ? -1 : g_sphereStore.material[slot];
+}
+
+/**
+ * Determine whether a light is blocked from a point, trying the sphere that
+ * last blocked the same light first.
+ */
+bool isOccluded(const Ray &lightRay, float lightDistance, int lightIndex) {
+    STATS_ADD(shadowRays, 1);
+    if (s_lastOccluder.size() != g_lights.size()) {
+        s_lastOccluder.assign(g_lights.size(), -1);
+    }
+
+    int cached = s_lastOccluder[lightIndex];
+    if (cached >= 0 && cached < (int) g_spheres.size()) {
+        float solution;
+        bool interiorPoint;
+        if (intersectSphere(g_spheres[cached], lightRay, solution, interiorPoint) && solution < lightDistance) {
+            STATS_ADD(occludedLightSamples, 1);
+            return true;
+        }
+    }
+
+    int occluder = findOccluder(lightRay, lightDistance);
+    if (occluder != -1) {
+        s_lastOccluder[lightIndex] = occluder;
+        STATS_ADD(occludedLightSamples, 1);
+    }
+    return occluder != -1;
+}
+
+vec4 trace(const Ray &ray);
+
+bool makeShadowRay(const Ray &ray, const Intersection &intersection, const Light &light, Ray &lightRay,
+                   float &lightDistance) {
+    vec4 toLight = light.position - intersection.point;
+    lightDistance = length(toLight);
+    if (light.radius > 0 && lightDistance >= light.radius) {
+        return false;
+    }
+
+    lightRay.origin = intersection.point;
+    lightRay.reflectionLevel = ray.reflectionLevel + 1; // Not a primary ray
+    lightRay.dir = normalize(toLight);
+    // The same test addLight() makes, so skipping the shadow ray cannot change the color
+    return dot(intersection.normal, lightRay.dir) > 0;
+}
+
+/**
+ * Share of a light's color that reaches lightDistance away: all of it for
+ * lights without a radius, otherwise (1 - (d / radius)^2)^2, falling
+ * smoothly from 1 at the light to 0 at its radius.
+ */
+float lightFalloff(const Light &light, float lightDistance) {
+    float t = lightDistance / light.radius;
+    float window = fmaxf(1 - t * t, 0.0f);
+    return window * window;
+}
+
+/**
+ * Add the Blinn-Phong terms of a light that reaches the intersection.
+ */
+void addLight(const Ray &ray, const Intersection &intersection, const Light &light, const Ray &lightRay,
+              float lightDistance, vec4 &diffusion, vec4 &specular) {
+    // Calculate the intensity of diffuse light
+    float diffusionIntensity = dot(intersection.normal, lightRay.dir);
+    if (diffusionIntensity > 0) {
+        vec4 lightColor = light.radius > 0 ? light.color * lightFalloff(light, lightDistance) : light.color;
+        diffusion += diffusionIntensity * lightColor * intersection.sphere->color;
+
+        // Calculate the half vector between light vector and the view vector
+        vec4 H = normalize(lightRay.dir - ray.dir);
+
+        // Calculate the intensity of specular light
+        float specularIntensity = dot(intersection.normal, H);
+        specular += powf(powf(specularIntensity, intersection.sphere->specularExponent), 3) * lightColor;
+    }
+}
+
+/**
+ * Color of an intersection before reflections are added.
+ */
+vec4 surfaceColor(const Intersection &intersection, const vec4 &diffusion, const vec4 &specular) {
+    // Calculate initial intersection color with ambient intensity
+    vec4 color = intersection.sphere->color * intersection.sphere->Ka * g_ambientIntensity;
+
+    // Apply diffusion and specular values
+    color += diffusion * intersection.sphere->Kd + specular * intersection.sphere->Ks;
+    return color;
+}
+
+Ray makeReflectionRay(const Ray &ray, const Intersection &intersection) {
+    Ray reflectRay;
+    reflectRay.origin = intersection.point;
+    reflectRay.dir = normalize(ray.dir - 2.0f * intersection.normal * dot(intersection.normal, ray.dir));
+    reflectRay.reflectionLevel = ray.reflectionLevel + 1;
+    return reflectRay;
+}
+
+/**
+ * Shade a ray given its nearest intersection.
+ */
+vec4 shade(const Ray &ray, const Intersection &intersection) {
+    if (intersection.distance == -1 && ray.reflectionLevel == 0) {
+        // Return background color if no intersection and is an initial ray
+        return g_backgroundColor;
+    } else if (intersection.distance == -1) {
+        // Return no color if no intersection and not an initial ray
+        return vec4();
+    }
+
+    // Calculate Blinn-Phong shading from light sources
+    vec4 diffusion = vec4(0, 0, 0, 0);
+    vec4 specular = vec4(0, 0, 0, 0);
+    // Shadow rays are only needed if the material shows diffuse or specular light
+    if (intersection.sphere->lit) {
+        forEachLight(intersection.point, [&](int l) {
+            const Light &light = g_lights[l];
+            Ray lightRay;
+            float lightDistance;
+            // Determine if the light source reaches the point and is not obstructed
+            if (makeShadowRay(ray, intersection, light, lightRay, lightDistance) &&
+                !isOccluded(lightRay, lightDistance, l)) {
+                addLight(ray, intersection, light, lightRay, lightDistance, diffusion, specular);
+            }
+        });
+    }
+    vec4 color = surfaceColor(intersection, diffusion, specular);
+
+    // Calculate reflections
+    if (intersection.sphere->reflective) {
+        color += trace(makeReflectionRay(ray, intersection)) * intersection.sphere->Kr;
+    }
+
+    return color;
+}
+
+// Reflection depth of the current render; progressive previews lower it
+static int s_reflectionLimit = MAX_REFLECTIONS;
+
+/**
+ * Trace the color of a ray.
+ */
+vec4 trace(const Ray &ray) {
+    // Limit reflection level
+    if (ray.reflectionLevel >= s_reflectionLimit) {
+        STATS_ADD(reflectionLimitRays, 1);
+        return vec4();
+    }
+
+    // Get the nearest intersecting sphere
+    return shade(ray, calculateNearestIntersection(ray));
+}
+
+/**
+ * Return the direction from the origin to a point on the image plane, given
+ * in pixels. Pixel (ix, iy) is sampled at its corner (ix, iy).
+ */
+vec4 getSampleDir(float px, float py) {
+    float x = g_left + (px / g_width) * (g_right - g_left);
+    float y = g_bottom + (py / g_height) * (g_top - g_bottom);
+    return vec4(x, y, -g_near, 0.0f);
+}
+
+/**
+ * Return the direction from the origin to a pixel.
+ */
+vec4 getDir(int ix, int iy) {
+    return getSampleDir((float) ix, (float) iy);
+}
+
+/**
+ * Trace a primary ray, also returning the sphere it hit (NULL for none).
+ */
+vec4 tracePrimary(const Ray &ray, const Sphere *&sphere) {
+    Intersection intersection = calculateNearestIntersection(ray);
+    sphere = intersection.distance == -1 ? NULL : intersection.sphere;
+    return shade(ray, intersection);
+}
+
+
+
+// -------------------------------------------------------------------
+// Primary ray packets
+
+PacketScene g_packetScene;
+
+// Backing storage for g_packetScene
+vector<float> s_packetS[4];
+vector<float> s_packetC;
+vector<float> s_packetInverse[16];
+vector<float> s_packetNormalMatrix[16];
+vector<float> s_packetPosition[4];
+
+/**
+ * Precompute the per-sphere data used by the packet kernels. Everything is
+ * derived with the same vec4/mat4 operations as calculateNearestIntersection()
+ * so both paths produce the same bits.
+ */
+void preparePacketScene() {
+    vec4 eye = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+    for (int k = 0; k < 4; k++) {
+        s_packetS[k].clear();
+        s_packetPosition[k].clear();
+    }
+    s_packetC.clear();
+    for (int k = 0; k < 16; k++) {
+        s_packetInverse[k].clear();
+        s_packetNormalMatrix[k].clear();
+    }
+
+    for (const Sphere &sphere : g_spheres) {
+        vec4 S = sphere.inverseTransform * (sphere.position - eye);
+
+        for (int k = 0; k < 4; k++) {
+            s_packetS[k].push_back(S[k]);
+            s_packetPosition[k].push_back(sphere.position[k]);
+        }
+        s_packetC.push_back(dot(S, S) - 1);
+        for (int k = 0; k < 16; k++) {
+            s_packetInverse[k].push_back(sphere.inverseTransform[k / 4][k % 4]);
+            s_packetNormalMatrix[k].push_back(sphere.normalMatrix[k / 4][k % 4]);
+        }
+    }
+
+    g_packetScene.sphereCount = (int) g_spheres.size();
+    g_packetScene.minHitTime = MIN_HIT_TIME;
+    g_packetScene.minReflectHitTime = MIN_RELECT_HIT_TIME;
+    for (int k = 0; k < 4; k++) {
+        g_packetScene.eye[k] = eye[k];
+        g_packetScene.S[k] = s_packetS[k].data();
+        g_packetScene.position[k] = s_packetPosition[k].data();
+    }
+    g_packetScene.c = s_packetC.data();
+    for (int k = 0; k < 16; k++) {
+        g_packetScene.inverse[k] = s_packetInverse[k].data();
+        g_packetScene.normalMatrix[k] = s_packetNormalMatrix[k].data();
+    }
+    g_packetScene.bvhNodes = g_accelerator == ACCEL_BVH ? g_bvh.nodes.data() : NULL;
+    g_packetScene.bvhPrimitives = g_accelerator == ACCEL_BVH ? g_bvh.primitives.data() : NULL;
+}
+
+/**
+ * Whether primary rays are traced with the packet kernels.
+ */
+bool usePrimaryPackets() {
+    // Packets only know brute force and the BVH; grid scenes trace per ray
+    return g_simdKernels != NULL && g_accelerator != ACCEL_GRID;
+}
+
+/**
+ * Unpack lane i of a packet result into an Intersection.
+ */
+Intersection packetIntersection(const Ray &ray, const PacketHits &hits, int i) {
+    Intersection intersection;
+    intersection.ray = ray;
+    intersection.distance = hits.distance[i];
+    intersection.interiorPoint = false;
+    STATS_ADD(primaryRays, 1);
+    STATS_ADD(hits, intersection.distance != -1);
+    if (intersection.distance != -1) {
+        intersection.sphere = &g_spheres[hits.sphere[i]];
+        intersection.interiorPoint = hits.interiorPoint[i] != 0;
+        intersection.point = vec4(hits.point[0][i], hits.point[1][i], hits.point[2][i], hits.point[3][i]);
+        intersection.normal = vec4(hits.normal[0][i], hits.normal[1][i], hits.normal[2][i], hits.normal[3][i]);
+    }
+    return intersection;
+}
+
+static unsigned int clampCost(unsigned long long cost) {
+    return (unsigned int) min(cost, (unsigned long long) UINT_MAX);
+}
+
+/**
+ * Trace count pixels into out, in packets of the selected kernel's width
+ * when packet tracing is enabled. Pixel i is at column pixels.x(i) of row
+ * pixels.y(i) and is stored at out[pixels.slot(i)]. If spheres is not NULL
+ * it receives the sphere each pixel's ray hit. If costs is not NULL it
+ * receives the work spent on each pixel; packets are not used then, since
+ * their work cannot be split between pixels.
+ */
+template<class Pixels>
+void tracePixels(const Pixels &pixels, int count, vec4 *out, const Sphere **spheres, unsigned int *costs) {
+    Ray ray;
+    ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    ray.reflectionLevel = 0;
+
+    if (!usePrimaryPackets() || costs != NULL) {
+        for (int i = 0; i < count; i++) {
+            unsigned long long start = costs != NULL ? costMark(g_costMetric) : 0;
+            int slot = pixels.slot(i);
+            ray.dir = getDir(pixels.x(i), pixels.y(i));
+            out[slot] = spheres != NULL ? tracePrimary(ray, spheres[slot]) : trace(ray);
+            if (costs != NULL) {
+                costs[slot] = clampCost(costMark(g_costMetric) - start);
+            }
+        }
+        return;
+    }
+
+    int width = g_simdKernels->packetWidth;
+    PacketRays rays;
+    PacketHits hits;
+    vec4 dirs[PACKET_MAX_WIDTH];
+
+    for (int first = 0; first < count; first += width) {
+        int packetCount = min(width, count - first);
+        for (int i = 0; i < width; i++) {
+            // Pad the tail with copies of the first ray
+            int pixel = i < packetCount ? first + i : first;
+            dirs[i] = getDir(pixels.x(pixel), pixels.y(pixel));
+            for (int k = 0; k < 4; k++) {
+                rays.dir[k][i] = dirs[i][k];
+            }
+        }
+
+        g_simdKernels->intersectPacket(g_packetScene, rays, hits);
+
+        for (int i = 0; i < packetCount; i++) {
+            int slot = pixels.slot(first + i);
+            ray.dir = dirs[i];
+            Intersection intersection = packetIntersection(ray, hits, i);
+            if (spheres != NULL) {
+                spheres[slot] = intersection.distance == -1 ? NULL : intersection.sphere;
+            }
+            out[slot] = shade(ray, intersection);
+        }
+    }
+}
+
+/**
+ * The pixels of a span of one row, left to right.
+ */
+struct SpanPixels {
+    int x0;
+    int iy;
+
+    int x(int i) const { return x0 + i; }
+
+    int y(int) const { return iy; }
+
+    int slot(int i) const { return i; }
+};
+
+/**
+ * Trace the pixels [x0, x1) of row iy into out, like tracePixels().
+ */
+void renderSpan(int iy, int x0, int x1, vec4 *out, const Sphere **spheres, unsigned int *costs) {
+    SpanPixels pixels = {x0, iy};
+    tracePixels(pixels, x1 - x0, out, spheres, costs);
+}
+
+void renderSerial(const RenderTarget &target) {
+    PhaseTimer timer(PHASE_RENDER);
+    int width = target.x1 - target.x0;
+    vector<vec4> row((size_t) width);
+    for (int iy = target.y0; iy < target.y1; iy++) {
+        renderSpan(iy, target.x0, target.x1, row.data(), NULL,
+                   target.costs != NULL ? target.costs + targetOffset(target, iy) : NULL);
+        target.frame->storeSpan(targetRow(target, iy), 0, row.data(), width);
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Wavefront rendering
+
+/**
+ * A ray waiting in a wavefront queue. path is the pixel within the tile the
+ * ray contributes to; weight is the product of the reflectivities along the
+ * way, so paths that can no longer contribute are dropped.
+ */
+struct WaveRay {
+    unsigned long long key;
+    Ray ray;
+    int path;
+    float weight;
+};
+
+struct ShadowRay {
+    unsigned long long key;
+    Ray ray;
+    float lightDistance;
+    int slot;               // Index into the queues' shadowLights and lightVisible
+    int light;
+};
+
+/**
+ * Shading recorded for each bounce of a pixel's path. The colors are only
+ * combined once the whole tile is done, innermost bounce first, in the same
+ * order as the recursive trace() so both modes produce the same bits.
+ */
+struct WavePath {
+    vec4 surface[MAX_REFLECTIONS];
+    float reflectivity[MAX_REFLECTIONS];
+    int depth;
+    bool background;
+    const Sphere *primary;
+};
+
+/**
+ * Queues reused from tile to tile by each thread.
+ */
+struct WavefrontQueues {
+    vector<WaveRay> rays;
+    vector<WaveRay> nextRays;
+    vector<Intersection> hits;
+    vector<ShadowRay> shadowRays;
+    vector<int> shadowStart;        // Hit i has the shadow slots [shadowStart[i], shadowStart[i + 1])
+    vector<int> shadowLights;       // Light of each slot, in scene order per hit
+    vector<char> lightVisible;      // Whether each slot's light reaches its hit
+    vector<WavePath> paths;
+};
+
+static thread_local WavefrontQueues s_wavefront;
+
+/**
+ * Spread the low 10 bits of v so that there are two zero bits between each.
+ */
+static unsigned long long spreadBits(unsigned int v) {
+    unsigned long long x = v & 0x3ff;
+    x = (x | (x << 16)) & 0x30000ffULL;
+    x = (x | (x << 8)) & 0x300f00fULL;
+    x = (x | (x << 4)) & 0x30c30c3ULL;
+    x = (x | (x << 2)) & 0x9249249ULL;
+    return x;
+}
+
+/**
+ * Give every queued ray a key of group (in the high bits) followed by the
+ * Morton code of its origin within the queue's bounds, then sort by key so
+ * rays that start close together are traced one after another.
+ */
+template <typename T>
+void sortByOrigin(vector<T> &queue, unsigned int (*group)(const T &)) {
+    if (queue.size() < 2) {
+        return;
+    }
+
+    float lo[3] = {INFINITY, INFINITY, INFINITY};
+    float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (const T &entry : queue) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], entry.ray.origin[k]);
+            hi[k] = max(hi[k], entry.ray.origin[k]);
+        }
+    }
+    float scale[3];
+    for (int k = 0; k < 3; k++) {
+        scale[k] = hi[k] > lo[k] ? 1023.0f / (hi[k] - lo[k]) : 0.0f;
+    }
+
+    for (T &entry : queue) {
+        unsigned long long morton = 0;
+        for (int k = 0; k < 3; k++) {
+            unsigned int cell = (unsigned int) ((entry.ray.origin[k] - lo[k]) * scale[k]);
+            morton |= spreadBits(cell) << k;
+        }
+        entry.key = ((unsigned long long) group(entry) << 30) | morton;
+    }
+    sort(queue.begin(), queue.end(), [](const T &a, const T &b) { return a.key < b.key; });
+}
+
+static unsigned int directionOctant(const WaveRay &wave) {
+    return (wave.ray.dir.x < 0 ? 1 : 0) | (wave.ray.dir.y < 0 ? 2 : 0) | (wave.ray.dir.z < 0 ? 4 : 0);
+}
+
+static unsigned int shadowLight(const ShadowRay &shadow) {
+    return (unsigned int) shadow.light;
+}
+
+/**
+ * Find the nearest intersection of every ray in the queue.
+ */
+void intersectWave(const vector<WaveRay> &rays, vector<Intersection> &hits) {
+    int count = (int) rays.size();
+    hits.resize(rays.size());
+
+    bool primary = count > 0 && rays[0].ray.reflectionLevel == 0;
+    if (!primary || !usePrimaryPackets()) {
+        for (int i = 0; i < count; i++) {
+            hits[i] = calculateNearestIntersection(rays[i].ray);
+        }
+        return;
+    }
+
+    // Primary rays all leave the eye, so they go through the packet kernel
+    int width = g_simdKernels->packetWidth;
+    PacketRays packet;
+    PacketHits packetHits;
+    for (int i = 0; i < count; i += width) {
+        int lanes = min(width, count - i);
+        for (int lane = 0; lane < width; lane++) {
+            // Pad the tail of the queue with copies of the first ray
+            const Ray &ray = rays[i + (lane < lanes ? lane : 0)].ray;
+            for (int k = 0; k < 4; k++) {
+                packet.dir[k][lane] = ray.dir[k];
+            }
+        }
+
+        g_simdKernels->intersectPacket(g_packetScene, packet, packetHits);
+
+        for (int lane = 0; lane < lanes; lane++) {
+            hits[i + lane] = packetIntersection(rays[i + lane].ray, packetHits, lane);
+        }
+    }
+}
+
+/**
+ * Trace the pixels of [x0, x1) x [y0, y1) breadth first: every ray of one
+ * bounce is intersected, then all of their shadow rays are tested, then the
+ * reflection rays are queued for the next bounce. out receives the colors
+ * row by row in getDir() order, row y0 (the bottom) first, and spheres, if
+ * not NULL, the sphere each pixel's primary ray hit. renderTile() flips the
+ * rows into the target's top-first layout with targetRow().
+ */
+void renderWavefront(int x0, int y0, int x1, int y1, vec4 *out, const Sphere **spheres) {
+    WavefrontQueues &q = s_wavefront;
+    int width = x1 - x0;
+
+    q.paths.resize((unsigned int) (width * (y1 - y0)));
+    q.rays.clear();
+    for (int iy = y0; iy < y1; iy++)
+        for (int ix = x0; ix < x1; ix++) {
+            WaveRay wave;
+            wave.ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+            wave.ray.dir = getDir(ix, iy);
+            wave.ray.reflectionLevel = 0;
+            wave.path = (iy - y0) * width + (ix - x0);
+            wave.weight = 1.0f;
+            q.rays.push_back(wave);
+
+            q.paths[wave.path].depth = 0;
+            q.paths[wave.path].background = false;
+            q.paths[wave.path].primary = NULL;
+        }
+
+    while (!q.rays.empty()) {
+        intersectWave(q.rays, q.hits);
+
+        // Queue a shadow ray for every light that could light each hit
+        q.shadowRays.clear();
+        q.shadowLights.clear();
+        q.shadowStart.resize(q.rays.size() + 1);
+        for (unsigned int i = 0; i < q.rays.size(); i++) {
+            const Intersection &hit = q.hits[i];
+            q.shadowStart[i] = (int) q.shadowLights.size();
+            if (hit.distance == -1 || !hit.sphere->lit) {
+                continue;
+            }
+            forEachLight(hit.point, [&](int l) {
+                ShadowRay shadow;
+                if (!makeShadowRay(q.rays[i].ray, hit, g_lights[l], shadow.ray, shadow.lightDistance)) {
+                    return;
+                }
+                shadow.slot = (int) q.shadowLights.size();
+                shadow.light = l;
+                q.shadowRays.push_back(shadow);
+                q.shadowLights.push_back(l);
+            });
+        }
+        q.shadowStart[q.rays.size()] = (int) q.shadowLights.size();
+
+        sortByOrigin(q.shadowRays, shadowLight);
+        q.lightVisible.assign(q.shadowLights.size(), 0);
+        for (const ShadowRay &shadow : q.shadowRays) {
+            if (!isOccluded(shadow.ray, shadow.lightDistance, shadow.light)) {
+                q.lightVisible[shadow.slot] = 1;
+            }
+        }
+
+        // Shade the hits and queue the reflection rays
+        q.nextRays.clear();
+        for (unsigned int i = 0; i < q.rays.size(); i++) {
+            const WaveRay &wave = q.rays[i];
+            const Intersection &hit = q.hits[i];
+            WavePath &path = q.paths[wave.path];
+            if (hit.distance == -1) {
+                path.background = wave.ray.reflectionLevel == 0;
+                continue;
+            }
+
+            vec4 diffusion = vec4(0, 0, 0, 0);
+            vec4 specular = vec4(0, 0, 0, 0);
+            for (int slot = q.shadowStart[i]; slot < q.shadowStart[i + 1]; slot++) {
+                if (q.lightVisible[slot]) {
+                    const Light &light = g_lights[q.shadowLights[slot]];
+                    Ray lightRay;
+                    float lightDistance;
+                    makeShadowRay(wave.ray, hit, light, lightRay, lightDistance);
+                    addLight(wave.ray, hit, light, lightRay, lightDistance, diffusion, specular);
+                }
+            }
+
+            int level = wave.ray.reflectionLevel;
+            if (level == 0) {
+                path.primary = hit.sphere;
+            }
+            path.surface[level] = surfaceColor(hit, diffusion, specular);
+            path.reflectivity[level] = hit.sphere->Kr;
+            path.depth = level + 1;
+
+            WaveRay reflection;
+            reflection.weight = wave.weight * hit.sphere->Kr;
+            if (level + 1 < s_reflectionLimit && reflection.weight != 0) {
+                reflection.ray = makeReflectionRay(wave.ray, hit);
+                reflection.path = wave.path;
+                q.nextRays.push_back(reflection);
+            } else if (reflection.weight != 0) {
+                STATS_ADD(reflectionLimitRays, 1);
+            }
+        }
+
+        sortByOrigin(q.nextRays, directionOctant);
+        swap(q.rays, q.nextRays);
+    }
+
+    // Fold each path back together from its last bounce
+    for (unsigned int p = 0; p < q.paths.size(); p++) {
+        const WavePath &path = q.paths[p];
+        if (spheres != NULL) {
+            spheres[p] = path.primary;
+        }
+        if (path.background) {
+            out[p] = g_backgroundColor;
+            continue;
+        }
+        vec4 color = vec4();
+        for (int level = path.depth - 1; level >= 0; level--) {
+            color = path.surface[level] + color * path.reflectivity[level];
+        }
+        out[p] = color;
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Adaptive anti-aliasing
+
+int g_aaDepth = 0; // 0 takes one sample per pixel
+float g_aaThreshold = DEFAULT_AA_THRESHOLD;
+
+// Pixels anti-aliased, pixels refined and primary rays traced for them, summed over all threads
+static atomic<long long> s_aaPixels(0);
+static atomic<long long> s_aaRefinedPixels(0);
+static atomic<long long> s_aaSamples(0);
+
+struct Sample {
+    vec4 color;
+    const Sphere *sphere;
+};
+
+/**
+ * Corner samples of the tile being anti-aliased, reused from tile to tile
+ * by each thread.
+ */
+struct AdaptiveGrid {
+    vector<vec4> colors;
+    vector<const Sphere *> spheres;
+    vector<unsigned int> costs;
+};
+
+static thread_local AdaptiveGrid s_adaptiveGrid;
+
+/**
+ * Whether the image may change between two samples: they hit different
+ * spheres, or their displayed colors differ by more than the threshold.
+ */
+bool samplesDiffer(const Sample &a, const Sample &b) {
+    if (a.sphere != b.sphere) {
+        return true;
+    }
+    for (int i = 0; i < 3; i++) {
+        // Anything above 1 is clamped when the image is written
+        if (fabsf(fminf(a.color[i], 1) - fminf(b.color[i], 1)) > g_aaThreshold) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cornersDiffer(const Sample corners[4]) {
+    for (int i = 0; i < 4; i++)
+        for (int j = i + 1; j < 4; j++)
+            if (samplesDiffer(corners[i], corners[j])) {
+                return true;
+            }
+    return false;
+}
+
+Sample traceSample(float px, float py) {
+    Ray ray;
+    ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    ray.dir = getSampleDir(px, py);
+    ray.reflectionLevel = 0;
+
+    Sample sample;
+    sample.color = tracePrimary(ray, sample.sphere);
+    return sample;
+}
+
+/**
+ * Average the image over the square [px, px + size) x [py, py + size),
+ * given the samples at its corners (bottom left, bottom right, top left,
+ * top right). If the corners differ the square is split in four, at most
+ * depth times; otherwise the corners are averaged. samples counts the rays
+ * traced.
+ */
+vec4 refineSquare(float px, float py, float size, const Sample corners[4], int depth, long long &samples) {
+    if (depth == 0 || !cornersDiffer(corners)) {
+        return (corners[0].color + corners[1].color + corners[2].color + corners[3].color) * 0.25f;
+    }
+
+    float half = size * 0.5f;
+    Sample bottom = traceSample(px + half, py);
+    Sample left = traceSample(px, py + half);
+    Sample center = traceSample(px + half, py + half);
+    Sample right = traceSample(px + size, py + half);
+    Sample top = traceSample(px + half, py + size);
+    samples += 5;
+
+    Sample bottomLeft[4] = {corners[0], bottom, left, center};
+    Sample bottomRight[4] = {bottom, corners[1], center, right};
+    Sample topLeft[4] = {left, center, corners[2], top};
+    Sample topRight[4] = {center, right, top, corners[3]};
+    return (refineSquare(px, py, half, bottomLeft, depth - 1, samples) +
+            refineSquare(px + half, py, half, bottomRight, depth - 1, samples) +
+            refineSquare(px, py + half, half, topLeft, depth - 1, samples) +
+            refineSquare(px + half, py + half, half, topRight, depth - 1, samples)) * 0.25f;
+}
+
+/**
+ * Anti-alias the pixels of [x0, x1) x [y0, y1) into out, laid out like the
+ * output of renderWavefront(). The pixel corners are traced as usual, plus
+ * one more row and column, so every pixel has samples at its four corners.
+ * Pixels whose corners agree keep their own sample, so smooth regions come
+ * out exactly as without anti-aliasing; the rest are refined by
+ * refineSquare() up to g_aaDepth levels. spheres and refined, if not NULL,
+ * receive the sphere hit at each pixel's own corner and whether the pixel
+ * was refined. costs, if not NULL, receives the work of each pixel's own
+ * corner sample plus its refinement.
+ */
+void renderAdaptive(int x0, int y0, int x1, int y1, vec4 *out, const Sphere **spheres, unsigned char *refined,
+                    unsigned int *costs) {
+    AdaptiveGrid &grid = s_adaptiveGrid;
+    int width = x1 - x0;
+    int stride = width + 1;
+    size_t cornerCount = (size_t) stride * (y1 - y0 + 1);
+    grid.colors.resize(cornerCount);
+    grid.spheres.resize(cornerCount);
+    grid.costs.resize(costs != NULL ? cornerCount : 0);
+
+    if (g_wavefront && costs == NULL) {
+        renderWavefront(x0, y0, x1 + 1, y1 + 1, grid.colors.data(), grid.spheres.data());
+    } else {
+        for (int iy = y0; iy <= y1; iy++)
+            renderSpan(iy, x0, x1 + 1, &grid.colors[(iy - y0) * stride], &grid.spheres[(iy - y0) * stride],
+                       costs != NULL ? &grid.costs[(iy - y0) * stride] : NULL);
+    }
+
+    long long samples = (long long) cornerCount;
+    long long refinedCount = 0;
+    for (int iy = y0; iy < y1; iy++)
+        for (int ix = x0; ix < x1; ix++) {
+            int corner = (iy - y0) * stride + (ix - x0);
+            Sample corners[4] = {
+                {grid.colors[corner], grid.spheres[corner]},
+                {grid.colors[corner + 1], grid.spheres[corner + 1]},
+                {grid.colors[corner + stride], grid.spheres[corner + stride]},
+                {grid.colors[corner + stride + 1], grid.spheres[corner + stride + 1]}
+            };
+
+            int pixel = (iy - y0) * width + (ix - x0);
+            bool refine = cornersDiffer(corners);
+            if (spheres != NULL) {
+                spheres[pixel] = corners[0].sphere;
+                refined[pixel] = refine;
+            }
+            if (!refine) {
+                out[pixel] = corners[0].color;
+                if (costs != NULL) {
+                    costs[pixel] = grid.costs[corner];
+                }
+                continue;
+            }
+            unsigned long long start = costs != NULL ? costMark(g_costMetric) : 0;
+            out[pixel] = refineSquare((float) ix, (float) iy, 1.0f, corners, g_aaDepth, samples);
+            if (costs != NULL) {
+                costs[pixel] = clampCost(grid.costs[corner] + (costMark(g_costMetric) - start));
+            }
+            refinedCount++;
+        }
+
+    s_aaPixels += (long long) width * (y1 - y0);
+    s_aaRefinedPixels += refinedCount;
+    s_aaSamples += samples;
+}
+
+void printAntialiasingStats() {
+    if (g_aaDepth <= 0 || s_aaPixels == 0) {
+        return;
+    }
+    cout << "Anti-aliasing refined " << s_aaRefinedPixels << " of " << s_aaPixels << " pixels, " << fixed
+         << setprecision(2) << (double) s_aaSamples / s_aaPixels << " samples per pixel" << defaultfloat << endl;
+}
+
+
+// -------------------------------------------------------------------
+// Tile rendering
+
+struct Tile {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+/**
+ * Per-thread tile deque. The owner pops from the front while idle threads
+ * steal from the back. The queues live in a vector, which does not align
+ * them to cache lines, so each is followed by a line of padding instead:
+ * neighbouring queues never share a line wherever the vector starts.
+ */
+struct TileQueue {
+    mutex lock;
+    deque<int> tiles;
+    char padding[CACHE_LINE_SIZE];
+};
+
+// Settings of the current pass, only changed while no render thread runs
+static int s_passStride = 1;
+static bool s_passSkipCoarse = false;
+static bool s_hasDeadline = false;
+static chrono::steady_clock::time_point s_deadline;
+static const atomic<bool> *s_cancel = NULL;
+static atomic<bool> s_stoppedEarly(false);
+
+// Set while an incremental render skips the tiles a scene edit cannot reach
+static const SceneChanges *s_sceneChanges = NULL;
+static atomic<int> s_changedTiles(0);
+
+vector<Tile> buildTiles(int tileSize, const RenderTarget &target) {
+    vector<Tile> tiles;
+    for (int y0 = target.y0; y0 < target.y1; y0 += tileSize)
+        for (int x0 = target.x0; x0 < target.x1; x0 += tileSize) {
+            Tile tile;
+            tile.x0 = x0;
+            tile.y0 = y0;
+            tile.x1 = min(x0 + tileSize, target.x1);
+            tile.y1 = min(y0 + tileSize, target.y1);
+            tiles.push_back(tile);
+        }
+
+    if (g_pixelOrder != PIXEL_ORDER_ROWS) {
+        // Threads take contiguous runs of the list, so along a curve each starts on a compact patch
+        int columns = (target.x1 - target.x0 + tileSize - 1) / tileSize;
+        int rows = (target.y1 - target.y0 + tileSize - 1) / tileSize;
+        vector<int> cells;
+        orderCells(g_pixelOrder, columns, rows, cells);
+        vector<Tile> ordered;
+        ordered.reserve(tiles.size());
+        for (int cell : cells) {
+            ordered.push_back(tiles[cell]);
+        }
+        tiles.swap(ordered);
+    }
+    return tiles;
+}
+
+bool popTile(TileQueue &queue, int &tile) {
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool stealTile(TileQueue &queue, int &tile) {
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+    return true;
+}
+
+/**
+ * Trace every stride-th pixel of a tile in both directions, counting from
+ * its corner, and fill the stride x stride block starting at each with its
+ * color. With skipCoarse, pixels on the twice as coarse lattice of the
+ * previous pass are left alone: their blocks already hold their color.
+ */
+void renderTilePreview(const Tile &tile, const RenderTarget &target, int stride, bool skipCoarse) {
+    Ray ray;
+    ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    ray.reflectionLevel = 0;
+
+    for (int iy = tile.y0; iy < tile.y1; iy += stride)
+        for (int ix = tile.x0; ix < tile.x1; ix += stride) {
+            if (skipCoarse && (ix - tile.x0) % (2 * stride) == 0 && (iy - tile.y0) % (2 * stride) == 0) {
+                continue;
+            }
+            ray.dir = getDir(ix, iy);
+            vec4 color = trace(ray);
+
+            int x1 = min(ix + stride, tile.x1);
+            for (int by = iy; by < min(iy + stride, tile.y1); by++)
+                target.frame->fillSpan(targetRow(target, by), ix, x1, color);
+        }
+}
+
+/**
+ * Per-thread scratch space for one tile.
+ */
+struct TileBuffers {
+    vector<vec4> colors;
+    vector<const Sphere *> hits;
+    vector<unsigned char> refined;
+    vector<unsigned int> costs;
+
+    // Pixel offsets of the last tile shape in the order they are traced
+    vector<int> order;
+    PixelOrder orderKind;
+    int orderWidth;
+    int orderHeight;
+
+    TileBuffers() : orderKind(PIXEL_ORDER_ROWS), orderWidth(0), orderHeight(0) {}
+};
+
+/**
+ * The pixels of a tile in the order of a list of offsets into it.
+ */
+struct OrderedPixels {
+    const Tile *tile;
+    const int *order;
+    int width;
+
+    int x(int i) const { return tile->x0 + order[i] % width; }
+
+    int y(int i) const { return tile->y0 + order[i] / width; }
+
+    int slot(int i) const { return order[i]; }
+};
+
+/**
+ * Trace a tile into thread-local buffers, then copy the finished rows into
+ * the target. Each pixel is written exactly once by one thread, so no locking
+ * is needed and shared cache lines are only touched at the tile edges.
+ */
+void renderTile(const Tile &tile, const RenderTarget &target, TileBuffers &buffers) {
+    if (s_passStride > 1) {
+        renderTilePreview(tile, target, s_passStride, s_passSkipCoarse);
+        return;
+    }
+    if (s_sceneChanges != NULL) {
+        if (!tileChanged(*s_sceneChanges, tile.x0, tile.y0, tile.x1, tile.y1)) {
+            return;
+        }
+        s_changedTiles++;
+    }
+
+    int tileWidth = tile.x1 - tile.x0;
+    vector<vec4> &buffer = buffers.colors;
+    buffer.resize((unsigned int) (tileWidth * (tile.y1 - tile.y0)));
+    const Sphere **hits = NULL;
+    if (target.hits != NULL) {
+        buffers.hits.resize(buffer.size());
+        buffers.refined.assign(buffer.size(), 0);
+        hits = buffers.hits.data();
+    }
+    unsigned int *costs = NULL;
+    if (target.costs != NULL) {
+        buffers.costs.resize(buffer.size());
+        costs = buffers.costs.data();
+    }
+
+    if (g_aaDepth > 0) {
+        renderAdaptive(tile.x0, tile.y0, tile.x1, tile.y1, buffer.data(), hits, buffers.refined.data(), costs);
+    } else if (g_wavefront && costs == NULL) {
+        renderWavefront(tile.x0, tile.y0, tile.x1, tile.y1, buffer.data(), hits);
+    } else if (g_pixelOrder != PIXEL_ORDER_ROWS) {
+        int tileHeight = tile.y1 - tile.y0;
+        if (buffers.orderKind != g_pixelOrder || buffers.orderWidth != tileWidth ||
+            buffers.orderHeight != tileHeight) {
+            orderCells(g_pixelOrder, tileWidth, tileHeight, buffers.order);
+            buffers.orderKind = g_pixelOrder;
+            buffers.orderWidth = tileWidth;
+            buffers.orderHeight = tileHeight;
+        }
+        OrderedPixels pixels = {&tile, buffers.order.data(), tileWidth};
+        tracePixels(pixels, (int) buffers.order.size(), buffer.data(), hits, costs);
+    } else {
+        for (int iy = tile.y0; iy < tile.y1; iy++)
+            renderSpan(iy, tile.x0, tile.x1, &buffer[(iy - tile.y0) * tileWidth],
+                       hits != NULL ? &hits[(iy - tile.y0) * tileWidth] : NULL,
+                       costs != NULL ? &costs[(iy - tile.y0) * tileWidth] : NULL);
+    }
+
+    for (int iy = tile.y0; iy < tile.y1; iy++) {
+        target.frame->storeSpan(targetRow(target, iy), tile.x0 - target.x0, &buffer[(iy - tile.y0) * tileWidth],
+                                tileWidth);
+    }
+    if (hits != NULL) {
+        for (int iy = tile.y0; iy < tile.y1; iy++)
+            for (int ix = tile.x0; ix < tile.x1; ix++) {
+                int pixel = (iy - tile.y0) * tileWidth + (ix - tile.x0);
+                size_t offset = targetOffset(target, iy) + (ix - target.x0);
+                target.hits[offset] = hits[pixel] != NULL ? (int) (hits[pixel] - g_spheres.data()) : -1;
+                target.refined[offset] = buffers.refined[pixel];
+            }
+    }
+    if (costs != NULL) {
+        for (int iy = tile.y0; iy < tile.y1; iy++) {
+            copy(buffers.costs.begin() + (iy - tile.y0) * tileWidth,
+                 buffers.costs.begin() + (iy - tile.y0 + 1) * tileWidth,
+                 target.costs + targetOffset(target, iy) + (tile.x0 - target.x0));
+        }
+    }
+}
+
+void renderWorker(int self, vector<TileQueue> &queues, const vector<Tile> &tiles, const RenderTarget &target) {
+    int threadCount = (int) queues.size();
+    TileBuffers buffers;
+    int tile;
+
+    while (true) {
+        // Leave the remaining tiles alone once the time budget is spent or the render is cancelled
+        if ((s_hasDeadline && chrono::steady_clock::now() >= s_deadline) || (s_cancel != NULL && *s_cancel)) {
+            s_stoppedEarly = true;
+            return;
+        }
+
+        if (popTile(queues[self], tile)) {
+            renderTile(tiles[tile], target, buffers);
+            continue;
+        }
+
+        // Own queue drained: steal from the others, starting at the next thread
+        bool stolen = false;
+        for (int i = 1; i < threadCount && !stolen; i++) {
+            stolen = stealTile(queues[(self + i) % threadCount], tile);
+        }
+        if (!stolen) {
+            // Tiles are never re-queued, so every queue being empty means we are done
+            return;
+        }
+        renderTile(tiles[tile], target, buffers);
+    }
+}
+
+/**
+ * Threads that stay parked between renders, so progressive passes and the
+ * frames of a sequence do not start a fresh set of threads each time.
+ * Thread t (from 1) runs job(t) once for every job that asks for more than
+ * t threads; the caller runs job(0) itself.
+ */
+struct RenderThreads {
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+    vector<thread> threads;
+    function<void(int)> job;
+    int jobThreads = 0;
+    int running = 0;
+    unsigned long long generation = 0;
+    bool stopping = false;
+
+    ~RenderThreads() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &t : threads) {
+            t.join();
+        }
+    }
+
+    void park(int self) {
+        unsigned long long seen = 0;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            if (self < jobThreads) {
+                guard.unlock();
+                job(self);
+                guard.lock();
+            }
+            if (--running == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+    void run(int threadCount, const function<void(int)> &work) {
+        unique_lock<mutex> guard(lock);
+        while ((int) threads.size() < threadCount - 1) {
+            threads.push_back(thread(&RenderThreads::park, this, (int) threads.size() + 1));
+        }
+        job = work;
+        jobThreads = threadCount;
+        running = (int) threads.size();
+        generation++;
+        guard.unlock();
+        wake.notify_all();
+
+        work(0);
+
+        guard.lock();
+        finished.wait(guard, [&] { return running == 0; });
+    }
+};
+
+static RenderThreads s_renderThreads;
+
+void runOnRenderThreads(int threadCount, const function<void(int)> &work) {
+    s_renderThreads.run(threadCount, work);
+}
+
+/**
+ * Render the given tiles into the target, sharing them out between
+ * threadCount threads that steal from each other once their own run is done.
+ */
+void renderTileList(int threadCount, const vector<Tile> &tiles, const RenderTarget &target) {
+    PhaseTimer timer(PHASE_RENDER);
+    vector<TileQueue> queues((unsigned int) threadCount);
+
+    // Hand each thread a contiguous run of tiles so it starts on neighbouring work
+    int tileCount = (int) tiles.size();
+    for (int t = 0; t < threadCount; t++) {
+        int begin = (int) ((long long) tileCount * t / threadCount);
+        int end = (int) ((long long) tileCount * (t + 1) / threadCount);
+        for (int i = begin; i < end; i++) {
+            queues[t].tiles.push_back(i);
+        }
+    }
+
+    s_renderThreads.run(threadCount, [&](int self) { renderWorker(self, queues, tiles, target); });
+}
+
+void renderTiles(int threadCount, int tileSize, const RenderTarget &target) {
+    renderTileList(threadCount, buildTiles(tileSize, target), target);
+}
+
+/**
+ * Select the SIMD kernels and build everything the tracer needs from the
+ * loaded scene.
+ */
+void prepareScene() {
+    PhaseTimer timer(PHASE_SETUP);
+    g_simdKernels = NULL;
+    if (g_simdISA != "off") {
+        g_simdKernels = selectSimdKernels(g_simdISA.c_str());
+        if (g_simdKernels == NULL) {
+            cout << "SIMD kernels '" << g_simdISA << "' are not available, using auto" << endl;
+            g_simdKernels = selectSimdKernels("auto");
+        }
+    }
+
+    s_aaPixels = 0;
+    s_aaRefinedPixels = 0;
+    s_aaSamples = 0;
+
+    compileScene();
+    buildSphereStore();
+    buildLightIndex();
+    if (g_accelerator == ACCEL_BVH) {
+        buildSceneBVH();
+    } else if (g_accelerator == ACCEL_GRID) {
+        buildSceneGrid();
+    }
+    if (g_simdKernels != NULL) {
+        preparePacketScene();
+    }
+}
+
+int renderThreadCount() {
+    int threadCount = g_threadCount;
+    if (threadCount <= 0) {
+        threadCount = (int) thread::hardware_concurrency();
+    }
+    return max(threadCount, 1);
+}
+
+void renderRows(const RenderTarget &target) {
+    int threadCount = renderThreadCount();
+
+    // The wavefront mode, anti-aliasing, curve orders and hit tracking work a tile at a time even on one thread
+    if (threadCount <= 1 && !g_wavefront && g_aaDepth <= 0 && g_pixelOrder == PIXEL_ORDER_ROWS &&
+        target.hits == NULL) {
+        renderSerial(target);
+    } else {
+        renderTiles(threadCount, max(g_tileSize, 1), target);
+    }
+}
+
+void renderWindow(int x0, int y0, int x1, int y1, Framebuffer &frame) {
+    RenderTarget target;
+    target.frame = &frame;
+    target.hits = NULL;
+    target.refined = NULL;
+    target.costs = NULL;
+    target.x0 = x0;
+    target.x1 = x1;
+    target.y0 = y0;
+    target.y1 = y1;
+    renderRows(target);
+}
+
+void renderBand(int y0, int y1, Framebuffer &band) {
+    renderWindow(0, y0, g_width, y1, band);
+}
+
+void renderRegion(int x0, int y0, int x1, int y1) {
+    g_framebuffer.reset(g_framebufferFormat, x1 - x0, y1 - y0);
+    // Flip to getDir() rows, which count from the bottom
+    renderWindow(x0, g_height - y1, x1, g_height - y0, g_framebuffer);
+}
+
+void render() {
+    g_framebuffer.reset(g_framebufferFormat, g_width, g_height);
+    g_costs.assign(g_recordCosts ? (size_t) g_width * g_height : 0, 0);
+
+    RenderTarget target;
+    target.frame = &g_framebuffer;
+    target.hits = NULL;
+    target.refined = NULL;
+    target.costs = g_recordCosts ? g_costs.data() : NULL;
+    target.x0 = 0;
+    target.x1 = g_width;
+    target.y0 = 0;
+    target.y1 = g_height;
+    renderRows(target);
+}
+
+/**
+ * Render the image like render(), but stop at the next tile once
+ * budgetSeconds (if positive) have passed or *cancel (if not NULL) is set.
+ * Returns false if the render stopped early, leaving tiles black.
+ */
+bool renderWithin(double budgetSeconds, const atomic<bool> *cancel) {
+    g_framebuffer.reset(g_framebufferFormat, g_width, g_height);
+
+    s_deadline = chrono::steady_clock::now() +
+                 chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(budgetSeconds));
+    s_hasDeadline = budgetSeconds > 0;
+    s_cancel = cancel;
+    s_stoppedEarly = false;
+
+    RenderTarget target;
+    target.frame = &g_framebuffer;
+    target.hits = NULL;
+    target.refined = NULL;
+    target.costs = NULL;
+    target.x0 = 0;
+    target.x1 = g_width;
+    target.y0 = 0;
+    target.y1 = g_height;
+    // Tiles even on one thread, so the deadline is checked as the render goes
+    renderTiles(renderThreadCount(), max(g_tileSize, 1), target);
+
+    s_hasDeadline = false;
+    s_cancel = NULL;
+    return !s_stoppedEarly;
+}
+
+/**
+ * Render only the tiles that a scene edit can have changed since the render
+ * cached in cacheFilename, write the image and update the cache. Renders
+ * everything when there is no usable cache or the edit reaches the whole
+ * image. The result is the same as a full render of the edited scene.
+ */
+void renderIncremental(const char *cacheFilename) {
+    size_t pixelCount = (size_t) g_width * g_height;
+    vector<int> hits(pixelCount, -1);
+    vector<unsigned char> refined(pixelCount, 0);
+
+    RenderCache cache;
+    SceneChanges changes;
+    bool loaded = loadRenderCache(cacheFilename, cache);
+    bool reused = loaded && findSceneChanges(cache, changes);
+    g_framebuffer.reset(g_framebufferFormat, g_width, g_height);
+    if (reused) {
+        // Tiles left alone keep the cached pixels, stored in the same format
+        memcpy(g_framebuffer.data(), cache.colors, g_framebuffer.size());
+        refined.assign(cache.refined, cache.refined + pixelCount);
+        for (size_t p = 0; p < pixelCount; p++) {
+            hits[p] = cache.hits[p] < 0 ? -1 : changes.renumber[cache.hits[p]];
+        }
+        s_sceneChanges = &changes;
+        s_changedTiles = 0;
+    }
+
+    RenderTarget target;
+    target.frame = &g_framebuffer;
+    target.hits = hits.data();
+    target.refined = refined.data();
+    target.costs = NULL;
+    target.x0 = 0;
+    target.x1 = g_width;
+    target.y0 = 0;
+    target.y1 = g_height;
+    vector<Tile> tiles = buildTiles(max(g_tileSize, 1), target);
+    renderTileList(renderThreadCount(), tiles, target);
+
+    if (reused) {
+        cout << "Incremental render: traced " << s_changedTiles << " of " << tiles.size() << " tiles" << endl;
+        s_sceneChanges = NULL;
+    }
+    if (loaded) {
+        unloadRenderCache(cache);
+    }
+
+    // A failed write leaves the old cache, which still matches its own image
+    if (!saveFile()) {
+        exit(1);
+    }
+    saveRenderCache(cacheFilename, hits.data(), refined.data());
+}
+
+struct ProgressivePass {
+    int stride;
+    int reflections;
+};
+
+// Coarse, shallow previews first; the last pass is an ordinary render
+static const ProgressivePass s_progressivePasses[] = {
+    {16, 1}, {8, 1}, {4, 2}, {2, 2}, {1, MAX_REFLECTIONS}
+};
+
+/**
+ * Render in passes of decreasing stride and increasing reflection depth,
+ * writing the image after each one. Each preview pass only traces the
+ * pixels the previous ones did not, but the last pass traces every pixel
+ * again, since the previews stopped at fewer reflections: on its own it
+ * costs as much as render(). Once budgetSeconds (if positive) have passed,
+ * the current pass stops at the next tile and the image is written as it
+ * is. The first pass always completes so every pixel has a color; a render
+ * that finishes in time is identical to render().
+ */
+void renderProgressive(double budgetSeconds) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    s_deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(budgetSeconds));
+    s_stoppedEarly = false;
+
+    g_framebuffer.reset(g_framebufferFormat, g_width, g_height);
+    RenderTarget target;
+    target.frame = &g_framebuffer;
+    target.hits = NULL;
+    target.refined = NULL;
+    target.costs = NULL;
+    target.x0 = 0;
+    target.x1 = g_width;
+    target.y0 = 0;
+    target.y1 = g_height;
+
+    int passCount = (int) (sizeof(s_progressivePasses) / sizeof(s_progressivePasses[0]));
+    for (int p = 0; p < passCount; p++) {
+        s_passStride = s_progressivePasses[p].stride;
+        s_passSkipCoarse = p > 0;
+        s_reflectionLimit = s_progressivePasses[p].reflections;
+        s_hasDeadline = budgetSeconds > 0 && p > 0;
+
+        renderTiles(renderThreadCount(), max(g_tileSize, 1), target);
+
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Pass " << p + 1 << "/" << passCount << " (stride " << s_passStride << ", " << s_reflectionLimit
+             << " reflections) " << (s_stoppedEarly ? "stopped" : "done") << " at " << fixed << setprecision(1)
+             << elapsed * 1e3 << " ms" << defaultfloat << endl;
+        if (s_stoppedEarly || p == passCount - 1) {
+            break;
+        }
+        // Only the final image goes to stdout
+        if (g_outputFilename != "-" && !saveFileAtomic()) {
+            exit(1);
+        }
+    }
+
+    s_passStride = 1;
+    s_passSkipCoarse = false;
+    s_reflectionLimit = MAX_REFLECTIONS;
+    s_hasDeadline = false;
+    if (!saveFileAtomic()) {
+        exit(1);
+    }
+}
+
+
+// -------------------------------------------------------------------
+// PPM saving
+
+/**
+ * Open fname and write the PPM header. "-" writes the image to stdout, in
+ * which case progress messages go to stderr. Returns NULL on failure.
+ */
+FILE *beginPPM(int Width, int Height, const char *fname) {
+    FILE *fp;
+    const int maxVal = 255;
+    bool toStdout = strcmp(fname, "-") == 0;
+
+    fprintf(toStdout ? stderr : stdout, "Saving image %s: %d x %d\n", fname, Width, Height);
+    fp = toStdout ? stdout : fopen(fname, "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", fname);
+        return NULL;
+    }
+    fprintf(fp, "P6\n");
+    fprintf(fp, "%d %d\n", Width, Height);
+    fprintf(fp, "%d\n", maxVal);
+    return fp;
+}
+
+/**
+ * Append the first rows of an 8-bit RGB framebuffer to the image.
+ */
+void writePPMRows(FILE *fp, const Framebuffer &frame, int rows) {
+    PhaseTimer timer(PHASE_WRITE);
+    fwrite(frame.data(), frame.rowBytes(), (size_t) rows, fp);
+}
+
+/**
+ * Finish an image begun with beginPPM(). Returns false, saying so, if any
+ * of it could not be written.
+ */
+bool endPPM(FILE *fp, const char *fname) {
+    PhaseTimer timer(PHASE_WRITE);
+    bool written = !ferror(fp);
+    if (fp == stdout) {
+        written = fflush(fp) == 0 && written;
+    } else {
+        written = fclose(fp) == 0 && written;
+    }
+    if (!written) {
+        printf("Unable to write file '%s'\n", fname);
+    }
+    return written;
+}
+
+/**
+ * The image as a file of the given format in memory, encoded on all render
+ * threads.
+ */
+void encodeImage(const ImageEncoder *encoder, vector<unsigned char> &out) {
+    PhaseTimer timer(PHASE_ENCODE);
+    encoder->encode(g_framebuffer, renderThreadCount(), out);
+}
+
+/**
+ * Encode the image and write it to fname. "-" writes it to stdout, in which
+ * case progress messages go to stderr.
+ */
+bool saveImage(const char *fname, const ImageEncoder *encoder) {
+    vector<unsigned char> image;
+    encodeImage(encoder, image);
+
+    PhaseTimer timer(PHASE_WRITE);
+    bool toStdout = strcmp(fname, "-") == 0;
+    fprintf(toStdout ? stderr : stdout, "Saving image %s: %d x %d\n", fname, g_width, g_height);
+    FILE *fp = toStdout ? stdout : fopen(fname, "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", fname);
+        return false;
+    }
+    bool written = fwrite(image.data(), 1, image.size(), fp) == image.size();
+    if (toStdout) {
+        written = fflush(fp) == 0 && written;
+    } else {
+        written = fclose(fp) == 0 && written;
+    }
+    if (!written) {
+        printf("Unable to write file '%s'\n", fname);
+    }
+    return written;
+}
+
+void encodePPM(vector<unsigned char> &out) {
+    encodeImage(findImageEncoder("ppm"), out);
+}
+
+bool saveFile() {
+    // Use provided output filename; its extension picks the format
+    return saveImage(g_outputFilename.c_str(), selectImageEncoder(g_outputFilename.c_str()));
+}
+
+/**
+ * Write the image to a temporary file next to the output, then rename it
+ * over the output, so anything watching the output only sees whole images.
+ * Returns false, saying so, if either step fails.
+ */
+bool saveFileAtomic() {
+    if (g_outputFilename == "-") {
+        return saveFile();
+    }
+
+    string temporary = g_outputFilename + ".tmp";
+    const ImageEncoder *encoder = selectImageEncoder(g_outputFilename.c_str());
+    if (!saveImage(temporary.c_str(), encoder)) {
+        return false;
+    }
+    if (rename(temporary.c_str(), g_outputFilename.c_str()) != 0) {
+        printf("Unable to replace '%s'\n", g_outputFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Color of a cost scaled to [0, 1] on a black, blue, red, yellow, white ramp.
+ */
+static void heatColor(float t, unsigned char *rgb) {
+    static const float stops[5][3] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+    t = fmaxf(0, fminf(t, 1)) * 4;
+    int i = min((int) t, 3);
+    float f = t - i;
+    for (int k = 0; k < 3; k++) {
+        rgb[k] = (unsigned char) ((stops[i][k] + (stops[i + 1][k] - stops[i][k]) * f) * 255.9f);
+    }
+}
+
+/**
+ * Write the costs recorded by the last render as a false-color PPM image.
+ * The ramp tops out at the 99th percentile so a few outliers, such as
+ * pixels a thread was preempted on, do not wash out the rest.
+ */
+bool saveHeatmap(const char *fname) {
+    if (g_costs.empty()) {
+        return false;
+    }
+    vector<unsigned int> sorted = g_costs;
+    size_t p99 = (sorted.size() - 1) * 99 / 100;
+    nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+    unsigned int scale = max(sorted[p99], 1u);
+    cout << "Pixel cost (" << (g_costMetric == COST_WORK ? "sphere tests + rays" : "cycles") << "): p99 "
+         << sorted[p99] << ", max " << *max_element(sorted.begin(), sorted.end()) << endl;
+
+    FILE *fp = beginPPM(g_width, g_height, fname);
+    if (!fp) {
+        return false;
+    }
+    vector<unsigned char> buf((size_t) g_width * 3);
+    for (int j = 0; j < g_height; j++) {
+        for (int x = 0; x < g_width; x++) {
+            heatColor((float) g_costs[(size_t) j * g_width + x] / scale, &buf[x * 3]);
+        }
+        fwrite(buf.data(), 3, g_width, fp);
+    }
+    return endPPM(fp, fname);
+}
+
+/**
+ * Write the costs recorded by the last render as raw 32-bit unsigned
+ * integers in native byte order, g_width per row, top row first.
+ */
+bool saveRawCosts(const char *fname) {
+    if (g_costs.empty()) {
+        return false;
+    }
+    cout << "Saving costs " << fname << ": " << g_width << " x " << g_height << endl;
+    FILE *fp = fopen(fname, "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", fname);
+        return false;
+    }
+    bool written = fwrite(g_costs.data(), sizeof(unsigned int), g_costs.size(), fp) == g_costs.size();
+    written = fclose(fp) == 0 && written;
+    if (!written) {
+        printf("Unable to write file '%s'\n", fname);
+    }
+    return written;
+}
+
+/**
+ * Render the image in bands of g_bandHeight rows, top band first, and append
+ * each band to the output as soon as it is finished. Only one band is ever
+ * held, so memory does not grow with the image height; it is stored as
+ * rgb8, so the render threads quantize the pixels as they go and a finished
+ * band is written as it is.
+ */
+void renderStreaming() {
+    FILE *fp = beginPPM(g_width, g_height, g_outputFilename.c_str());
+    if (!fp) {
+        exit(1);
+    }
+
+    int bandHeight = max(g_bandHeight, 1);
+    Framebuffer band;
+    band.reset(FRAMEBUFFER_RGB8, g_width, min(bandHeight, g_height));
+    for (int y1 = g_height; y1 > 0; y1 -= bandHeight) {
+        int y0 = max(y1 - bandHeight, 0);
+        renderBand(y0, y1, band);
+        writePPMRows(fp, band, y1 - y0);
+    }
+    if (!endPPM(fp, g_outputFilename.c_str())) {
+        exit(1);
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Animation sequences
+
+// Where each named sphere and light is, for matching delta lines
+static unordered_map<string, int> s_sphereIndices;
+static unordered_map<string, int> s_lightIndices;
+
+// What the delta files of the current frame changed
+static vector<int> s_changedSpheres;
+static vector<char> s_sphereChanged;
+static bool s_spheresAdded = false;
+
+// Frames of the sequence, each a list of delta files
+static vector<vector<string> > s_sequenceFrames;
+
+static float s_bvhBuildCost = 0;
+
+/**
+ * Apply one line of a delta file: spheres and lights with a known name are
+ * replaced, others are added, and every other keyword sets what it sets in
+ * a scene file.
+ */
+void parseDeltaLine(const Token *vs) {
+    switch (toDatatype(vs[0])) {
+        case SPHERE:
+        {
+            unordered_map<string, int>::iterator match = s_sphereIndices.find(vs[1].str());
+            int i;
+            if (match == s_sphereIndices.end()) {
+                i = (int) g_spheres.size();
+                s_sphereIndices[vs[1].str()] = i;
+                parseLine(vs);
+                s_sphereChanged.push_back(0);
+                s_spheresAdded = true;
+            } else {
+                i = match->second;
+                g_spheres.owned(i) = parseSphere(vs);
+            }
+            if (!s_sphereChanged[i]) {
+                s_sphereChanged[i] = 1;
+                s_changedSpheres.push_back(i);
+            }
+            break;
+        }
+        case LIGHT:
+        {
+            unordered_map<string, int>::iterator match = s_lightIndices.find(vs[1].str());
+            if (match != s_lightIndices.end()) {
+                g_lights.owned(match->second) = parseLight(vs);
+            } else {
+                s_lightIndices[vs[1].str()] = (int) g_lights.size();
+                parseLine(vs);
+            }
+            break;
+        }
+        default:
+            parseLine(vs);
+            break;
+    }
+}
+
+void applyDeltaFile(const string &filename) {
+    PhaseTimer timer(PHASE_PARSE);
+    MappedFile file;
+    if (!mapFile(filename.c_str(), file)) {
+        cout << "Could not open file " << filename << endl;
+        exit(1);
+    }
+    if (isBinaryScene(file)) {
+        cout << "Delta file " << filename << " must be a text scene" << endl;
+        exit(1);
+    }
+    adviseSequential(file);
+    parseLines(file.data, file.data + file.size, parseDeltaLine);
+    unmapFile(file);
+}
+
+void parseFrameLine(const Token *vs) {
+    if (*vs[0].begin == '#') {
+        return;
+    }
+    vector<string> files;
+    for (int i = 0; i < MAX_LINE_TOKENS && vs[i].size() > 0; i++) {
+        files.push_back(vs[i].str());
+    }
+    s_sequenceFrames.push_back(files);
+}
+
+void buildSequenceBVH() {
+    buildSceneBVH();
+    s_bvhBuildCost = bvhCost(g_bvh);
+}
+
+/**
+ * Bring everything prepareScene() built up to date with the spheres the
+ * delta files changed. Only changed spheres are compiled and repacked; the
+ * BVH is refitted unless spheres were added or refitting made it more than
+ * g_refitThreshold times as costly as when it was built. Describes what
+ * happened to the acceleration structure in accelUpdate.
+ */
+void updateScene(Accelerator previousAccelerator, string &accelUpdate) {
+    PhaseTimer timer(PHASE_SETUP);
+    for (int i : s_changedSpheres) {
+        compileSphere((unsigned int) i);
+    }
+    if (s_spheresAdded) {
+        buildSphereStore();
+    } else {
+        updateSphereStore(s_changedSpheres);
+    }
+
+    bool rebuild = s_spheresAdded || g_accelerator != previousAccelerator;
+    accelUpdate = "";
+    if (g_accelerator == ACCEL_BVH) {
+        if (rebuild) {
+            buildSequenceBVH();
+            accelUpdate = "rebuilt BVH";
+        } else if (!s_changedSpheres.empty()) {
+            refitBVH(computeSphereBounds(), g_bvh);
+            float ratio = s_bvhBuildCost > 0 ? bvhCost(g_bvh) / s_bvhBuildCost : 1;
+            ostringstream update;
+            update << fixed << setprecision(2);
+            if (ratio > g_refitThreshold) {
+                buildSequenceBVH();
+                update << "rebuilt BVH (refit cost " << ratio << "x)";
+            } else {
+                update << "refitted BVH (cost " << ratio << "x)";
+            }
+            accelUpdate = update.str();
+        }
+    } else if (g_accelerator == ACCEL_GRID && (rebuild || !s_changedSpheres.empty())) {
+        // Refilling the grid's cells is all a rebuild does besides sizing it
+        buildSceneGrid();
+        accelUpdate = "rebuilt grid";
+    }
+    if (g_simdKernels != NULL) {
+        preparePacketScene();
+    }
+    buildLightIndex();
+
+    for (int i : s_changedSpheres) {
+        s_sphereChanged[i] = 0;
+    }
+    s_changedSpheres.clear();
+    s_spheresAdded = false;
+}
+
+/**
+ * Name of a frame's image: the first run of '#' in the pattern replaced by
+ * the zero-padded frame number, or the number inserted before the extension
+ * if there is none. "-" writes every frame to stdout in turn.
+ */
+string frameFilename(const string &pattern, int frame) {
+    if (pattern == "-") {
+        return pattern;
+    }
+
+    size_t begin = pattern.find('#');
+    size_t digits = 4;
+    if (begin != string::npos) {
+        digits = pattern.find_first_not_of('#', begin);
+        digits = (digits == string::npos ? pattern.size() : digits) - begin;
+    }
+    ostringstream number;
+    number << setw((int) digits) << setfill('0') << frame;
+
+    if (begin != string::npos) {
+        return pattern.substr(0, begin) + number.str() + pattern.substr(begin + digits);
+    }
+    size_t dot = pattern.rfind('.');
+    size_t slash = pattern.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return pattern + "." + number.str();
+    }
+    return pattern.substr(0, dot) + "." + number.str() + pattern.substr(dot);
+}
+
+/**
+ * Render an animation from the prepared scene. Every line of listFilename
+ * is a frame and names the delta files to apply, in order, on top of the
+ * previous frame's scene before rendering it. Each frame is the same as a
+ * standalone render of the scene it describes.
+ */
+void renderSequence(const char *listFilename) {
+    MappedFile list;
+    if (!mapFile(listFilename, list)) {
+        cout << "Could not open file " << listFilename << endl;
+        exit(1);
+    }
+    parseLines(list.data, list.data + list.size, parseFrameLine);
+    unmapFile(list);
+
+    // Deltas edit spheres in place, which a mapped binary scene cannot take
+    if (g_spheres.isMapped()) {
+        g_spheres.makeOwned();
+        g_lights.makeOwned();
+        g_sphereIds.makeOwned();
+        g_lightIds.makeOwned();
+        buildSphereStore();
+    }
+    for (size_t i = 0; i < g_spheres.size(); i++) {
+        s_sphereIndices.insert(make_pair(g_sphereIds[i], (int) i));
+    }
+    for (size_t i = 0; i < g_lights.size(); i++) {
+        s_lightIndices.insert(make_pair(g_lightIds[i], (int) i));
+    }
+    s_sphereChanged.assign(g_spheres.size(), 0);
+    if (g_accelerator == ACCEL_BVH) {
+        s_bvhBuildCost = bvhCost(g_bvh);
+    }
+
+    int frameCount = (int) s_sequenceFrames.size();
+    for (int frame = 0; frame < frameCount; frame++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Accelerator previousAccelerator = g_accelerator;
+        for (const string &delta : s_sequenceFrames[frame]) {
+            applyDeltaFile(delta);
+        }
+        string accelUpdate;
+        updateScene(previousAccelerator, accelUpdate);
+        chrono::steady_clock::time_point updated = chrono::steady_clock::now();
+
+        render();
+        chrono::steady_clock::time_point rendered = chrono::steady_clock::now();
+
+        cout << "Frame " << frame + 1 << "/" << frameCount << ": updated in " << fixed << setprecision(1)
+             << chrono::duration<double>(updated - start).count() * 1e3 << " ms"
+             << (accelUpdate.empty() ? "" : ", ") << accelUpdate << "; rendered in "
+             << chrono::duration<double>(rendered - updated).count() * 1e3 << " ms" << defaultfloat << endl;
+        string filename = frameFilename(g_outputFilename, frame + 1);
+        if (!saveImage(filename.c_str(), selectImageEncoder(filename.c_str()))) {
+            exit(1);
+        }
     }
-    loadFile(argv[1]);
-    render();
-    saveFile();
-    return 0;
 }
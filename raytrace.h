@@ -0,0 +1,280 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- raytrace.h ---
+//
+//  Scene data, render options and the entry points of the ray tracer.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RAYTRACE_H__
+#define __RAYTRACE_H__
+
+#include "matm.h"
+#include "framebuffer.h"
+#include "image_encoder.h"
+#include "mapped_file.h"
+#include "pixel_order.h"
+#include "simd.h"
+#include "bvh.h"
+#include "grid.h"
+#include "render_stats.h"
+#include "scene_array.h"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Program constants
+#define MIN_HIT_TIME 1.0f
+#define MIN_RELECT_HIT_TIME 0.0001f
+#ifndef MAX_REFLECTIONS
+#define MAX_REFLECTIONS 3               // Set with cmake -DRT_MAX_REFLECTIONS=N
+#endif
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_TILE_SIZE 32
+#define DEFAULT_BAND_HEIGHT 64
+#define DEFAULT_AA_THRESHOLD 0.1f
+#define DEFAULT_REFIT_THRESHOLD 1.3f
+
+// STRUCTURES
+struct Ray {
+    vec4 origin;
+    vec4 dir;
+    int reflectionLevel;
+};
+
+/**
+ * Render-ready sphere. loadFile() fills in the scene description and
+ * compileScene() derives the rest; the tracer never writes to it. Fields
+ * read while shading come first; the sphere's name is kept apart in
+ * g_sphereIds.
+ */
+struct Sphere {
+    vec4 position;
+    mat4 inverseTransform;  // Closed-form inverse of Scale(scale)
+    mat4 normalMatrix;      // transpose(inverseTransform) * inverseTransform
+    vec4 color;
+    float Ka;
+    float Kd;
+    float Ks;
+    float Kr;
+    float specularExponent;
+    bool reflective;        // Kr != 0: reflection rays can change the color
+    bool lit;               // Kd or Ks != 0: shadow rays can change the color
+    vec3 scale;
+};
+
+struct Light {
+    vec4 position;
+    vec4 color;
+    float radius;           // Fades out at this distance; 0 reaches everywhere at full strength
+};
+
+struct Intersection {
+    Ray ray;
+    float distance;
+    vec4 point;
+    bool interiorPoint;
+    const Sphere *sphere;
+    vec4 normal;
+};
+
+enum Accelerator {
+    ACCEL_NONE,
+    ACCEL_BVH,
+    ACCEL_GRID
+};
+
+
+extern Framebuffer g_framebuffer;
+extern std::vector<unsigned int> g_costs;    // Per-pixel work, top row first, when g_recordCosts is set
+
+// SCENE DATA
+// Planes
+extern float g_near;
+extern float g_left;
+extern float g_right;
+extern float g_top;
+extern float g_bottom;
+
+// Resolution
+extern int g_width;
+extern int g_height;
+
+extern SceneArray<Sphere> g_spheres;
+extern SceneArray<Light> g_lights;
+extern NameTable g_sphereIds;
+extern NameTable g_lightIds;
+extern vec4 g_backgroundColor;
+extern vec4 g_ambientIntensity;
+extern std::string g_outputFilename;
+
+// Acceleration structure
+extern Accelerator g_accelerator;
+extern SphereStore g_sphereStore;
+extern BVH g_bvh;
+extern Grid g_grid;
+
+/**
+ * Lights by where they reach: the lights without a radius apply everywhere,
+ * the others are found through a grid over their spheres of influence,
+ * whose cells hold light indices in scene order.
+ */
+struct LightIndex {
+    std::vector<int> unbounded;
+    Grid grid;
+};
+
+extern LightIndex g_lightIndex;
+
+// RENDER OPTIONS
+extern int g_threadCount;
+extern int g_tileSize;
+extern bool g_wavefront;
+extern bool g_streamOutput;
+extern int g_bandHeight;
+extern bool g_progressive;
+extern double g_timeBudget;
+extern int g_aaDepth;
+extern float g_aaThreshold;
+extern float g_refitThreshold;
+extern bool g_recordCosts;
+extern CostMetric g_costMetric;
+extern std::string g_simdISA;
+extern FramebufferFormat g_framebufferFormat;
+extern PixelOrder g_pixelOrder;
+
+
+// Input file parsing
+void loadFile(const char *filename);
+
+void clearScene();
+
+bool loadSceneBuffer(const char *name, MappedFile &buffer);
+
+// Scene setup
+void compileScene();
+
+void compileSphere(unsigned int i);
+
+void buildSphereStore();
+
+void updateSphereStore(const std::vector<int> &spheres);
+
+void buildSceneBVH();
+
+void buildSceneGrid();
+
+void buildLightIndex();
+
+/**
+ * Call visit(l) for every light l whose influence can reach point, in scene
+ * order: the lights without a radius and those listed in the light grid
+ * cell holding point. Lights near a cell can still be out of reach.
+ */
+template<class Visit>
+inline void forEachLight(const vec4 &point, Visit visit) {
+    const int *unbounded = g_lightIndex.unbounded.data();
+    const int *unboundedEnd = unbounded + g_lightIndex.unbounded.size();
+    const int *bounded = NULL;
+    const int *boundedEnd = NULL;
+    if (!g_lightIndex.grid.cellSpheres.empty()) {
+        findGridCell(g_lightIndex.grid, point.x, point.y, point.z, bounded, boundedEnd);
+    }
+    // Merge the two sorted lists, so lights add up in the same order as a loop over all of them
+    while (unbounded != unboundedEnd || bounded != boundedEnd) {
+        if (bounded == boundedEnd || (unbounded != unboundedEnd && *unbounded < *bounded)) {
+            visit(*unbounded++);
+        } else {
+            visit(*bounded++);
+        }
+    }
+}
+
+void prepareScene();
+
+int renderThreadCount();
+
+/**
+ * Run work(self) for self in [0, threadCount) on the render threads, the
+ * caller being thread 0, and wait for all of them.
+ */
+void runOnRenderThreads(int threadCount, const std::function<void(int)> &work);
+
+// Tracing
+Intersection calculateNearestIntersection(const Ray &ray);
+
+Intersection intersectOneSphere(const Ray &ray, const Sphere &sphere);
+
+Ray makeReflectionRay(const Ray &ray, const Intersection &intersection);
+
+/**
+ * Build the shadow ray from an intersection towards a light. Returns false
+ * if the light cannot add anything there, blocked or not, because it is
+ * behind the surface or out of its reach; no shadow ray is needed then.
+ */
+bool makeShadowRay(const Ray &ray, const Intersection &intersection, const Light &light, Ray &lightRay,
+                   float &lightDistance);
+
+vec4 shade(const Ray &ray, const Intersection &intersection);
+
+vec4 trace(const Ray &ray);
+
+vec4 getSampleDir(float px, float py);
+
+vec4 getDir(int ix, int iy);
+
+/**
+ * Render rows [y0, y1) of the image, counted from the bottom like getDir(),
+ * into the first y1 - y0 rows of band, top row first. band must be g_width
+ * pixels wide.
+ */
+void renderBand(int y0, int y1, Framebuffer &band);
+
+/**
+ * Render columns [x0, x1) of rows [y0, y1), rows counted from the bottom
+ * like getDir(), into the first y1 - y0 rows of frame, top row first. frame
+ * must be x1 - x0 pixels wide.
+ */
+void renderWindow(int x0, int y0, int x1, int y1, Framebuffer &frame);
+
+/**
+ * Render only the window of columns [x0, x1) and rows [y0, y1) of the
+ * image into g_framebuffer, which becomes x1 - x0 by y1 - y0 pixels. Rows
+ * here count from the top, as in the image file. Every pixel gets the
+ * color it has in a render() of the whole image.
+ */
+void renderRegion(int x0, int y0, int x1, int y1);
+
+void render();
+
+void renderProgressive(double budgetSeconds);
+
+void renderIncremental(const char *cacheFilename);
+
+void renderSequence(const char *listFilename);
+
+bool renderWithin(double budgetSeconds, const std::atomic<bool> *cancel);
+
+void printAntialiasingStats();
+
+// Output
+/**
+ * Write the image to g_outputFilename in the format its extension picks.
+ * Returns false, saying so, if it cannot be written.
+ */
+bool saveFile();
+
+void encodePPM(std::vector<unsigned char> &out);
+
+void encodeImage(const ImageEncoder *encoder, std::vector<unsigned char> &out);
+
+bool saveFileAtomic();
+
+void renderStreaming();
+
+bool saveHeatmap(const char *fname);
+
+bool saveRawCosts(const char *fname);
+
+#endif // __RAYTRACE_H__
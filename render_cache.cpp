@@ -0,0 +1,492 @@
+#include "render_cache.h"
+#include "scene_file.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+// Past this many changed spheres testing every pixel's rays against them costs about as much as tracing
+#define MAX_CHANGED_SPHERES 64
+
+// The primary hit of a sample that has to be searched for
+#define HIT_UNKNOWN -2
+
+// Whether the sample at a pixel corner has been tested yet, and how it came out
+#define CORNER_UNKNOWN 0
+#define CORNER_CLEAR 1
+#define CORNER_TOUCHED 2
+
+
+// -------------------------------------------------------------------
+// Loading
+
+static bool validHeader(const RenderCacheHeader &header, size_t fileSize) {
+    if (header.version != RENDER_CACHE_VERSION || header.byteOrder != RENDER_CACHE_BYTE_ORDER ||
+        header.headerSize != sizeof(RenderCacheHeader) || header.sphereSize != sizeof(Sphere) ||
+        header.lightSize != sizeof(Light) || header.fileSize != fileSize || header.width < 0 || header.height < 0 ||
+        header.framebufferFormat < 0 || header.framebufferFormat >= FRAMEBUFFER_FORMAT_COUNT) {
+        return false;
+    }
+
+    unsigned long long pixelCount = (unsigned long long) header.width * header.height;
+    return validFileSection(header.fileSize, header.spheres, header.sphereCount, sizeof(Sphere)) &&
+           validFileSection(header.fileSize, header.lights, header.lightCount, sizeof(Light)) &&
+           validFileSection(header.fileSize, header.sphereNameOffsets, header.sphereCount + 1, 8) &&
+           validFileSection(header.fileSize, header.sphereNames, header.sphereNamesSize, 1) &&
+           validFileSection(header.fileSize, header.colors, pixelCount,
+                        framebufferPixelBytes((FramebufferFormat) header.framebufferFormat)) &&
+           validFileSection(header.fileSize, header.hits, pixelCount, sizeof(int)) &&
+           validFileSection(header.fileSize, header.refined, pixelCount, 1);
+}
+
+bool loadRenderCache(const char *filename, RenderCache &cache) {
+    cache.file.data = NULL;
+    cache.file.size = 0;
+    cache.file.mapped = false;
+    if (!mapFile(filename, cache.file)) {
+        cout << "No render cache " << filename << ", rendering everything" << endl;
+        return false;
+    }
+
+    const RenderCacheHeader *header = (const RenderCacheHeader *) cache.file.data;
+    if (cache.file.size < sizeof(RenderCacheHeader) || memcmp(header->magic, RENDER_CACHE_MAGIC, 8) != 0 ||
+        !validHeader(*header, cache.file.size)) {
+        cout << "Render cache " << filename << " is corrupt or was written by an incompatible version, "
+             << "rendering everything" << endl;
+        unloadRenderCache(cache);
+        return false;
+    }
+
+    const char *base = cache.file.data;
+    const unsigned long long *nameOffsets = (const unsigned long long *) (base + header->sphereNameOffsets);
+    for (unsigned long long i = 0; i < header->sphereCount; i++) {
+        if (nameOffsets[0] != 0 || nameOffsets[i + 1] < nameOffsets[i] ||
+            nameOffsets[i + 1] > header->sphereNamesSize) {
+            cout << "Render cache " << filename << " has corrupt names, rendering everything" << endl;
+            unloadRenderCache(cache);
+            return false;
+        }
+    }
+
+    // Cached hits index the cached spheres unchecked
+    const int *hits = (const int *) (base + header->hits);
+    for (unsigned long long p = 0; p < (unsigned long long) header->width * header->height; p++) {
+        if (hits[p] >= 0 && (unsigned long long) hits[p] >= header->sphereCount) {
+            cout << "Render cache " << filename << " has hits on spheres it does not hold, rendering everything"
+                 << endl;
+            unloadRenderCache(cache);
+            return false;
+        }
+    }
+
+    cache.header = header;
+    cache.spheres = (const Sphere *) (base + header->spheres);
+    cache.lights = (const Light *) (base + header->lights);
+    cache.sphereIds.view(base + header->sphereNames, nameOffsets, (size_t) header->sphereCount);
+    cache.colors = (const unsigned char *) (base + header->colors);
+    cache.hits = hits;
+    cache.refined = (const unsigned char *) (base + header->refined);
+    return true;
+}
+
+void unloadRenderCache(RenderCache &cache) {
+    cache.sphereIds.clear();
+    unmapFile(cache.file);
+}
+
+
+// -------------------------------------------------------------------
+// Saving
+
+bool saveRenderCache(const char *filename, const int *hits, const unsigned char *refined) {
+    RenderCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RENDER_CACHE_MAGIC, 8);
+    header.version = RENDER_CACHE_VERSION;
+    header.byteOrder = RENDER_CACHE_BYTE_ORDER;
+    header.headerSize = sizeof(RenderCacheHeader);
+    header.sphereSize = sizeof(Sphere);
+    header.lightSize = sizeof(Light);
+    header.aaDepth = g_aaDepth;
+    header.aaThreshold = g_aaThreshold;
+    header.maxReflections = MAX_REFLECTIONS;
+    header.nearPlane = g_near;
+    header.left = g_left;
+    header.right = g_right;
+    header.top = g_top;
+    header.bottom = g_bottom;
+    header.width = g_width;
+    header.height = g_height;
+    header.framebufferFormat = g_framebuffer.format();
+    for (int k = 0; k < 4; k++) {
+        header.backgroundColor[k] = g_backgroundColor[k];
+        header.ambientIntensity[k] = g_ambientIntensity[k];
+    }
+    header.sphereCount = g_spheres.size();
+    header.lightCount = g_lights.size();
+    header.sphereNamesSize = g_sphereIds.offsets()[g_sphereIds.size()];
+
+    unsigned long long pixelCount = (unsigned long long) g_width * g_height;
+    unsigned long long end = sizeof(RenderCacheHeader);
+    header.spheres = alignFileSection(end);
+    end = header.spheres + header.sphereCount * sizeof(Sphere);
+    header.lights = alignFileSection(end);
+    end = header.lights + header.lightCount * sizeof(Light);
+    header.sphereNameOffsets = alignFileSection(end);
+    end = header.sphereNameOffsets + (header.sphereCount + 1) * 8;
+    header.sphereNames = alignFileSection(end);
+    end = header.sphereNames + header.sphereNamesSize;
+    header.colors = alignFileSection(end);
+    end = header.colors + g_framebuffer.size();
+    header.hits = alignFileSection(end);
+    end = header.hits + pixelCount * sizeof(int);
+    header.refined = alignFileSection(end);
+    end = header.refined + pixelCount;
+    header.fileSize = end;
+
+    // Write next to the cache and rename, so an interrupted run leaves the old cache intact
+    string temporary = string(filename) + ".tmp";
+    FILE *fp = fopen(temporary.c_str(), "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", temporary.c_str());
+        return false;
+    }
+    unsigned long long written = 0;
+    writeFileSection(fp, written, 0, &header, sizeof(header));
+    writeFileSection(fp, written, header.spheres, g_spheres.data(), header.sphereCount * sizeof(Sphere));
+    writeFileSection(fp, written, header.lights, g_lights.data(), header.lightCount * sizeof(Light));
+    writeFileSection(fp, written, header.sphereNameOffsets, g_sphereIds.offsets(), (header.sphereCount + 1) * 8);
+    writeFileSection(fp, written, header.sphereNames, g_sphereIds.text(), header.sphereNamesSize);
+    writeFileSection(fp, written, header.colors, g_framebuffer.data(), g_framebuffer.size());
+    writeFileSection(fp, written, header.hits, hits, pixelCount * sizeof(int));
+    writeFileSection(fp, written, header.refined, refined, pixelCount);
+
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (ok && rename(temporary.c_str(), filename) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        printf("Unable to write file '%s'\n", filename);
+    }
+    return ok;
+}
+
+
+// -------------------------------------------------------------------
+// Comparing scenes
+
+static Bounds sphereBounds(const Sphere &sphere) {
+    Bounds bounds;
+    bounds.center = sphere.position;
+    bounds.radius = fmaxf(fabsf(sphere.scale.x), fmaxf(fabsf(sphere.scale.y), fabsf(sphere.scale.z)));
+    return bounds;
+}
+
+static bool sameVec4(const vec4 &a, const vec4 &b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w;
+}
+
+static bool sameShape(const Sphere &a, const Sphere &b) {
+    return sameVec4(a.position, b.position) && a.scale.x == b.scale.x && a.scale.y == b.scale.y &&
+           a.scale.z == b.scale.z;
+}
+
+static bool sameMaterial(const Sphere &a, const Sphere &b) {
+    return sameVec4(a.color, b.color) && a.Ka == b.Ka && a.Kd == b.Kd && a.Ks == b.Ks && a.Kr == b.Kr &&
+           a.specularExponent == b.specularExponent;
+}
+
+/**
+ * Flag the pixels a ball can cover on screen, with a pixel to spare on
+ * every side for the extra corner samples of anti-aliasing. A ball that
+ * reaches the eye's plane can cover anything.
+ */
+static void markFootprint(const Bounds &bounds, vector<char> &footprint) {
+    const vec4 &c = bounds.center;
+    float r = bounds.radius;
+    if (c.z + r >= 0) {
+        fill(footprint.begin(), footprint.end(), 1);
+        return;
+    }
+
+    // The ball's bounding box projects inside the hull of its projected corners
+    float xLow = INFINITY, xHigh = -INFINITY, yLow = INFINITY, yHigh = -INFINITY;
+    for (int corner = 0; corner < 8; corner++) {
+        float x = c.x + (corner & 1 ? r : -r);
+        float y = c.y + (corner & 2 ? r : -r);
+        float z = c.z + (corner & 4 ? r : -r);
+        float px = (x * g_near / -z - g_left) / (g_right - g_left) * g_width;
+        float py = (y * g_near / -z - g_bottom) / (g_top - g_bottom) * g_height;
+        xLow = fminf(xLow, px);
+        xHigh = fmaxf(xHigh, px);
+        yLow = fminf(yLow, py);
+        yHigh = fmaxf(yHigh, py);
+    }
+
+    int x0 = (int) fmaxf(floorf(xLow) - 1, 0);
+    int x1 = (int) fminf(ceilf(xHigh) + 1, (float) (g_width - 1));
+    int y0 = (int) fmaxf(floorf(yLow) - 1, 0);
+    int y1 = (int) fminf(ceilf(yHigh) + 1, (float) (g_height - 1));
+    for (int iy = y0; iy <= y1; iy++)
+        for (int ix = x0; ix <= x1; ix++)
+            footprint[(size_t) (g_height - 1 - iy) * g_width + ix] = 1;
+}
+
+/**
+ * Whether origin + t * dir passes through a ball for some t in [0, maxT].
+ */
+static bool rayTouches(const vec4 &origin, const vec4 &dir, float maxT, const Bounds &bounds) {
+    vec4 toCenter = bounds.center - origin;
+    float length = dot(dir, dir);
+    float t = length > 0 ? fminf(fmaxf(dot(toCenter, dir) / length, 0), maxT) : 0;
+    vec4 offset = toCenter - dir * t;
+    // Leave room for rounding
+    float radius = bounds.radius * 1.001f + 1e-4f;
+    return dot(offset, offset) <= radius * radius;
+}
+
+/**
+ * Whether any shadow or reflection ray that goes into the color of hit,
+ * found along ray, can pass through a changed sphere. Shadow rays only
+ * depend on where spheres are, so they are only tested against the moved
+ * ones. Reflections are followed through the current scene as far as
+ * trace() would.
+ */
+static bool pathTouches(const Ray &ray, const Intersection &hit, const vector<Bounds> &changed,
+                        const vector<Bounds> &moved) {
+    if (hit.sphere->lit && !moved.empty()) {
+        // Only lights that can add anything at the hit cast shadows there
+        bool touched = false;
+        forEachLight(hit.point, [&](int l) {
+            const Light &light = g_lights[l];
+            Ray lightRay;
+            float lightDistance;
+            if (touched || !makeShadowRay(ray, hit, light, lightRay, lightDistance)) {
+                return;
+            }
+            for (const Bounds &bounds : moved)
+                if (rayTouches(hit.point, light.position - hit.point, 1, bounds)) {
+                    touched = true;
+                    return;
+                }
+        });
+        if (touched) {
+            return true;
+        }
+    }
+    if (!hit.sphere->reflective || ray.reflectionLevel + 1 >= MAX_REFLECTIONS) {
+        return false;
+    }
+
+    Ray reflection = makeReflectionRay(ray, hit);
+    Intersection next = calculateNearestIntersection(reflection);
+    // Up to the next hit, or without end if there is none
+    float maxT = next.distance == -1 ? INFINITY : next.distance;
+    for (const Bounds &bounds : changed) {
+        if (rayTouches(reflection.origin, reflection.dir, maxT, bounds)) {
+            return true;
+        }
+    }
+    return next.distance != -1 && pathTouches(reflection, next, changed, moved);
+}
+
+/**
+ * Whether the primary ray through (px, py) on the image plane, or any ray
+ * behind its color, can pass through a changed sphere. sphere is the index
+ * of the sphere the primary ray is known to hit, -1 if it is known to hit
+ * nothing, or HIT_UNKNOWN.
+ */
+static bool sampleTouches(float px, float py, int sphere, const SceneChanges &changes) {
+    if (sphere == -1) {
+        return false;
+    }
+
+    Ray ray;
+    ray.origin = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    ray.dir = getSampleDir(px, py);
+    ray.reflectionLevel = 0;
+
+    if (sphere != HIT_UNKNOWN) {
+        return pathTouches(ray, intersectOneSphere(ray, g_spheres[sphere]), changes.changed, changes.moved);
+    }
+    Intersection hit = calculateNearestIntersection(ray);
+    float maxT = hit.distance == -1 ? INFINITY : hit.distance;
+    for (const Bounds &bounds : changes.changed) {
+        if (rayTouches(ray.origin, ray.dir, maxT, bounds)) {
+            return true;
+        }
+    }
+    return hit.distance != -1 && pathTouches(ray, hit, changes.changed, changes.moved);
+}
+
+/**
+ * Map each name to its index, or return false if a name is used twice.
+ */
+static bool indexNames(const NameTable &names, unordered_map<string, int> &indices) {
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!indices.insert(make_pair(names[i], (int) i)).second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool findSceneChanges(const RenderCache &cache, SceneChanges &changes) {
+    const RenderCacheHeader &header = *cache.header;
+    const char *reason = NULL;
+    if (header.width != g_width || header.height != g_height || header.nearPlane != g_near ||
+        header.left != g_left || header.right != g_right || header.top != g_top || header.bottom != g_bottom) {
+        reason = "the camera or resolution changed";
+    } else if (header.aaDepth != g_aaDepth || header.aaThreshold != g_aaThreshold) {
+        reason = "the anti-aliasing settings changed";
+    } else if (header.maxReflections != MAX_REFLECTIONS) {
+        reason = "the reflection depth of the build changed";
+    } else if (header.framebufferFormat != g_framebufferFormat) {
+        reason = "the framebuffer format changed";
+    } else if (!sameVec4(vec4(header.backgroundColor[0], header.backgroundColor[1], header.backgroundColor[2],
+                              header.backgroundColor[3]), g_backgroundColor) ||
+               !sameVec4(vec4(header.ambientIntensity[0], header.ambientIntensity[1], header.ambientIntensity[2],
+                              header.ambientIntensity[3]), g_ambientIntensity)) {
+        reason = "the background or ambient light changed";
+    } else if (header.lightCount != g_lights.size()) {
+        reason = "the lights changed";
+    } else {
+        for (size_t l = 0; l < g_lights.size() && reason == NULL; l++) {
+            if (!sameVec4(cache.lights[l].position, g_lights[l].position) ||
+                !sameVec4(cache.lights[l].color, g_lights[l].color) || cache.lights[l].radius != g_lights[l].radius) {
+                reason = "the lights changed";
+            }
+        }
+    }
+
+    // Spheres are matched up by name
+    unordered_map<string, int> cachedIndices;
+    unordered_map<string, int> currentIndices;
+    if (reason == NULL && (!indexNames(cache.sphereIds, cachedIndices) || !indexNames(g_sphereIds, currentIndices))) {
+        reason = "sphere names are not unique";
+    }
+
+    changes.cache = &cache;
+    changes.renumber.assign((size_t) header.sphereCount, -1);
+    changes.changed.clear();
+    changes.moved.clear();
+    for (size_t i = 0; i < g_spheres.size() && reason == NULL; i++) {
+        unordered_map<string, int>::const_iterator match = cachedIndices.find(g_sphereIds[i]);
+        if (match == cachedIndices.end()) {
+            changes.changed.push_back(sphereBounds(g_spheres[i]));
+            changes.moved.push_back(changes.changed.back());
+            continue;
+        }
+
+        const Sphere &before = cache.spheres[match->second];
+        const Sphere &after = g_spheres[i];
+        if (!sameShape(before, after)) {
+            changes.changed.push_back(sphereBounds(before));
+            changes.changed.push_back(sphereBounds(after));
+            changes.moved.push_back(sphereBounds(before));
+            changes.moved.push_back(sphereBounds(after));
+        } else if (!sameMaterial(before, after)) {
+            changes.changed.push_back(sphereBounds(after));
+        } else {
+            changes.renumber[match->second] = (int) i;
+        }
+    }
+    for (size_t i = 0; i < cache.sphereIds.size() && reason == NULL; i++) {
+        if (currentIndices.find(cache.sphereIds[i]) == currentIndices.end()) {
+            changes.changed.push_back(sphereBounds(cache.spheres[i]));
+            changes.moved.push_back(changes.changed.back());
+        }
+    }
+    if (reason == NULL && changes.changed.size() > 2 * MAX_CHANGED_SPHERES) {
+        reason = "too many spheres changed";
+    }
+
+    size_t pixelCount = (size_t) g_width * g_height;
+    changes.footprint.assign(pixelCount, 0);
+    for (const Bounds &bounds : changes.changed) {
+        markFootprint(bounds, changes.footprint);
+    }
+
+    if (reason == NULL && g_aaDepth > 0) {
+        // Past about one lattice test per pixel, checking costs more than tracing
+        int lattice = 1 << g_aaDepth;
+        size_t latticeTests = 0;
+        for (size_t p = 0; p < pixelCount; p++) {
+            if (!changes.footprint[p] && cache.refined[p]) {
+                latticeTests += (size_t) ((lattice + 1) * (lattice + 1) - 4);
+            }
+        }
+        if (latticeTests > pixelCount) {
+            reason = "too many anti-aliased edges to check";
+        }
+    }
+
+    if (reason != NULL) {
+        cout << "Incremental render: " << reason << ", rendering everything" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Tested corner samples of the tile being checked, reused by each thread.
+ */
+static thread_local vector<char> s_corners;
+
+bool tileChanged(const SceneChanges &changes, int x0, int y0, int x1, int y1) {
+    if (changes.changed.empty()) {
+        return false;
+    }
+
+    // Anti-aliased pixels also use the corners they share with the pixels
+    // to their right and above, and refined ones any point of the finest
+    // lattice they can be split to. None of these primary rays meets a
+    // changed sphere outside the footprints, so where a corner is some
+    // pixel's own sample it still hits what the cache says.
+    const RenderCache &cache = *changes.cache;
+    int spread = g_aaDepth > 0 ? 1 : 0;
+    int lattice = 1 << max(g_aaDepth, 0);
+    int cornerWidth = x1 - x0 + spread;
+    s_corners.assign((size_t) cornerWidth * (y1 - y0 + spread), CORNER_UNKNOWN);
+
+    for (int iy = y0; iy < y1; iy++)
+        for (int ix = x0; ix < x1; ix++) {
+            size_t p = (size_t) (g_height - 1 - iy) * g_width + ix;
+            if (changes.footprint[p]) {
+                return true;
+            }
+
+            for (int dy = 0; dy <= spread; dy++)
+                for (int dx = 0; dx <= spread; dx++) {
+                    char &corner = s_corners[(size_t) (iy - y0 + dy) * cornerWidth + ix - x0 + dx];
+                    if (corner == CORNER_UNKNOWN) {
+                        int sphere = HIT_UNKNOWN;
+                        if (ix + dx < g_width && iy + dy < g_height) {
+                            int hit = cache.hits[(size_t) (g_height - 1 - iy - dy) * g_width + ix + dx];
+                            sphere = hit < 0 ? -1 : changes.renumber[hit] < 0 ? HIT_UNKNOWN : changes.renumber[hit];
+                        }
+                        bool touched = sampleTouches((float) (ix + dx), (float) (iy + dy), sphere, changes);
+                        corner = touched ? CORNER_TOUCHED : CORNER_CLEAR;
+                    }
+                    if (corner == CORNER_TOUCHED) {
+                        return true;
+                    }
+                }
+
+            if (spread > 0 && cache.refined[p]) {
+                for (int sy = 0; sy <= lattice; sy++)
+                    for (int sx = 0; sx <= lattice; sx++)
+                        if (sampleTouches(ix + (float) sx / lattice, iy + (float) sy / lattice, HIT_UNKNOWN,
+                                          changes)) {
+                            return true;
+                        }
+            }
+        }
+    return false;
+}
@@ -0,0 +1,133 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- render_cache.h ---
+//
+//  Render caches for incremental rendering. A cache holds the scene an
+//  image was rendered from, the image itself and the sphere each pixel's
+//  primary ray hit, so the next render of an edited scene only has to
+//  trace the pixels the edit can reach.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RENDER_CACHE_H__
+#define __RENDER_CACHE_H__
+
+#include "mapped_file.h"
+#include "raytrace.h"
+#include <vector>
+
+#define RENDER_CACHE_MAGIC "RTCACHE"
+#define RENDER_CACHE_VERSION 4
+#define RENDER_CACHE_BYTE_ORDER 0x01020304u
+
+/**
+ * File header. Sections start at multiples of SCENE_FILE_ALIGNMENT bytes
+ * and hold raw records, like binary scene files. colors, hits and refined
+ * have one entry per pixel in the order of g_framebuffer, colors in its
+ * framebufferFormat; hits are indices into
+ * the cached spheres, -1 where the primary ray hit nothing, and refined is
+ * 1 where anti-aliasing took more samples than the pixel's corners.
+ */
+struct RenderCacheHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder;
+    unsigned int headerSize;
+    unsigned int sphereSize;
+    unsigned int lightSize;
+    int aaDepth;
+    float aaThreshold;
+    int maxReflections;             // MAX_REFLECTIONS of the build that wrote it
+
+    float nearPlane;
+    float left;
+    float right;
+    float top;
+    float bottom;
+    int width;
+    int height;
+    int framebufferFormat;
+    float backgroundColor[4];
+    float ambientIntensity[4];
+
+    unsigned long long sphereCount;
+    unsigned long long lightCount;
+
+    // Byte offsets of the sections
+    unsigned long long spheres;
+    unsigned long long lights;
+    unsigned long long sphereNameOffsets;   // sphereCount + 1 offsets into sphereNames
+    unsigned long long sphereNames;
+    unsigned long long sphereNamesSize;
+    unsigned long long colors;
+    unsigned long long hits;
+    unsigned long long refined;
+    unsigned long long fileSize;
+};
+
+/**
+ * A render cache read back from disk. Everything points into the mapped
+ * file, which stays mapped until unloadRenderCache().
+ */
+struct RenderCache {
+    MappedFile file;
+    const RenderCacheHeader *header;
+    const Sphere *spheres;
+    const Light *lights;
+    NameTable sphereIds;
+    const unsigned char *colors;
+    const int *hits;
+    const unsigned char *refined;
+};
+
+/**
+ * Map a render cache. Returns false, saying why, if there is none or it
+ * cannot be used.
+ */
+bool loadRenderCache(const char *filename, RenderCache &cache);
+
+void unloadRenderCache(RenderCache &cache);
+
+/**
+ * Write the current scene, g_framebuffer and the per-pixel hits (indices into
+ * g_spheres) and refined flags as a render cache. The file is replaced
+ * atomically.
+ */
+bool saveRenderCache(const char *filename, const int *hits, const unsigned char *refined);
+
+/**
+ * Bounding ball of a sphere.
+ */
+struct Bounds {
+    vec4 center;
+    float radius;
+};
+
+/**
+ * How the current scene differs from the one a cache was rendered from.
+ */
+struct SceneChanges {
+    const RenderCache *cache;
+    std::vector<int> renumber;      // Index of each cached sphere in g_spheres, -1 if it changed or went away
+    std::vector<Bounds> changed;    // Every changed sphere, as it was and as it is
+    std::vector<Bounds> moved;      // Only those whose shape changed, which can cast different shadows
+    std::vector<char> footprint;    // Per pixel, laid out like g_framebuffer: a primary ray may meet a changed sphere
+};
+
+/**
+ * Compare the current scene with the one the cache was rendered from.
+ * Returns false, saying why, if the change reaches the whole image: a
+ * different camera, resolution, background, ambient light, light,
+ * anti-aliasing setting or framebuffer format.
+ */
+bool findSceneChanges(const RenderCache &cache, SceneChanges &changes);
+
+/**
+ * Whether any pixel of [x0, x1) x [y0, y1) can come out differently from
+ * the cache: one of its samples, or the shadow and reflection rays behind
+ * them, can reach a changed sphere. Only reads shared data, so tiles can be
+ * checked on several threads.
+ */
+bool tileChanged(const SceneChanges &changes, int x0, int y0, int x1, int y1);
+
+#endif // __RENDER_CACHE_H__
@@ -0,0 +1,565 @@
+#include "render_farm.h"
+#include "raytrace.h"
+#include "render_service.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+// -------------------------------------------------------------------
+// Addresses
+
+/**
+ * Split "host:port" into its parts. Anything with a '/' or without a ':'
+ * is the path of a UNIX domain socket.
+ */
+static bool splitTCPAddress(const char *address, string &host, string &port) {
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || strchr(address, '/') != NULL) {
+        return false;
+    }
+    host.assign(address, colon);
+    port = colon + 1;
+    return true;
+}
+
+static struct addrinfo *resolveAddress(const string &host, const string &port, bool passive) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo *addresses = NULL;
+    int error = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addresses);
+    if (error != 0) {
+        cout << "Could not resolve " << host << ":" << port << ": " << gai_strerror(error) << endl;
+        return NULL;
+    }
+    return addresses;
+}
+
+static int listenOnAddress(const char *address) {
+    string host, port;
+    if (!splitTCPAddress(address, host, port)) {
+        return listenOnSocket(address);
+    }
+    struct addrinfo *addresses = resolveAddress(host, port, true);
+    if (addresses == NULL) {
+        return -1;
+    }
+
+    int fd = -1;
+    int error = 0;
+    for (struct addrinfo *a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            error = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        cout << "Could not listen on " << address << ": " << strerror(error) << endl;
+    }
+    return fd;
+}
+
+static int connectOnce(const char *address) {
+    string host, port;
+    if (!splitTCPAddress(address, host, port)) {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(local.sun_path)) {
+            return -1;
+        }
+        strcpy(local.sun_path, address);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &local, sizeof(local)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *addresses = resolveAddress(host, port, false);
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (addresses != NULL) {
+        freeaddrinfo(addresses);
+    }
+    return fd;
+}
+
+/**
+ * Connect to address, retrying for FARM_CONNECT_SECONDS so workers can be
+ * started before the coordinator.
+ */
+static int connectToAddress(const char *address) {
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(FARM_CONNECT_SECONDS);
+    while (true) {
+        int fd = connectOnce(address);
+        if (fd >= 0 || chrono::steady_clock::now() >= deadline) {
+            return fd;
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+}
+
+/**
+ * Send headers without waiting for more data to fill a packet. Fails
+ * harmlessly on UNIX domain sockets.
+ */
+static void disableNagle(int fd) {
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+}
+
+static void setTimeout(int fd, int option, int seconds) {
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+
+// -------------------------------------------------------------------
+// Coordinator
+
+struct FarmBand {
+    int y0;
+    int y1;
+    bool done;
+    int running;                                // Workers rendering it now
+    chrono::steady_clock::time_point started;   // When it was last handed out with no copy running
+};
+
+struct FarmWorker {
+    int fd;
+    int band;                                   // Band being rendered, -1 when idle
+};
+
+/**
+ * Start a local worker running program --farm-worker address. Its messages
+ * go to stderr, so an image written to stdout stays intact.
+ */
+static pid_t startWorker(const char *program, const char *address, int threads) {
+    char executable[4096];
+    ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+    string path = program;
+    if (length > 0) {
+        path.assign(executable, (size_t) length);
+    }
+
+    vector<string> args = {path, "--threads", to_string(threads), "--tile-size", to_string(g_tileSize), "--simd",
+                           g_simdISA, "--pixel-order", pixelOrderName(g_pixelOrder)};
+    if (g_wavefront) {
+        args.push_back("--wavefront");
+    }
+    args.push_back("--farm-worker");
+    args.push_back(address);
+    vector<char *> argv;
+    for (string &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(NULL);
+
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(2, 1);
+        execv(path.c_str(), argv.data());
+        _exit(127);
+    }
+    if (pid < 0) {
+        cout << "Could not start a farm worker: " << strerror(errno) << endl;
+    }
+    return pid;
+}
+
+/**
+ * Greet a new worker, learning its thread count, and send it the job.
+ * Returns false if it does not speak the protocol or the transfer fails.
+ */
+static bool startJob(int fd, const MappedFile &scene, int &threads) {
+    setTimeout(fd, SO_RCVTIMEO, FARM_IO_TIMEOUT);
+    setTimeout(fd, SO_SNDTIMEO, FARM_IO_TIMEOUT);
+    disableNagle(fd);
+
+    FarmHello hello;
+    if (!receiveAll(fd, &hello, sizeof(hello)) || memcmp(hello.magic, FARM_HELLO_MAGIC, 8) != 0 ||
+        hello.version != RENDER_FARM_VERSION) {
+        return false;
+    }
+    threads = hello.threads;
+
+    FarmJob job;
+    memset(&job, 0, sizeof(job));
+    memcpy(job.magic, FARM_JOB_MAGIC, 8);
+    job.version = RENDER_FARM_VERSION;
+    job.framebufferFormat = g_framebufferFormat;
+    job.aaDepth = g_aaDepth;
+    job.aaThreshold = g_aaThreshold;
+    job.sceneSize = scene.size;
+    return sendAll(fd, &job, sizeof(job)) && sendAll(fd, scene.data, scene.size);
+}
+
+/**
+ * The next band for an idle worker: the front of the queue, or else a
+ * second copy of the band that has been running longest on one worker.
+ * Returns -1 if there is nothing to hand out.
+ */
+static int nextBand(deque<int> &queue, const vector<FarmBand> &bands, bool &backup) {
+    backup = false;
+    if (!queue.empty()) {
+        int band = queue.front();
+        queue.pop_front();
+        return band;
+    }
+    int oldest = -1;
+    for (size_t b = 0; b < bands.size(); b++) {
+        if (!bands[b].done && bands[b].running == 1 && (oldest < 0 || bands[b].started < bands[oldest].started)) {
+            oldest = (int) b;
+        }
+    }
+    backup = oldest >= 0;
+    return oldest;
+}
+
+/**
+ * Read a finished band from a worker into g_framebuffer. A band another
+ * worker already delivered is read and dropped.
+ */
+static bool receiveBand(FarmWorker &worker, vector<FarmBand> &bands, int &finished) {
+    FarmBand &band = bands[worker.band];
+    size_t size = g_framebuffer.rowBytes() * (band.y1 - band.y0);
+    FarmResult result;
+    if (!receiveAll(worker.fd, &result, sizeof(result)) || result.id != worker.band || result.y0 != band.y0 ||
+        result.y1 != band.y1 || result.size != size) {
+        return false;
+    }
+
+    if (band.done) {
+        vector<unsigned char> late(size);
+        if (!receiveAll(worker.fd, late.data(), size)) {
+            return false;
+        }
+    } else {
+        // A partly received band is simply rendered again
+        if (!receiveAll(worker.fd, g_framebuffer.row(g_height - band.y1), size)) {
+            return false;
+        }
+        band.done = true;
+        finished++;
+    }
+    band.running--;
+    worker.band = -1;
+    return true;
+}
+
+bool renderFarm(const char *address, const char *sceneFile, int localWorkers, const char *program) {
+    MappedFile scene;
+    if (!mapFile(sceneFile, scene)) {
+        cout << "Could not open file " << sceneFile << endl;
+        return false;
+    }
+    int listener = listenOnAddress(address);
+    if (listener < 0) {
+        unmapFile(scene);
+        return false;
+    }
+    // Workers that die are noticed by their closed socket, not a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    g_framebuffer.reset(g_framebufferFormat, g_width, g_height);
+    int bandHeight = max(g_bandHeight, 1);
+    vector<FarmBand> bands;
+    deque<int> queue;
+    for (int y1 = g_height; y1 > 0; y1 -= bandHeight) {
+        FarmBand band;
+        band.y0 = max(y1 - bandHeight, 0);
+        band.y1 = y1;
+        band.done = false;
+        band.running = 0;
+        queue.push_back((int) bands.size());
+        bands.push_back(band);
+    }
+
+    cout << "Render farm on " << address << ": " << bands.size() << " bands of " << bandHeight << " rows, "
+         << localWorkers << " local workers" << endl;
+    vector<pid_t> children;
+    int threads = max(renderThreadCount() / max(localWorkers, 1), 1);
+    for (int i = 0; i < localWorkers; i++) {
+        pid_t pid = startWorker(program, address, threads);
+        if (pid > 0) {
+            children.push_back(pid);
+        }
+    }
+
+    PhaseTimer timer(PHASE_RENDER);
+    vector<FarmWorker> workers;
+    vector<struct pollfd> fds;
+    int finished = 0;
+    int joined = 0;
+    int joinedThreads = 0;
+    int lost = 0;
+    int reissued = 0;
+    int backups = 0;
+    bool ok = true;
+    while (finished < (int) bands.size()) {
+        for (size_t i = 0; i < children.size();) {
+            if (waitpid(children[i], NULL, WNOHANG) != 0) {
+                children.erase(children.begin() + i);
+            } else {
+                i++;
+            }
+        }
+        if (localWorkers > 0 && children.empty() && workers.empty()) {
+            cout << "Every farm worker failed with " << bands.size() - finished << " bands left" << endl;
+            ok = false;
+            break;
+        }
+
+        fds.clear();
+        struct pollfd entry;
+        entry.events = POLLIN;
+        entry.revents = 0;
+        entry.fd = listener;
+        fds.push_back(entry);
+        for (const FarmWorker &worker : workers) {
+            entry.fd = worker.fd;
+            fds.push_back(entry);
+        }
+        // Wake up now and then to notice local workers that exit before connecting
+        if (poll(fds.data(), (nfds_t) fds.size(), 1000) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cout << "poll failed: " << strerror(errno) << endl;
+            ok = false;
+            break;
+        }
+
+        // Results, or hang-ups: an idle worker has nothing to say
+        size_t kept = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            FarmWorker &worker = workers[i];
+            if (fds[i + 1].revents != 0 && (worker.band < 0 || !receiveBand(worker, bands, finished))) {
+                close(worker.fd);
+                lost++;
+                if (worker.band >= 0) {
+                    FarmBand &band = bands[worker.band];
+                    band.running--;
+                    if (!band.done && band.running == 0) {
+                        cout << "Lost a farm worker; rows " << band.y0 << "-" << band.y1 << " go back on the queue"
+                             << endl;
+                        queue.push_front(worker.band);
+                        reissued++;
+                    }
+                }
+                continue;
+            }
+            workers[kept++] = worker;
+        }
+        workers.resize(kept);
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            int workerThreads = 0;
+            if (fd >= 0 && startJob(fd, scene, workerThreads)) {
+                FarmWorker worker;
+                worker.fd = fd;
+                worker.band = -1;
+                workers.push_back(worker);
+                joined++;
+                joinedThreads += workerThreads;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        for (FarmWorker &worker : workers) {
+            bool backup;
+            int b = worker.band < 0 && finished < (int) bands.size() ? nextBand(queue, bands, backup) : -1;
+            if (b < 0) {
+                continue;
+            }
+            FarmRegion region;
+            region.id = b;
+            region.y0 = bands[b].y0;
+            region.y1 = bands[b].y1;
+            region.reserved = 0;
+            if (bands[b].running == 0) {
+                bands[b].started = chrono::steady_clock::now();
+            }
+            bands[b].running++;
+            backups += backup ? 1 : 0;
+            worker.band = b;
+            // A failed send shows up as a hang-up on the next poll
+            sendAll(worker.fd, &region, sizeof(region));
+        }
+    }
+
+    // Tell idle workers the frame is done; busy ones find out when their answer bounces
+    FarmRegion done;
+    memset(&done, 0, sizeof(done));
+    done.id = -1;
+    for (const FarmWorker &worker : workers) {
+        if (worker.band < 0) {
+            sendAll(worker.fd, &done, sizeof(done));
+        }
+        close(worker.fd);
+    }
+    close(listener);
+    string host, port;
+    if (!splitTCPAddress(address, host, port)) {
+        unlink(address);
+    }
+    unmapFile(scene);
+
+    // Give local workers a moment to exit, then stop stragglers
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() + chrono::seconds(1);
+    for (pid_t pid : children) {
+        while (waitpid(pid, NULL, WNOHANG) == 0) {
+            if (chrono::steady_clock::now() >= deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+
+    if (ok) {
+        cout << "Render farm: " << bands.size() << " bands from " << joined << " workers (" << joinedThreads
+             << " threads), " << lost << " lost, " << reissued << " bands issued again, " << backups
+             << " backup copies" << endl;
+    }
+    return ok;
+}
+
+
+// -------------------------------------------------------------------
+// Worker
+
+bool runFarmWorker(const char *address) {
+    signal(SIGPIPE, SIG_IGN);
+    int fd = connectToAddress(address);
+    if (fd < 0) {
+        cout << "Could not connect to the render farm at " << address << endl;
+        return false;
+    }
+    // Waiting for the next band can take as long as the frame, so only sends time out
+    setTimeout(fd, SO_SNDTIMEO, FARM_IO_TIMEOUT);
+    disableNagle(fd);
+
+    FarmHello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, FARM_HELLO_MAGIC, 8);
+    hello.version = RENDER_FARM_VERSION;
+    hello.threads = renderThreadCount();
+    FarmJob job;
+    if (!sendAll(fd, &hello, sizeof(hello)) || !receiveAll(fd, &job, sizeof(job)) ||
+        memcmp(job.magic, FARM_JOB_MAGIC, 8) != 0 || job.version != RENDER_FARM_VERSION ||
+        job.framebufferFormat < 0 || job.framebufferFormat >= FRAMEBUFFER_FORMAT_COUNT ||
+        job.sceneSize > MAX_SCENE_BYTES) {
+        cout << "The render farm at " << address << " did not send a usable job" << endl;
+        close(fd);
+        return false;
+    }
+
+    char *data = new char[job.sceneSize];
+    MappedFile scene = {data, (size_t) job.sceneSize, false};
+    if (!receiveAll(fd, data, scene.size)) {
+        unmapFile(scene);
+        cout << "The render farm at " << address << " hung up while sending the scene" << endl;
+        close(fd);
+        return false;
+    }
+    if (!loadSceneBuffer("farm scene", scene) || g_width <= 0 || g_height <= 0) {
+        cout << "The render farm sent an unusable scene" << endl;
+        close(fd);
+        return false;
+    }
+    g_framebufferFormat = (FramebufferFormat) job.framebufferFormat;
+    g_aaDepth = job.aaDepth;
+    g_aaThreshold = job.aaThreshold;
+    prepareScene();
+
+    Framebuffer band;
+    int rendered = 0;
+    FarmRegion region;
+    while (receiveAll(fd, &region, sizeof(region)) && region.id >= 0) {
+        if (region.y0 < 0 || region.y1 > g_height || region.y0 >= region.y1) {
+            cout << "The render farm asked for rows " << region.y0 << "-" << region.y1 << endl;
+            break;
+        }
+        if (band.height() < region.y1 - region.y0) {
+            band.reset(g_framebufferFormat, g_width, region.y1 - region.y0);
+        }
+        renderBand(region.y0, region.y1, band);
+
+        FarmResult result;
+        result.id = region.id;
+        result.y0 = region.y0;
+        result.y1 = region.y1;
+        result.reserved = 0;
+        result.size = band.rowBytes() * (region.y1 - region.y0);
+        if (!sendAll(fd, &result, sizeof(result)) || !sendAll(fd, band.data(), (size_t) result.size)) {
+            break;
+        }
+        rendered++;
+    }
+    close(fd);
+    cout << "Farm worker rendered " << rendered << " bands" << endl;
+    return true;
+}
+
+#else
+
+bool renderFarm(const char *, const char *, int, const char *) {
+    cout << "The render farm needs POSIX sockets and processes" << endl;
+    return false;
+}
+
+bool runFarmWorker(const char *) {
+    cout << "The render farm needs POSIX sockets and processes" << endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,77 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- render_farm.h ---
+//
+//  Rendering one frame on several worker processes. A coordinator listens
+//  on a UNIX domain socket or a TCP host:port, starts local workers and
+//  accepts any others that connect, sends each the scene and then hands
+//  out bands of rows one at a time. Finished bands are copied into
+//  g_framebuffer, so the image is the same as a render in one process.
+//
+//  A band whose worker fails goes back on the queue. Once the queue is
+//  empty, idle workers get a second copy of bands still being rendered
+//  and the first result wins, so one slow worker cannot hold up the frame.
+//
+//  Messages, all in native byte order:
+//
+//    worker -> coordinator   FarmHello
+//    coordinator -> worker   FarmJob and the scene file
+//    coordinator -> worker   FarmRegion, a band to render (id -1: done)
+//    worker -> coordinator   FarmResult and the band's framebuffer rows
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RENDER_FARM_H__
+#define __RENDER_FARM_H__
+
+#define FARM_HELLO_MAGIC "RTFARMW"
+#define FARM_JOB_MAGIC "RTFARMJ"
+#define RENDER_FARM_VERSION 1
+#define FARM_IO_TIMEOUT 30              // Seconds a transfer may take before its worker is given up
+#define FARM_CONNECT_SECONDS 10         // How long a worker keeps trying to reach the coordinator
+
+struct FarmHello {
+    char magic[8];
+    unsigned int version;
+    int threads;                        // Render threads of the worker, for the summary
+};
+
+struct FarmJob {
+    char magic[8];
+    unsigned int version;
+    int framebufferFormat;              // FramebufferFormat the rows come back in
+    int aaDepth;
+    float aaThreshold;
+    unsigned long long sceneSize;       // Bytes of scene file that follow
+};
+
+struct FarmRegion {
+    int id;
+    int y0;                             // Rows [y0, y1), counted from the bottom like getDir()
+    int y1;
+    int reserved;
+};
+
+struct FarmResult {
+    int id;
+    int y0;
+    int y1;
+    int reserved;
+    unsigned long long size;            // Bytes of rows that follow, top row first
+};
+
+/**
+ * Render the loaded scene into g_framebuffer on farm workers. sceneFile is
+ * sent to the workers as it is; localWorkers worker processes are started
+ * from program, each with an equal share of the render threads. Returns
+ * false, saying why, if the address cannot be used or every local worker
+ * failed with bands left.
+ */
+bool renderFarm(const char *address, const char *sceneFile, int localWorkers, const char *program);
+
+/**
+ * Connect to the coordinator at address and render bands until it is done.
+ */
+bool runFarmWorker(const char *address);
+
+#endif // __RENDER_FARM_H__
@@ -0,0 +1,544 @@
+#include "render_service.h"
+#include "raytrace.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+
+// -------------------------------------------------------------------
+// Socket I/O
+
+bool sendAll(int fd, const void *data, size_t size) {
+    const char *p = (const char *) data;
+    while (size > 0) {
+        ssize_t sent = send(fd, p, size, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        p += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+bool receiveAll(int fd, void *data, size_t size) {
+    char *p = (char *) data;
+    while (size > 0) {
+        ssize_t received = recv(fd, p, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        p += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+
+// -------------------------------------------------------------------
+// Jobs
+
+struct ServiceJob {
+    int fd;
+    int priority;
+    unsigned long long arrival;     // Keeps equal priorities first come, first served
+    chrono::steady_clock::time_point arrived;
+    unsigned int timeoutMs;
+    MappedFile scene;               // Heap copy of the scene file
+    atomic<bool> cancelled;
+    bool done;                      // Answered, or given up; guarded by s_lock
+};
+
+struct JobOrder {
+    bool operator()(const shared_ptr<ServiceJob> &a, const shared_ptr<ServiceJob> &b) const {
+        if (a->priority != b->priority) {
+            return a->priority < b->priority;
+        }
+        return a->arrival > b->arrival;
+    }
+};
+
+static mutex s_lock;
+static condition_variable s_jobReady;
+static priority_queue<shared_ptr<ServiceJob>, vector<shared_ptr<ServiceJob> >, JobOrder> s_queue;
+static bool s_shuttingDown = false;
+static long long s_answered[RENDER_BAD_SCENE + 1];
+static long long s_cancelledJobs = 0;
+
+// Written to by the render thread and the signal handler to wake the poll loop
+static int s_wakePipe[2] = {-1, -1};
+static volatile sig_atomic_t s_stopRequested = 0;
+
+static void requestStop(int) {
+    s_stopRequested = 1;
+    char c = 0;
+    ssize_t ignored = write(s_wakePipe[1], &c, 1);
+    (void) ignored;
+}
+
+static void wakePollLoop() {
+    char c = 0;
+    ssize_t ignored = write(s_wakePipe[1], &c, 1);
+    (void) ignored;
+}
+
+static double millisecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static bool answer(int fd, RenderStatus status, float queueMs, float renderMs, const vector<unsigned char> &image) {
+    RenderResponseHeader response;
+    memset(&response, 0, sizeof(response));
+    memcpy(response.magic, RENDER_RESPONSE_MAGIC, sizeof(RENDER_RESPONSE_MAGIC));
+    response.version = RENDER_SERVICE_VERSION;
+    response.status = status;
+    response.queueMs = queueMs;
+    response.renderMs = renderMs;
+    response.imageSize = image.size();
+    {
+        lock_guard<mutex> guard(s_lock);
+        s_answered[status]++;
+    }
+    return sendAll(fd, &response, sizeof(response)) && (image.empty() || sendAll(fd, image.data(), image.size()));
+}
+
+/**
+ * Load, render and encode one job and send the answer. Cancelled jobs get
+ * no answer: nobody is listening.
+ */
+static void runJob(ServiceJob &job) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    float queueMs = (float) chrono::duration<double, milli>(start - job.arrived).count();
+    double budgetSeconds = 0;
+    if (job.timeoutMs > 0) {
+        budgetSeconds = job.timeoutMs / 1e3 - queueMs / 1e3;
+    }
+
+    vector<unsigned char> image;
+    RenderStatus status = RENDER_OK;
+    if (job.cancelled) {
+        unmapFile(job.scene);
+    } else if (job.timeoutMs > 0 && budgetSeconds <= 0) {
+        unmapFile(job.scene);
+        status = RENDER_TIMEOUT;
+    } else if (!loadSceneBuffer("request", job.scene)) {
+        status = RENDER_BAD_SCENE;
+    } else if (g_width <= 0 || g_height <= 0 || (long long) g_width * g_height > MAX_IMAGE_PIXELS) {
+        cout << "Scene has an unusable resolution of " << g_width << " x " << g_height << endl;
+        status = RENDER_BAD_SCENE;
+    } else {
+        prepareScene();
+        if (renderWithin(budgetSeconds, &job.cancelled)) {
+            encodePPM(image);
+        } else if (!job.cancelled) {
+            status = RENDER_TIMEOUT;
+        }
+    }
+
+    if (job.cancelled) {
+        lock_guard<mutex> guard(s_lock);
+        s_cancelledJobs++;
+        return;
+    }
+    answer(job.fd, status, queueMs, (float) millisecondsSince(start), image);
+}
+
+/**
+ * Render queued jobs, highest priority first, until the service shuts down.
+ */
+static void renderJobs() {
+    while (true) {
+        shared_ptr<ServiceJob> job;
+        {
+            unique_lock<mutex> guard(s_lock);
+            s_jobReady.wait(guard, [] { return s_shuttingDown || !s_queue.empty(); });
+            if (s_shuttingDown) {
+                return;
+            }
+            job = s_queue.top();
+            s_queue.pop();
+        }
+
+        runJob(*job);
+        {
+            lock_guard<mutex> guard(s_lock);
+            job->done = true;
+        }
+        wakePollLoop();
+    }
+}
+
+
+// -------------------------------------------------------------------
+// Connections
+
+/**
+ * A connection whose request is still arriving. It is read a piece at a time
+ * as the poll loop finds data on it, so a slow client holds up nobody else.
+ */
+struct PendingRequest {
+    int fd;
+    unsigned long long arrival;
+    chrono::steady_clock::time_point arrived;
+    RenderRequestHeader request;
+    size_t headerReceived;
+    MappedFile scene;               // Heap copy of the scene file, once the header is in
+    size_t sceneReceived;
+    bool busy;                      // No room: the scene is read and dropped, then RENDER_BUSY answered
+};
+
+/**
+ * Put a connection back into blocking mode, giving the client
+ * RENDER_SERVICE_IO_TIMEOUT seconds for every transfer of the answer.
+ */
+static void blockWithTimeout(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    struct timeval timeout;
+    timeout.tv_sec = RENDER_SERVICE_IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static void refuseRequest(PendingRequest &pending, RenderStatus status) {
+    vector<unsigned char> noImage;
+    unmapFile(pending.scene);
+    blockWithTimeout(pending.fd);
+    answer(pending.fd, status, 0, 0, noImage);
+}
+
+/**
+ * Read whatever has arrived of a request without waiting for more. Returns
+ * false, after answering, if it is malformed or the client stopped sending;
+ * sets done once the whole request is in. A request whose header arrives
+ * while full is read to the end but gets no scene buffer.
+ */
+static bool continueRequest(PendingRequest &pending, bool full, bool &done) {
+    done = false;
+    if (pending.headerReceived < sizeof(RenderRequestHeader)) {
+        ssize_t received = recv(pending.fd, (char *) &pending.request + pending.headerReceived,
+                                sizeof(RenderRequestHeader) - pending.headerReceived, 0);
+        if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received <= 0) {
+            refuseRequest(pending, RENDER_BAD_REQUEST);
+            return false;
+        }
+        pending.headerReceived += (size_t) received;
+        if (pending.headerReceived < sizeof(RenderRequestHeader)) {
+            return true;
+        }
+
+        const RenderRequestHeader &request = pending.request;
+        if (memcmp(request.magic, RENDER_REQUEST_MAGIC, sizeof(RENDER_REQUEST_MAGIC)) != 0 ||
+            request.version != RENDER_SERVICE_VERSION || request.sceneSize > MAX_SCENE_BYTES) {
+            refuseRequest(pending, RENDER_BAD_REQUEST);
+            return false;
+        }
+        // Read the scene even when full, so the client is not cut off mid-send
+        pending.busy = full;
+        if (!full && request.sceneSize > 0) {
+            char *data = new (nothrow) char[request.sceneSize];
+            if (data == NULL) {
+                refuseRequest(pending, RENDER_BUSY);
+                return false;
+            }
+            pending.scene.data = data;
+            pending.scene.size = (size_t) request.sceneSize;
+        }
+    } else {
+        size_t remaining = (size_t) pending.request.sceneSize - pending.sceneReceived;
+        char discard[65536];
+        char *target = pending.busy ? discard : (char *) pending.scene.data + pending.sceneReceived;
+        ssize_t received = recv(pending.fd, target, pending.busy ? min(remaining, sizeof(discard)) : remaining, 0);
+        if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (received <= 0) {
+            refuseRequest(pending, RENDER_BAD_REQUEST);
+            return false;
+        }
+        pending.sceneReceived += (size_t) received;
+    }
+
+    if (pending.sceneReceived < pending.request.sceneSize) {
+        return true;
+    }
+    if (pending.busy) {
+        refuseRequest(pending, RENDER_BUSY);
+        return false;
+    }
+    blockWithTimeout(pending.fd);
+    done = true;
+    return true;
+}
+
+static shared_ptr<ServiceJob> makeJob(const PendingRequest &pending) {
+    shared_ptr<ServiceJob> job = make_shared<ServiceJob>();
+    job->fd = pending.fd;
+    job->priority = pending.request.priority;
+    job->arrival = pending.arrival;
+    job->arrived = pending.arrived;
+    job->timeoutMs = pending.request.timeoutMs;
+    job->scene = pending.scene;
+    job->cancelled = false;
+    job->done = false;
+    return job;
+}
+
+int listenOnSocket(const char *socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        cout << "Socket path " << socketPath << " is too long" << endl;
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        cout << "Could not create a socket: " << strerror(errno) << endl;
+        return -1;
+    }
+    // Replace a socket left behind by a service that is gone, but not a live one
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+        cout << "Another service is listening on " << socketPath << endl;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(socketPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        cout << "Could not listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+bool serveRenders(const char *socketPath, int maxJobs) {
+    int listener = listenOnSocket(socketPath);
+    if (listener < 0) {
+        return false;
+    }
+    if (pipe(s_wakePipe) != 0) {
+        cout << "Could not create a pipe: " << strerror(errno) << endl;
+        return false;
+    }
+    fcntl(s_wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(s_wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    // Clients that hang up are noticed by their closed socket, not a signal
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+
+    cout << "Serving renders on " << socketPath << " with " << renderThreadCount() << " threads, up to "
+         << maxJobs << " jobs" << endl;
+    thread renderer(renderJobs);
+
+    // Jobs that are queued or rendering, or answered but not yet closed
+    vector<shared_ptr<ServiceJob> > jobs;
+    vector<ServiceJob *> watched;
+    // Connections whose request is still arriving
+    vector<PendingRequest> pending;
+    vector<struct pollfd> fds;
+    unsigned long long arrivals = 0;
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+    while (!s_stopRequested) {
+        // Watch the listener, the wake pipe, every request still arriving, and every waiting client for a hang-up
+        fds.clear();
+        watched.clear();
+        struct pollfd entry;
+        entry.events = POLLIN;
+        entry.revents = 0;
+        entry.fd = listener;
+        fds.push_back(entry);
+        entry.fd = s_wakePipe[0];
+        fds.push_back(entry);
+        for (const PendingRequest &request : pending) {
+            entry.fd = request.fd;
+            fds.push_back(entry);
+        }
+        for (const shared_ptr<ServiceJob> &job : jobs) {
+            if (!job->cancelled) {
+                entry.fd = job->fd;
+                fds.push_back(entry);
+                watched.push_back(job.get());
+            }
+        }
+
+        // Wake up in time to drop the first request that takes too long to arrive
+        int waitMs = -1;
+        for (const PendingRequest &request : pending) {
+            double left = RENDER_SERVICE_IO_TIMEOUT * 1e3 - millisecondsSince(request.arrived);
+            int ms = left <= 0 ? 0 : (int) left + 1;
+            waitMs = waitMs < 0 ? ms : min(waitMs, ms);
+        }
+
+        if (poll(fds.data(), (nfds_t) fds.size(), waitMs) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cout << "poll failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        if (fds[1].revents != 0) {
+            char drain[64];
+            while (read(s_wakePipe[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        for (size_t i = 0; i < watched.size(); i++) {
+            if (fds[i + 2 + pending.size()].revents != 0) {
+                watched[i]->cancelled = true;
+            }
+        }
+        {
+            lock_guard<mutex> guard(s_lock);
+            size_t kept = 0;
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (jobs[i]->done) {
+                    close(jobs[i]->fd);
+                } else {
+                    jobs[kept++] = jobs[i];
+                }
+            }
+            jobs.resize(kept);
+        }
+
+        // Scene buffers held by jobs and by requests still arriving count towards maxJobs
+        int reserved = (int) jobs.size();
+        for (const PendingRequest &request : pending) {
+            reserved += request.scene.data != NULL;
+        }
+        size_t kept = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            PendingRequest &request = pending[i];
+            bool done = false;
+            bool alive = true;
+            if (fds[i + 2].revents != 0) {
+                bool hadScene = request.scene.data != NULL;
+                alive = continueRequest(request, reserved >= maxJobs, done);
+                if (alive && !hadScene && (request.scene.data != NULL || done)) {
+                    reserved++;     // It holds a scene buffer now, or becomes a job without one
+                }
+            }
+            if (alive && !done && millisecondsSince(request.arrived) >= RENDER_SERVICE_IO_TIMEOUT * 1e3) {
+                refuseRequest(request, RENDER_BAD_REQUEST);
+                alive = false;
+            }
+            if (!alive) {
+                close(request.fd);
+            } else if (done) {
+                shared_ptr<ServiceJob> job = makeJob(request);
+                jobs.push_back(job);
+                lock_guard<mutex> guard(s_lock);
+                s_queue.push(job);
+                s_jobReady.notify_one();
+            } else {
+                pending[kept++] = request;
+            }
+        }
+        pending.resize(kept);
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listener, NULL, NULL)) >= 0) {
+                PendingRequest request;
+                request.fd = fd;
+                request.arrival = arrivals++;
+                request.arrived = chrono::steady_clock::now();
+                request.headerReceived = 0;
+                request.scene.data = NULL;
+                request.scene.size = 0;
+                request.scene.mapped = false;
+                request.sceneReceived = 0;
+                request.busy = false;
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                pending.push_back(request);
+            }
+        }
+    }
+
+    // Stop the render at the next tile and leave the rest unanswered
+    {
+        lock_guard<mutex> guard(s_lock);
+        s_shuttingDown = true;
+        for (const shared_ptr<ServiceJob> &job : jobs) {
+            job->cancelled = true;
+        }
+    }
+    s_jobReady.notify_one();
+    renderer.join();
+    for (const shared_ptr<ServiceJob> &job : jobs) {
+        close(job->fd);
+    }
+    for (PendingRequest &request : pending) {
+        unmapFile(request.scene);
+        close(request.fd);
+    }
+    close(listener);
+    unlink(socketPath);
+
+    cout << "Answered " << s_answered[RENDER_OK] << " renders, " << s_answered[RENDER_BUSY] << " busy, "
+         << s_answered[RENDER_TIMEOUT] << " timed out, "
+         << s_answered[RENDER_BAD_REQUEST] + s_answered[RENDER_BAD_SCENE] << " bad; " << s_cancelledJobs
+         << " cancelled" << endl;
+    return true;
+}
+
+#else
+
+bool sendAll(int, const void *, size_t) {
+    return false;
+}
+
+bool receiveAll(int, void *, size_t) {
+    return false;
+}
+
+int listenOnSocket(const char *) {
+    cout << "UNIX domain sockets are not supported on this platform" << endl;
+    return -1;
+}
+
+bool serveRenders(const char *, int) {
+    cout << "The render service needs UNIX domain sockets" << endl;
+    return false;
+}
+
+#endif
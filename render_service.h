@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- render_service.h ---
+//
+//  Resident render service on a local UNIX domain socket. Clients send a
+//  scene and get the rendered image back, without paying for process
+//  startup, thread creation or the SIMD kernel selection on every render.
+//
+//  One request per connection: the client sends a RenderRequestHeader and
+//  the scene file (text or binary) and the service answers with a
+//  RenderResponseHeader and the image as a PPM file. A client that sends
+//  anything more or hangs up before the answer cancels its job.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RENDER_SERVICE_H__
+#define __RENDER_SERVICE_H__
+
+#include <cstddef>
+
+#define RENDER_REQUEST_MAGIC "RTRQST"
+#define RENDER_RESPONSE_MAGIC "RTRESP"
+#define RENDER_SERVICE_VERSION 1
+#define DEFAULT_MAX_JOBS 64
+#define MAX_SCENE_BYTES (1ull << 30)
+#define MAX_IMAGE_PIXELS (1ll << 26)
+#define RENDER_SERVICE_IO_TIMEOUT 10    // Seconds to send a whole request, or each part of the answer
+
+enum RenderStatus {
+    RENDER_OK,
+    RENDER_BUSY,            // Too many jobs already; try again later
+    RENDER_TIMEOUT,         // The job's timeout passed before the image was done
+    RENDER_BAD_REQUEST,     // Malformed header or truncated scene
+    RENDER_BAD_SCENE        // Malformed binary scene or unusable resolution
+};
+
+struct RenderRequestHeader {
+    char magic[8];
+    unsigned int version;
+    int priority;                   // Higher priorities are rendered first, equal ones in order of arrival
+    unsigned int timeoutMs;         // Counted from arrival, queueing included; 0 means no limit
+    unsigned int reserved;
+    unsigned long long sceneSize;   // Bytes of scene file that follow
+};
+
+struct RenderResponseHeader {
+    char magic[8];
+    unsigned int version;
+    int status;                     // RenderStatus
+    float queueMs;                  // Time from arrival until rendering started
+    float renderMs;                 // Time spent loading, rendering and encoding
+    unsigned long long imageSize;   // Bytes of PPM file that follow
+};
+
+/**
+ * Write or read exactly size bytes, retrying short transfers. Return false
+ * on an error, a timeout or end of file.
+ */
+bool sendAll(int fd, const void *data, size_t size);
+
+bool receiveAll(int fd, void *data, size_t size);
+
+/**
+ * Listen on a UNIX domain socket at socketPath, replacing a stale socket
+ * file but not a live one. Returns the listening descriptor, or -1 after
+ * saying why.
+ */
+int listenOnSocket(const char *socketPath);
+
+/**
+ * Listen on socketPath and render requests until SIGINT or SIGTERM, one job
+ * at a time on all render threads. At most maxJobs jobs are queued or
+ * rendering; further requests are answered with RENDER_BUSY at once.
+ * Requests are read from all clients side by side as their data arrives,
+ * so a slow client only delays its own job. Returns false if the socket
+ * cannot be set up.
+ */
+bool serveRenders(const char *socketPath, int maxJobs);
+
+#endif // __RENDER_SERVICE_H__
@@ -0,0 +1,121 @@
+#include "render_stats.h"
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+static double s_phaseSeconds[PHASE_COUNT];
+
+static const char *s_phaseNames[PHASE_COUNT] = {"parse", "setup", "render", "encode", "write"};
+
+
+// -------------------------------------------------------------------
+// Per-thread counters
+
+#ifdef RT_STATS
+
+static void addCounters(RenderCounters &total, const RenderCounters &counters) {
+    total.primaryRays += counters.primaryRays;
+    total.shadowRays += counters.shadowRays;
+    total.reflectionRays += counters.reflectionRays;
+    total.sphereTests += counters.sphereTests;
+    total.hits += counters.hits;
+    total.reflectionLimitRays += counters.reflectionLimitRays;
+    total.occludedLightSamples += counters.occludedLightSamples;
+}
+
+struct CounterRegistry {
+    mutex lock;
+    vector<ThreadCounters *> live;
+    RenderCounters retired;
+};
+
+/**
+ * Never destroyed: render threads may exit while static objects are being
+ * destroyed, and they still retire their counters here.
+ */
+static CounterRegistry &counterRegistry() {
+    static CounterRegistry *registry = new CounterRegistry();
+    return *registry;
+}
+
+ThreadCounters::ThreadCounters() : RenderCounters() {
+    CounterRegistry &registry = counterRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    registry.live.push_back(this);
+}
+
+ThreadCounters::~ThreadCounters() {
+    CounterRegistry &registry = counterRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    addCounters(registry.retired, *this);
+    for (size_t i = 0; i < registry.live.size(); i++) {
+        if (registry.live[i] == this) {
+            registry.live[i] = registry.live.back();
+            registry.live.pop_back();
+            break;
+        }
+    }
+}
+
+thread_local ThreadCounters g_threadCounters;
+
+RenderCounters renderCounters() {
+    CounterRegistry &registry = counterRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    // Render threads are parked between renders, so their counts are settled
+    RenderCounters total = registry.retired;
+    for (const ThreadCounters *counters : registry.live) {
+        addCounters(total, *counters);
+    }
+    return total;
+}
+
+#else
+
+RenderCounters renderCounters() {
+    return RenderCounters();
+}
+
+#endif
+
+
+// -------------------------------------------------------------------
+// Phase times and the report
+
+PhaseTimer::PhaseTimer(RenderPhase phase) : _phase(phase), _start(chrono::steady_clock::now()) {
+}
+
+PhaseTimer::~PhaseTimer() {
+    addPhaseTime(_phase, chrono::duration<double>(chrono::steady_clock::now() - _start).count());
+}
+
+void addPhaseTime(RenderPhase phase, double seconds) {
+    s_phaseSeconds[phase] += seconds;
+}
+
+void writeRenderStatsJSON(ostream &out, double totalSeconds) {
+    RenderCounters counters = renderCounters();
+    out << fixed << setprecision(6);
+    out << "{\n  \"total_seconds\": " << totalSeconds << ",\n  \"phase_seconds\": {";
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        out << (p > 0 ? ", " : "") << "\"" << s_phaseNames[p] << "\": " << s_phaseSeconds[p];
+    }
+    out << "},\n";
+    out << defaultfloat;
+#ifdef RT_STATS
+    out << "  \"counters_enabled\": true,\n";
+#else
+    out << "  \"counters_enabled\": false,\n";
+#endif
+    out << "  \"counters\": {\n"
+        << "    \"primary_rays\": " << counters.primaryRays << ",\n"
+        << "    \"shadow_rays\": " << counters.shadowRays << ",\n"
+        << "    \"reflection_rays\": " << counters.reflectionRays << ",\n"
+        << "    \"sphere_tests\": " << counters.sphereTests << ",\n"
+        << "    \"hits\": " << counters.hits << ",\n"
+        << "    \"max_reflection_terminations\": " << counters.reflectionLimitRays << ",\n"
+        << "    \"occluded_light_samples\": " << counters.occludedLightSamples << "\n"
+        << "  }\n}" << endl;
+}
@@ -0,0 +1,119 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- render_stats.h ---
+//
+//  Where a render spends its time: wall time per phase, and, in builds
+//  configured with RT_STATS, counts of the rays and sphere tests behind it.
+//  Every thread counts into its own RenderCounters; the totals are only
+//  summed when the report is written, so the hot path has no atomics. With
+//  RT_STATS off, STATS_ADD expands to nothing and its arguments are never
+//  evaluated.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RENDER_STATS_H__
+#define __RENDER_STATS_H__
+
+#include <chrono>
+#include <ostream>
+
+#if defined(RT_X86_SIMD) && !defined(_MSC_VER)
+#include <x86intrin.h>
+#elif defined(RT_X86_SIMD)
+#include <intrin.h>
+#endif
+
+enum RenderPhase {
+    PHASE_PARSE,        // Reading scene files
+    PHASE_SETUP,        // Compiling the scene and building the accelerators
+    PHASE_RENDER,
+    PHASE_ENCODE,       // Converting colors to the output format
+    PHASE_WRITE,        // Writing the image out
+    PHASE_COUNT
+};
+
+struct RenderCounters {
+    long long primaryRays;
+    long long shadowRays;
+    long long reflectionRays;
+    long long sphereTests;          // Ray-sphere tests; SIMD kernels count every lane, padding included
+    long long hits;                 // Primary and reflection rays that hit a sphere
+    long long reflectionLimitRays;  // Reflection rays not traced because of MAX_REFLECTIONS
+    long long occludedLightSamples; // Shadow rays that found a blocker
+};
+
+#ifdef RT_STATS
+
+/**
+ * The counters of one thread. They register themselves on first use and
+ * add their counts to the retired totals when the thread exits.
+ */
+struct ThreadCounters : RenderCounters {
+    ThreadCounters();
+    ~ThreadCounters();
+};
+
+extern thread_local ThreadCounters g_threadCounters;
+
+#define STATS_ADD(counter, n) (g_threadCounters.counter += (n))
+
+#else
+
+#define STATS_ADD(counter, n) ((void) 0)
+
+#endif
+
+enum CostMetric {
+    COST_CYCLES,    // CPU time stamp counter ticks, or nanoseconds where there is none
+    COST_WORK       // Sphere tests plus rays; needs RT_STATS
+};
+
+/**
+ * A running count of the calling thread's work in the given metric. The
+ * work spent on a pixel is the difference of two marks around it.
+ */
+inline unsigned long long costMark(CostMetric metric) {
+#ifdef RT_STATS
+    if (metric == COST_WORK) {
+        const RenderCounters &c = g_threadCounters;
+        return (unsigned long long) (c.sphereTests + c.primaryRays + c.shadowRays + c.reflectionRays);
+    }
+#else
+    (void) metric;
+#endif
+#ifdef RT_X86_SIMD
+    return __rdtsc();
+#else
+    return (unsigned long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+/**
+ * Add the time from construction to destruction to a phase. Phases are
+ * timed on the thread that drives the render, never by the workers.
+ */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(RenderPhase phase);
+
+    ~PhaseTimer();
+
+private:
+    RenderPhase _phase;
+    std::chrono::steady_clock::time_point _start;
+};
+
+void addPhaseTime(RenderPhase phase, double seconds);
+
+/**
+ * The counts of all threads so far, zero without RT_STATS.
+ */
+RenderCounters renderCounters();
+
+/**
+ * Write the phase times and counters as a JSON object.
+ */
+void writeRenderStatsJSON(std::ostream &out, double totalSeconds);
+
+#endif // __RENDER_STATS_H__
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- scene_array.h ---
+//
+//  Containers for scene objects that either own their elements (scenes
+//  parsed from text) or view elements stored in a mapped binary scene file.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SCENE_ARRAY_H__
+#define __SCENE_ARRAY_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * Array of scene objects. Text scenes fill it with push_back(); binary
+ * scenes point it at the mapped file with view(), where the objects are
+ * stored exactly as the tracer reads them. Mapped elements are read-only.
+ */
+template<class T>
+class SceneArray {
+public:
+    SceneArray() : _data(NULL), _size(0), _mapped(false) {}
+
+    void push_back(const T &value) {
+        if (_mapped) {
+            clear();
+        }
+        _owned.push_back(value);
+        _data = _owned.data();
+        _size = _owned.size();
+    }
+
+    void reserve(size_t count) {
+        _owned.reserve(count);
+        _data = _owned.data();
+    }
+
+    void clear() {
+        _owned.clear();
+        _data = _owned.data();
+        _size = 0;
+        _mapped = false;
+    }
+
+    /**
+     * Drop any owned elements and view count elements at data instead.
+     */
+    void view(const T *data, size_t count) {
+        std::vector<T>().swap(_owned);
+        _data = data;
+        _size = count;
+        _mapped = true;
+    }
+
+    /**
+     * Copy viewed elements into owned storage so they can be changed.
+     */
+    void makeOwned() {
+        if (_mapped) {
+            _owned.assign(_data, _data + _size);
+            _data = _owned.data();
+            _mapped = false;
+        }
+    }
+
+    bool isMapped() const { return _mapped; }
+
+    size_t size() const { return _size; }
+
+    bool empty() const { return _size == 0; }
+
+    const T *data() const { return _data; }
+
+    const T *begin() const { return _data; }
+
+    const T *end() const { return _data + _size; }
+
+    const T &operator[](size_t i) const { return _data[i]; }
+
+    // Write access, for arrays that are not mapped
+    T &owned(size_t i) { return _owned[i]; }
+
+private:
+    std::vector<T> _owned;
+    const T *_data;
+    size_t _size;
+    bool _mapped;
+};
+
+/**
+ * Names of scene objects, stored back to back. Name i is
+ * text[offsets[i] .. offsets[i + 1]). Kept apart from the objects so the
+ * tracer never pulls them into cache.
+ */
+class NameTable {
+public:
+    NameTable() : _text(NULL), _offsets(NULL), _size(0), _mapped(false) {
+        _ownedOffsets.push_back(0);
+        _offsets = _ownedOffsets.data();
+    }
+
+    void push_back(const char *begin, const char *end) {
+        if (_mapped) {
+            clear();
+        }
+        _ownedText.insert(_ownedText.end(), begin, end);
+        _ownedOffsets.push_back(_ownedText.size());
+        _text = _ownedText.data();
+        _offsets = _ownedOffsets.data();
+        _size++;
+    }
+
+    void push_back(const std::string &name) {
+        push_back(name.data(), name.data() + name.size());
+    }
+
+    void reserve(size_t count) {
+        _ownedOffsets.reserve(count + 1);
+        _text = _ownedText.data();
+        _offsets = _ownedOffsets.data();
+    }
+
+    void clear() {
+        _ownedText.clear();
+        _ownedOffsets.assign(1, 0);
+        _text = _ownedText.data();
+        _offsets = _ownedOffsets.data();
+        _size = 0;
+        _mapped = false;
+    }
+
+    /**
+     * Drop any owned names and view count names stored in the given text and
+     * count + 1 offsets instead.
+     */
+    void view(const char *text, const unsigned long long *offsets, size_t count) {
+        std::vector<char>().swap(_ownedText);
+        _ownedOffsets.assign(1, 0);
+        _text = text;
+        _offsets = offsets;
+        _size = count;
+        _mapped = true;
+    }
+
+    /**
+     * Copy viewed names into owned storage so more can be added.
+     */
+    void makeOwned() {
+        if (_mapped) {
+            _ownedText.assign(_text, _text + _offsets[_size]);
+            _ownedOffsets.assign(_offsets, _offsets + _size + 1);
+            _text = _ownedText.data();
+            _offsets = _ownedOffsets.data();
+            _mapped = false;
+        }
+    }
+
+    bool isMapped() const { return _mapped; }
+
+    size_t size() const { return _size; }
+
+    std::string operator[](size_t i) const {
+        return std::string(_text + _offsets[i], _text + _offsets[i + 1]);
+    }
+
+    const char *text() const { return _text; }
+
+    const unsigned long long *offsets() const { return _offsets; }
+
+private:
+    std::vector<char> _ownedText;
+    std::vector<unsigned long long> _ownedOffsets;
+    const char *_text;
+    const unsigned long long *_offsets;
+    size_t _size;
+    bool _mapped;
+};
+
+#endif // __SCENE_ARRAY_H__
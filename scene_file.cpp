@@ -0,0 +1,287 @@
+#include "scene_file.h"
+#include "raytrace.h"
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+// The mapped file the current binary scene points into
+static MappedFile s_sceneFile = {NULL, 0, false};
+
+
+// -------------------------------------------------------------------
+// Loading
+
+bool isBinaryScene(const MappedFile &file) {
+    return file.size >= sizeof(SceneFileHeader) && memcmp(file.data, SCENE_FILE_MAGIC, 8) == 0;
+}
+
+bool validFileSection(unsigned long long fileSize, unsigned long long offset, unsigned long long count,
+                      unsigned long long elementSize) {
+    if (offset % SCENE_FILE_ALIGNMENT != 0 || offset > fileSize) {
+        return false;
+    }
+    return count <= (fileSize - offset) / elementSize;
+}
+
+static bool validHeader(const SceneFileHeader &header, size_t fileSize) {
+    if (header.version != SCENE_FILE_VERSION || header.byteOrder != SCENE_FILE_BYTE_ORDER ||
+        header.headerSize != sizeof(SceneFileHeader) || header.sphereSize != sizeof(Sphere) ||
+        header.lightSize != sizeof(Light) || header.fileSize != fileSize ||
+        header.accelerator < ACCEL_NONE || header.accelerator > ACCEL_GRID) {
+        return false;
+    }
+    if (header.paddedCount < header.sphereCount || header.paddedCount % SPHERE_BLOCK != 0 ||
+        header.paddedCount > (unsigned long long) INT_MAX) {
+        return false;
+    }
+
+    bool valid = validFileSection(header.fileSize, header.spheres, header.sphereCount, sizeof(Sphere)) &&
+                 validFileSection(header.fileSize, header.lights, header.lightCount, sizeof(Light)) &&
+                 validFileSection(header.fileSize, header.material, header.paddedCount, sizeof(int)) &&
+                 validFileSection(header.fileSize, header.sphereNameOffsets, header.sphereCount + 1, 8) &&
+                 validFileSection(header.fileSize, header.sphereNames, header.sphereNamesSize, 1) &&
+                 validFileSection(header.fileSize, header.lightNameOffsets, header.lightCount + 1, 8) &&
+                 validFileSection(header.fileSize, header.lightNames, header.lightNamesSize, 1) &&
+                 validFileSection(header.fileSize, header.outputFilename, header.outputFilenameSize, 1);
+    for (int k = 0; k < 3; k++) {
+        valid = valid && validFileSection(header.fileSize, header.center[k], header.paddedCount, sizeof(float)) &&
+                validFileSection(header.fileSize, header.inverseScale[k], header.paddedCount, sizeof(float));
+    }
+    return valid;
+}
+
+/**
+ * Whether every name lies inside its text section.
+ */
+static bool validNames(const unsigned long long *offsets, unsigned long long count, unsigned long long textSize) {
+    if (offsets[0] != 0) {
+        return false;
+    }
+    for (unsigned long long i = 0; i < count; i++) {
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] > textSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether every sphere slot refers to one of the count spheres.
+ */
+static bool validMaterials(const int *material, unsigned long long count) {
+    for (unsigned long long i = 0; i < count; i++) {
+        if (material[i] < 0 || (unsigned long long) material[i] >= count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool loadBinaryScene(const char *filename, MappedFile &file) {
+    const SceneFileHeader &header = *(const SceneFileHeader *) file.data;
+    if (!validHeader(header, file.size)) {
+        cout << "Binary scene " << filename << " is corrupt or was written by an incompatible version" << endl;
+        return false;
+    }
+
+    const char *base = file.data;
+    const unsigned long long *sphereNameOffsets = (const unsigned long long *) (base + header.sphereNameOffsets);
+    const unsigned long long *lightNameOffsets = (const unsigned long long *) (base + header.lightNameOffsets);
+    if (!validNames(sphereNameOffsets, header.sphereCount, header.sphereNamesSize) ||
+        !validNames(lightNameOffsets, header.lightCount, header.lightNamesSize)) {
+        cout << "Binary scene " << filename << " has corrupt names" << endl;
+        return false;
+    }
+    if (!validMaterials((const int *) (base + header.material), header.sphereCount)) {
+        cout << "Binary scene " << filename << " has spheres that refer to no sphere" << endl;
+        return false;
+    }
+
+    g_near = header.nearPlane;
+    g_left = header.left;
+    g_right = header.right;
+    g_top = header.top;
+    g_bottom = header.bottom;
+    g_width = header.width;
+    g_height = header.height;
+    g_backgroundColor = vec4(header.backgroundColor[0], header.backgroundColor[1], header.backgroundColor[2],
+                             header.backgroundColor[3]);
+    g_ambientIntensity = vec4(header.ambientIntensity[0], header.ambientIntensity[1], header.ambientIntensity[2],
+                              header.ambientIntensity[3]);
+    g_accelerator = (Accelerator) header.accelerator;
+    g_outputFilename.assign(base + header.outputFilename, (size_t) header.outputFilenameSize);
+
+    g_spheres.view((const Sphere *) (base + header.spheres), (size_t) header.sphereCount);
+    g_lights.view((const Light *) (base + header.lights), (size_t) header.lightCount);
+    g_sphereIds.view(base + header.sphereNames, sphereNameOffsets, (size_t) header.sphereCount);
+    g_lightIds.view(base + header.lightNames, lightNameOffsets, (size_t) header.lightCount);
+
+    g_sphereStore.count = (int) header.sphereCount;
+    g_sphereStore.paddedCount = (int) header.paddedCount;
+    for (int k = 0; k < 3; k++) {
+        g_sphereStore.center[k] = (const float *) (base + header.center[k]);
+        g_sphereStore.inverseScale[k] = (const float *) (base + header.inverseScale[k]);
+    }
+    g_sphereStore.material = (const int *) (base + header.material);
+
+    // Only now is nothing left pointing into the previous file
+    unmapFile(s_sceneFile);
+    s_sceneFile = file;
+    return true;
+}
+
+
+// -------------------------------------------------------------------
+// Saving
+
+unsigned long long alignFileSection(unsigned long long offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+void writeFileSection(FILE *fp, unsigned long long &written, unsigned long long offset, const void *data,
+                      unsigned long long size) {
+    static const char zeros[SCENE_FILE_ALIGNMENT] = {0};
+    fwrite(zeros, 1, (size_t) (offset - written), fp);
+    fwrite(data, 1, (size_t) size, fp);
+    written = offset + size;
+}
+
+bool saveBinaryScene(const char *filename) {
+    compileScene();
+    buildSphereStore();
+
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, 8);
+    header.version = SCENE_FILE_VERSION;
+    header.byteOrder = SCENE_FILE_BYTE_ORDER;
+    header.headerSize = sizeof(SceneFileHeader);
+    header.sphereSize = sizeof(Sphere);
+    header.lightSize = sizeof(Light);
+    header.accelerator = g_accelerator;
+    header.nearPlane = g_near;
+    header.left = g_left;
+    header.right = g_right;
+    header.top = g_top;
+    header.bottom = g_bottom;
+    header.width = g_width;
+    header.height = g_height;
+    for (int k = 0; k < 4; k++) {
+        header.backgroundColor[k] = g_backgroundColor[k];
+        header.ambientIntensity[k] = g_ambientIntensity[k];
+    }
+    header.sphereCount = g_spheres.size();
+    header.paddedCount = (unsigned long long) g_sphereStore.paddedCount;
+    header.lightCount = g_lights.size();
+    header.sphereNamesSize = g_sphereIds.offsets()[g_sphereIds.size()];
+    header.lightNamesSize = g_lightIds.offsets()[g_lightIds.size()];
+    header.outputFilenameSize = g_outputFilename.size();
+
+    // Lay the sections out one after another
+    unsigned long long end = sizeof(SceneFileHeader);
+    header.spheres = alignFileSection(end);
+    end = header.spheres + header.sphereCount * sizeof(Sphere);
+    header.lights = alignFileSection(end);
+    end = header.lights + header.lightCount * sizeof(Light);
+    for (int k = 0; k < 3; k++) {
+        header.center[k] = alignFileSection(end);
+        end = header.center[k] + header.paddedCount * sizeof(float);
+    }
+    for (int k = 0; k < 3; k++) {
+        header.inverseScale[k] = alignFileSection(end);
+        end = header.inverseScale[k] + header.paddedCount * sizeof(float);
+    }
+    header.material = alignFileSection(end);
+    end = header.material + header.paddedCount * sizeof(int);
+    header.sphereNameOffsets = alignFileSection(end);
+    end = header.sphereNameOffsets + (header.sphereCount + 1) * 8;
+    header.sphereNames = alignFileSection(end);
+    end = header.sphereNames + header.sphereNamesSize;
+    header.lightNameOffsets = alignFileSection(end);
+    end = header.lightNameOffsets + (header.lightCount + 1) * 8;
+    header.lightNames = alignFileSection(end);
+    end = header.lightNames + header.lightNamesSize;
+    header.outputFilename = alignFileSection(end);
+    end = header.outputFilename + header.outputFilenameSize;
+    header.fileSize = end;
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", filename);
+        return false;
+    }
+    unsigned long long written = 0;
+    writeFileSection(fp, written, 0, &header, sizeof(header));
+    writeFileSection(fp, written, header.spheres, g_spheres.data(), header.sphereCount * sizeof(Sphere));
+    writeFileSection(fp, written, header.lights, g_lights.data(), header.lightCount * sizeof(Light));
+    for (int k = 0; k < 3; k++) {
+        writeFileSection(fp, written, header.center[k], g_sphereStore.center[k], header.paddedCount * sizeof(float));
+    }
+    for (int k = 0; k < 3; k++) {
+        writeFileSection(fp, written, header.inverseScale[k], g_sphereStore.inverseScale[k],
+                     header.paddedCount * sizeof(float));
+    }
+    writeFileSection(fp, written, header.material, g_sphereStore.material, header.paddedCount * sizeof(int));
+    writeFileSection(fp, written, header.sphereNameOffsets, g_sphereIds.offsets(), (header.sphereCount + 1) * 8);
+    writeFileSection(fp, written, header.sphereNames, g_sphereIds.text(), header.sphereNamesSize);
+    writeFileSection(fp, written, header.lightNameOffsets, g_lightIds.offsets(), (header.lightCount + 1) * 8);
+    writeFileSection(fp, written, header.lightNames, g_lightIds.text(), header.lightNamesSize);
+    writeFileSection(fp, written, header.outputFilename, g_outputFilename.data(), header.outputFilenameSize);
+
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        printf("Unable to write file '%s'\n", filename);
+    }
+    return ok;
+}
+
+bool saveTextScene(const char *filename) {
+    static const char *accelerators[] = {"NONE", "BVH", "GRID"};
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp) {
+        printf("Unable to open file '%s'\n", filename);
+        return false;
+    }
+
+    // 9 significant digits read back as the same float
+    fprintf(fp, "NEAR %.9g\nLEFT %.9g\nRIGHT %.9g\nBOTTOM %.9g\nTOP %.9g\n", g_near, g_left, g_right, g_bottom,
+            g_top);
+    fprintf(fp, "RES %d %d\n", g_width, g_height);
+    for (size_t i = 0; i < g_spheres.size(); i++) {
+        const Sphere &sphere = g_spheres[i];
+        fprintf(fp, "SPHERE %s %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n",
+                g_sphereIds[i].c_str(), sphere.position.x, sphere.position.y, sphere.position.z, sphere.scale.x,
+                sphere.scale.y, sphere.scale.z, sphere.color.x, sphere.color.y, sphere.color.z, sphere.Ka, sphere.Kd,
+                sphere.Ks, sphere.Kr, sphere.specularExponent);
+    }
+    for (size_t i = 0; i < g_lights.size(); i++) {
+        const Light &light = g_lights[i];
+        fprintf(fp, "LIGHT %s %.9g %.9g %.9g %.9g %.9g %.9g", g_lightIds[i].c_str(), light.position.x,
+                light.position.y, light.position.z, light.color.x, light.color.y, light.color.z);
+        if (light.radius > 0) {
+            fprintf(fp, " %.9g", light.radius);
+        }
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "BACK %.9g %.9g %.9g\n", g_backgroundColor.x, g_backgroundColor.y, g_backgroundColor.z);
+    fprintf(fp, "AMBIENT %.9g %.9g %.9g\n", g_ambientIntensity.x, g_ambientIntensity.y, g_ambientIntensity.z);
+    if (g_accelerator != ACCEL_NONE) {
+        fprintf(fp, "ACCEL %s\n", accelerators[g_accelerator]);
+    }
+    if (!g_outputFilename.empty()) {
+        fprintf(fp, "OUTPUT %s\n", g_outputFilename.c_str());
+    }
+
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        printf("Unable to write file '%s'\n", filename);
+    }
+    return ok;
+}
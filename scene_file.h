@@ -0,0 +1,109 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- scene_file.h ---
+//
+//  Binary scene files. They hold the compiled scene exactly as the tracer
+//  reads it, so loading one maps the file and points the scene at it
+//  without touching a single object.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SCENE_FILE_H__
+#define __SCENE_FILE_H__
+
+#include "mapped_file.h"
+#include <cstdio>
+
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 2
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+#define SCENE_FILE_ALIGNMENT 64
+
+/**
+ * File header. Every section starts at a multiple of SCENE_FILE_ALIGNMENT
+ * bytes from the start of the file. The sphere and light arrays are raw
+ * Sphere and Light records, so a file is only readable by a build with the
+ * same record sizes; the sphere store arrays are padded to paddedCount.
+ */
+struct SceneFileHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder;
+    unsigned int headerSize;
+    unsigned int sphereSize;
+    unsigned int lightSize;
+    int accelerator;
+
+    float nearPlane;
+    float left;
+    float right;
+    float top;
+    float bottom;
+    int width;
+    int height;
+    float backgroundColor[4];
+    float ambientIntensity[4];
+
+    unsigned long long sphereCount;
+    unsigned long long paddedCount;
+    unsigned long long lightCount;
+
+    // Byte offsets of the sections
+    unsigned long long spheres;
+    unsigned long long lights;
+    unsigned long long center[3];
+    unsigned long long inverseScale[3];
+    unsigned long long material;
+    unsigned long long sphereNameOffsets;   // sphereCount + 1 offsets into sphereNames
+    unsigned long long sphereNames;
+    unsigned long long sphereNamesSize;
+    unsigned long long lightNameOffsets;    // lightCount + 1 offsets into lightNames
+    unsigned long long lightNames;
+    unsigned long long lightNamesSize;
+    unsigned long long outputFilename;
+    unsigned long long outputFilenameSize;
+    unsigned long long fileSize;
+};
+
+bool isBinaryScene(const MappedFile &file);
+
+/**
+ * Whether count elements of elementSize bytes at offset lie inside a file
+ * of fileSize bytes and start on a SCENE_FILE_ALIGNMENT boundary. Shared
+ * with the render cache, which lays out its sections the same way.
+ */
+bool validFileSection(unsigned long long fileSize, unsigned long long offset, unsigned long long count,
+                      unsigned long long elementSize);
+
+/**
+ * The first offset from offset on where a section may start.
+ */
+unsigned long long alignFileSection(unsigned long long offset);
+
+/**
+ * Append a section at offset, zero padding from written, the current end
+ * of the file, which then moves past the section.
+ */
+void writeFileSection(FILE *fp, unsigned long long &written, unsigned long long offset, const void *data,
+                      unsigned long long size);
+
+/**
+ * Point the scene at a mapped binary scene file. The file stays mapped for
+ * as long as the scene uses it. Returns false, saying why, on a malformed
+ * file, which is then left to the caller and the scene untouched.
+ */
+bool loadBinaryScene(const char *filename, MappedFile &file);
+
+/**
+ * Write the current scene as a binary scene file, compiling it first if
+ * needed. Returns false if the file cannot be written.
+ */
+bool saveBinaryScene(const char *filename);
+
+/**
+ * Write the current scene in the text format. Numbers are written with
+ * enough digits to read back as the same floats.
+ */
+bool saveTextScene(const char *filename);
+
+#endif // __SCENE_FILE_H__
@@ -0,0 +1,71 @@
+#include "simd_lanes.h"
+#include "packet_kernel.h"
+#include "sphere_kernel.h"
+#include "quantize_kernel.h"
+#include <cstring>
+
+// Scalar-lane kernels, used on hosts without a SIMD kernel.
+
+void intersectPacketScalar(const PacketScene &scene, const PacketRays &rays, PacketHits &hits) {
+    intersectPrimaryPacket<ScalarLanes>(scene, rays, hits);
+}
+
+void intersectSpheresScalar(const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    intersectSpheres<ScalarLanes>(store, query, hit);
+}
+
+int findOccluderScalar(const SphereStore &store, const SphereQuery &query) {
+    return findOccluder<ScalarLanes>(store, query);
+}
+
+void quantizeRGB8Scalar(const float *values, size_t count, unsigned char *out) {
+    quantizeRGB8<ScalarLanes>(values, count, out);
+}
+
+
+// -------------------------------------------------------------------
+// Runtime dispatch
+
+const SimdKernels *g_simdKernels = NULL;
+
+static const SimdKernels s_scalarKernels = {
+        "scalar", ScalarLanes::WIDTH, intersectPacketScalar, 2 * ScalarLanes::WIDTH, intersectSpheresScalar,
+        findOccluderScalar, quantizeRGB8Scalar
+};
+#ifdef RT_X86_SIMD
+static const SimdKernels s_sseKernels = {
+        "sse", 4, intersectPacketSSE, 8, intersectSpheresSSE, findOccluderSSE, quantizeRGB8SSE
+};
+static const SimdKernels s_avx2Kernels = {
+        "avx2", 8, intersectPacketAVX2, 16, intersectSpheresAVX2, findOccluderAVX2, quantizeRGB8AVX2
+};
+#endif
+
+QuantizeFunc quantizeKernel() {
+    return g_simdKernels != NULL ? g_simdKernels->quantizeRGB8 : quantizeRGB8Scalar;
+}
+
+const SimdKernels *selectSimdKernels(const char *isa) {
+#ifdef RT_X86_SIMD
+    __builtin_cpu_init();
+    bool hasAVX2 = __builtin_cpu_supports("avx2");
+
+    if (strcmp(isa, "auto") == 0) {
+        return hasAVX2 ? &s_avx2Kernels : &s_sseKernels;
+    }
+    if (strcmp(isa, "avx2") == 0) {
+        return hasAVX2 ? &s_avx2Kernels : NULL;
+    }
+    if (strcmp(isa, "sse") == 0) {
+        return &s_sseKernels; // SSE2 is part of x86-64
+    }
+#else
+    if (strcmp(isa, "auto") == 0) {
+        return &s_scalarKernels;
+    }
+#endif
+    if (strcmp(isa, "scalar") == 0) {
+        return &s_scalarKernels;
+    }
+    return NULL;
+}
@@ -0,0 +1,183 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- simd.h ---
+//
+//  SIMD intersection kernels and their runtime dispatch:
+//
+//    - primary ray packets: several primary rays against every sphere
+//    - sphere blocks: one ray against a block of spheres at a time
+//    - BVH traversal of primary ray packets
+//    - clamping and quantizing float colors to 8 bits for the framebuffer
+//      and the image encoders
+//
+//  The kernels only see plain float arrays so that ISA-specific translation
+//  units never instantiate the vec4/mat4 inline helpers.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cstddef>
+
+#define PACKET_MAX_WIDTH 8
+
+// Sphere stores are padded to a multiple of this many entries so the widest
+// kernel never reads past the end
+#define SPHERE_BLOCK 16
+
+// Traversal stack depth. The BVH builder caps the tree depth well below this.
+#define BVH_STACK_SIZE 128
+
+/**
+ * Bounding volume hierarchy node. Internal nodes have count == 0 and their
+ * children at first and first + 1; leaves hold the spheres
+ * primitives[first .. first + count). See bvh.h.
+ */
+struct BVHNode {
+    float bounds[2][3];             // Min and max corner
+    int first;
+    int count;
+};
+
+/**
+ * Per-frame sphere data for primary rays, all stored structure-of-arrays
+ * with one entry per sphere. Everything that only depends on the sphere and
+ * the shared ray origin is precomputed with the scalar code path so that the
+ * packet results match calculateNearestIntersection() bit for bit.
+ */
+struct PacketScene {
+    int sphereCount;
+    float minHitTime;               // MIN_HIT_TIME
+    float minReflectHitTime;        // MIN_RELECT_HIT_TIME
+    float eye[4];                   // Shared origin of all primary rays
+    const float *S[4];              // inverseTransform * (position - eye)
+    const float *c;                 // dot(S, S) - 1
+    const float *inverse[16];       // inverseTransform, row-major
+    const float *normalMatrix[16];  // transpose(inverseTransform) * inverseTransform, row-major
+    const float *position[4];
+    const BVHNode *bvhNodes;        // NULL tests every sphere
+    const int *bvhPrimitives;       // Sphere indices referenced by the leaves
+};
+
+/**
+ * Primary ray directions, one column per lane. Unused lanes must still hold a
+ * valid direction (e.g. a copy of lane 0).
+ */
+struct PacketRays {
+    float dir[4][PACKET_MAX_WIDTH];
+};
+
+/**
+ * Nearest hits of a packet. A distance of -1 marks a lane that hit nothing,
+ * in which case the other fields of that lane are undefined.
+ */
+struct PacketHits {
+    float distance[PACKET_MAX_WIDTH];
+    int sphere[PACKET_MAX_WIDTH];
+    int interiorPoint[PACKET_MAX_WIDTH];
+    float point[4][PACKET_MAX_WIDTH];
+    float normal[4][PACKET_MAX_WIDTH];
+};
+
+/**
+ * Packed structure-of-arrays view of the spheres. Only what the intersection
+ * test needs is stored: the centre, the diagonal of inverseTransform and the
+ * index of the full Sphere record. Arrays hold paddedCount entries; the
+ * entries past count are ignored.
+ */
+struct SphereStore {
+    int count;
+    int paddedCount;
+    const float *center[3];
+    const float *inverseScale[3];
+    const int *material;            // Index into g_spheres
+};
+
+/**
+ * A single ray for the sphere block kernel. minHitTime is the largest hit
+ * time that is still rejected, so primary and secondary rays share one test.
+ * Occlusion queries only count hits before maxDistance.
+ */
+struct SphereQuery {
+    float origin[3];
+    float dir[3];
+    float minHitTime;
+    float maxDistance;
+};
+
+/**
+ * Nearest hit of a single ray, as a store slot. A distance of -1 means no
+ * hit.
+ */
+struct SphereHit {
+    float distance;
+    int slot;
+    bool interiorPoint;
+};
+
+typedef void (*PacketIntersectFunc)(const PacketScene &scene, const PacketRays &rays, PacketHits &hits);
+
+typedef void (*SphereIntersectFunc)(const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+typedef int (*SphereOccluderFunc)(const SphereStore &store, const SphereQuery &query);
+
+/**
+ * Clamp count float channels to [0, 1] and scale them to bytes.
+ */
+typedef void (*QuantizeFunc)(const float *values, size_t count, unsigned char *out);
+
+struct SimdKernels {
+    const char *name;
+    int packetWidth;
+    PacketIntersectFunc intersectPacket;
+    int sphereWidth;                // Spheres tested per iteration
+    SphereIntersectFunc intersectSpheres;
+    SphereOccluderFunc findOccluder;
+    QuantizeFunc quantizeRGB8;
+};
+
+/**
+ * The kernels in use, set from --simd before rendering; NULL with SIMD off.
+ */
+extern const SimdKernels *g_simdKernels;
+
+/**
+ * The quantize kernel of g_simdKernels, or the scalar one with SIMD off.
+ * All of them give the same bytes.
+ */
+QuantizeFunc quantizeKernel();
+
+/**
+ * Pick the kernels by name ("avx2", "sse", "scalar"), or the widest ones the
+ * host supports for "auto". Returns NULL for an unknown or unsupported name.
+ */
+const SimdKernels *selectSimdKernels(const char *isa);
+
+void intersectPacketScalar(const PacketScene &scene, const PacketRays &rays, PacketHits &hits);
+
+void intersectSpheresScalar(const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+int findOccluderScalar(const SphereStore &store, const SphereQuery &query);
+
+void quantizeRGB8Scalar(const float *values, size_t count, unsigned char *out);
+
+#ifdef RT_X86_SIMD
+void intersectPacketSSE(const PacketScene &scene, const PacketRays &rays, PacketHits &hits);
+
+void intersectSpheresSSE(const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+int findOccluderSSE(const SphereStore &store, const SphereQuery &query);
+
+void quantizeRGB8SSE(const float *values, size_t count, unsigned char *out);
+
+void intersectPacketAVX2(const PacketScene &scene, const PacketRays &rays, PacketHits &hits);
+
+void intersectSpheresAVX2(const SphereStore &store, const SphereQuery &query, SphereHit &hit);
+
+int findOccluderAVX2(const SphereStore &store, const SphereQuery &query);
+
+void quantizeRGB8AVX2(const float *values, size_t count, unsigned char *out);
+#endif
+
+#endif // __SIMD_H__
@@ -0,0 +1,24 @@
+#include "simd_lanes.h"
+#include "packet_kernel.h"
+#include "sphere_kernel.h"
+#include "quantize_kernel.h"
+
+// AVX2 kernels: eight primary rays per sphere test, sixteen spheres per
+// iteration for single rays. This file is the only one built with -mavx2
+// and is only called after a runtime CPU check.
+
+void intersectPacketAVX2(const PacketScene &scene, const PacketRays &rays, PacketHits &hits) {
+    intersectPrimaryPacket<AVX2Lanes>(scene, rays, hits);
+}
+
+void intersectSpheresAVX2(const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    intersectSpheres<AVX2Lanes>(store, query, hit);
+}
+
+int findOccluderAVX2(const SphereStore &store, const SphereQuery &query) {
+    return findOccluder<AVX2Lanes>(store, query);
+}
+
+void quantizeRGB8AVX2(const float *values, size_t count, unsigned char *out) {
+    quantizeRGB8<AVX2Lanes>(values, count, out);
+}
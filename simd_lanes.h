@@ -0,0 +1,255 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- simd_lanes.h ---
+//
+//  Lane operations the SIMD kernels are written against. Each ISA
+//  translation unit includes this with its own compiler flags and only gets
+//  the lane types its target supports. Everything lives in an anonymous
+//  namespace so differently compiled copies never meet at link time.
+//
+//  Only include this from simd*.cpp.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SIMD_LANES_H__
+#define __SIMD_LANES_H__
+
+#include <cmath>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Portable lanes used when no SIMD kernel is available. Same arithmetic as
+// the SIMD lanes, one lane at a time.
+struct ScalarLanes {
+    static const int WIDTH = 4;
+
+    struct F {
+        float v[WIDTH];
+    };
+
+    struct M {
+        bool v[WIDTH];
+    };
+
+#define SCALAR_LANES_OP(expr) \
+        F r; \
+        for (int i = 0; i < WIDTH; i++) r.v[i] = (expr); \
+        return r
+
+#define SCALAR_LANES_MASK(expr) \
+        M r; \
+        for (int i = 0; i < WIDTH; i++) r.v[i] = (expr); \
+        return r
+
+    static F set1(float s) { SCALAR_LANES_OP(s); }
+
+    static F load(const float *p) { SCALAR_LANES_OP(p[i]); }
+
+
+    static void store(float *p, F a) { for (int i = 0; i < WIDTH; i++) p[i] = a.v[i]; }
+
+    // Truncate lanes holding values in [0, 256) to bytes
+    static void storeBytes(unsigned char *p, F a) { for (int i = 0; i < WIDTH; i++) p[i] = (unsigned char) a.v[i]; }
+
+    static F gather(const float *base, const int *idx) { SCALAR_LANES_OP(base[idx[i]]); }
+
+    static F add(F a, F b) { SCALAR_LANES_OP(a.v[i] + b.v[i]); }
+
+    static F sub(F a, F b) { SCALAR_LANES_OP(a.v[i] - b.v[i]); }
+
+    static F mul(F a, F b) { SCALAR_LANES_OP(a.v[i] * b.v[i]); }
+
+    static F div(F a, F b) { SCALAR_LANES_OP(a.v[i] / b.v[i]); }
+
+    static F neg(F a) { SCALAR_LANES_OP(-a.v[i]); }
+
+    static F sqrt(F a) { SCALAR_LANES_OP(sqrtf(a.v[i])); }
+
+    // Match minps/maxps, which return the second operand when either is NaN
+    static F min(F a, F b) { SCALAR_LANES_OP(a.v[i] < b.v[i] ? a.v[i] : b.v[i]); }
+
+    static F max(F a, F b) { SCALAR_LANES_OP(a.v[i] > b.v[i] ? a.v[i] : b.v[i]); }
+
+    static M cmplt(F a, F b) { SCALAR_LANES_MASK(a.v[i] < b.v[i]); }
+
+    static M cmple(F a, F b) { SCALAR_LANES_MASK(a.v[i] <= b.v[i]); }
+
+    static M cmpeq(F a, F b) { SCALAR_LANES_MASK(a.v[i] == b.v[i]); }
+
+    static M mand(M a, M b) { SCALAR_LANES_MASK(a.v[i] && b.v[i]); }
+
+    static M mor(M a, M b) { SCALAR_LANES_MASK(a.v[i] || b.v[i]); }
+
+    // ~a & b
+    static M mandnot(M a, M b) { SCALAR_LANES_MASK(!a.v[i] && b.v[i]); }
+
+    static M mnot(M a) { SCALAR_LANES_MASK(!a.v[i]); }
+
+    static F select(M m, F a, F b) { SCALAR_LANES_OP(m.v[i] ? a.v[i] : b.v[i]); }
+
+    static bool any(M m) {
+        for (int i = 0; i < WIDTH; i++)
+            if (m.v[i]) return true;
+        return false;
+    }
+
+    static float hmin(F a) {
+        float r = a.v[0];
+        for (int i = 1; i < WIDTH; i++) r = a.v[i] < r ? a.v[i] : r;
+        return r;
+    }
+
+#undef SCALAR_LANES_OP
+#undef SCALAR_LANES_MASK
+};
+
+#ifdef __SSE2__
+
+// SSE2 lanes, four wide.
+struct SSELanes {
+    static const int WIDTH = 4;
+    typedef __m128 F;
+    typedef __m128 M;
+
+    static F set1(float s) { return _mm_set1_ps(s); }
+
+    static F load(const float *p) { return _mm_loadu_ps(p); }
+
+
+    static void store(float *p, F a) { _mm_storeu_ps(p, a); }
+
+    static void storeBytes(unsigned char *p, F a) {
+        __m128i words = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_setzero_si128());
+        int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+        memcpy(p, &bytes, 4);
+    }
+
+    static F gather(const float *base, const int *idx) {
+        return _mm_set_ps(base[idx[3]], base[idx[2]], base[idx[1]], base[idx[0]]);
+    }
+
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+
+    static F neg(F a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+
+    static F sqrt(F a) { return _mm_sqrt_ps(a); }
+
+    static F min(F a, F b) { return _mm_min_ps(a, b); }
+
+    static F max(F a, F b) { return _mm_max_ps(a, b); }
+
+    static M cmplt(F a, F b) { return _mm_cmplt_ps(a, b); }
+
+    static M cmple(F a, F b) { return _mm_cmple_ps(a, b); }
+
+    static M cmpeq(F a, F b) { return _mm_cmpeq_ps(a, b); }
+
+    static M mand(M a, M b) { return _mm_and_ps(a, b); }
+
+    static M mor(M a, M b) { return _mm_or_ps(a, b); }
+
+    // ~a & b
+    static M mandnot(M a, M b) { return _mm_andnot_ps(a, b); }
+
+    static M mnot(M a) { return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+
+    static F select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+
+    static bool any(M m) { return _mm_movemask_ps(m) != 0; }
+
+    static float hmin(F a) {
+        a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 3, 2)));
+        a = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(a);
+    }
+};
+
+#endif // __SSE2__
+
+#ifdef __AVX2__
+
+// AVX2 lanes, eight wide.
+struct AVX2Lanes {
+    static const int WIDTH = 8;
+    typedef __m256 F;
+    typedef __m256 M;
+
+    static F set1(float s) { return _mm256_set1_ps(s); }
+
+    static F load(const float *p) { return _mm256_loadu_ps(p); }
+
+
+    static void store(float *p, F a) { _mm256_storeu_ps(p, a); }
+
+    static void storeBytes(unsigned char *p, F a) {
+        __m256i ints = _mm256_cvttps_epi32(a);
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(ints), _mm256_extracti128_si256(ints, 1));
+        _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(words, words));
+    }
+
+    static F gather(const float *base, const int *idx) {
+        return _mm256_i32gather_ps(base, _mm256_loadu_si256((const __m256i *) idx), 4);
+    }
+
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+
+    static F neg(F a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+
+    static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+
+    static F min(F a, F b) { return _mm256_min_ps(a, b); }
+
+    static F max(F a, F b) { return _mm256_max_ps(a, b); }
+
+    static M cmplt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+
+    static M cmple(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+
+    static M cmpeq(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+
+    static M mand(M a, M b) { return _mm256_and_ps(a, b); }
+
+    static M mor(M a, M b) { return _mm256_or_ps(a, b); }
+
+    // ~a & b
+    static M mandnot(M a, M b) { return _mm256_andnot_ps(a, b); }
+
+    static M mnot(M a) { return _mm256_xor_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(-1))); }
+
+    static F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+
+    static bool any(M m) { return _mm256_movemask_ps(m) != 0; }
+
+    static float hmin(F a) {
+        __m128 r = _mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        r = _mm_min_ps(r, _mm_shuffle_ps(r, r, _MM_SHUFFLE(1, 0, 3, 2)));
+        r = _mm_min_ps(r, _mm_shuffle_ps(r, r, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(r);
+    }
+};
+
+#endif // __AVX2__
+
+} // namespace
+
+#endif // __SIMD_LANES_H__
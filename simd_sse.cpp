@@ -0,0 +1,23 @@
+#include "simd_lanes.h"
+#include "packet_kernel.h"
+#include "sphere_kernel.h"
+#include "quantize_kernel.h"
+
+// SSE2 kernels: four primary rays per sphere test, eight spheres per
+// iteration for single rays.
+
+void intersectPacketSSE(const PacketScene &scene, const PacketRays &rays, PacketHits &hits) {
+    intersectPrimaryPacket<SSELanes>(scene, rays, hits);
+}
+
+void intersectSpheresSSE(const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    intersectSpheres<SSELanes>(store, query, hit);
+}
+
+int findOccluderSSE(const SphereStore &store, const SphereQuery &query) {
+    return findOccluder<SSELanes>(store, query);
+}
+
+void quantizeRGB8SSE(const float *values, size_t count, unsigned char *out) {
+    quantizeRGB8<SSELanes>(values, count, out);
+}
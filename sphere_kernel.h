@@ -0,0 +1,200 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- sphere_kernel.h ---
+//
+//  One ray against the packed sphere store, V::WIDTH spheres per test and
+//  two independent tests per iteration for nearest hits, or stopping at the
+//  first blocker for occlusion. The inverse transforms are diagonal
+//  scales, so S and C only need the centre and the inverse scale; the
+//  remaining terms of the scalar mat4 products are all zero.
+//
+//  Only include this from simd*.cpp, after simd_lanes.h.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SPHERE_KERNEL_H__
+#define __SPHERE_KERNEL_H__
+
+#include "render_stats.h"
+#include "simd.h"
+
+namespace {
+
+const float s_laneIndex[SPHERE_BLOCK] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+/**
+ * Running nearest hit of each lane. Slots are kept as floats so they can be
+ * blended with the distances; they are exact well past any sphere count.
+ */
+template<class V>
+struct SphereLanesHit {
+    typename V::F distance;
+    typename V::F slot;
+    typename V::F interior;
+};
+
+/**
+ * Solve the quadratic for the V::WIDTH spheres starting at slot base.
+ * Returns the lanes with a valid hit after query.minHitTime, with their hit
+ * time and whether the ray starts inside the sphere.
+ */
+template<class V>
+inline typename V::M solveSphereBlock(const SphereStore &store, const SphereQuery &query, int base,
+                                      typename V::F &solution, typename V::M &interiorPoint) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    const F zero = V::set1(0.0f);
+    const F one = V::set1(1.0f);
+    const F minHitTime = V::set1(query.minHitTime);
+
+    F slot = V::add(V::set1((float) base), V::load(s_laneIndex));
+    M inStore = V::cmplt(slot, V::set1((float) store.count));
+
+    // S = inverseTransform * (position - origin), C = inverseTransform * dir
+    F isx = V::load(store.inverseScale[0] + base);
+    F isy = V::load(store.inverseScale[1] + base);
+    F isz = V::load(store.inverseScale[2] + base);
+    F sx = V::mul(isx, V::sub(V::load(store.center[0] + base), V::set1(query.origin[0])));
+    F sy = V::mul(isy, V::sub(V::load(store.center[1] + base), V::set1(query.origin[1])));
+    F sz = V::mul(isz, V::sub(V::load(store.center[2] + base), V::set1(query.origin[2])));
+    F cx = V::mul(isx, V::set1(query.dir[0]));
+    F cy = V::mul(isy, V::set1(query.dir[1]));
+    F cz = V::mul(isz, V::set1(query.dir[2]));
+
+    // Quadratic equation: |c|^2t^2 + 2(S.tc) + |S|^2 - 1
+    F a = V::add(V::add(V::mul(cx, cx), V::mul(cy, cy)), V::mul(cz, cz));
+    F b = V::add(V::add(V::mul(sx, cx), V::mul(sy, cy)), V::mul(sz, cz));
+    F c = V::sub(V::add(V::add(V::mul(sx, sx), V::mul(sy, sy)), V::mul(sz, sz)), one);
+    F discriminant = V::sub(V::mul(b, b), V::mul(a, c));
+
+    M intersects = V::mand(V::mnot(V::cmplt(discriminant, zero)), inStore);
+    if (!V::any(intersects)) {
+        return intersects;
+    }
+    M single = V::cmpeq(discriminant, zero);
+
+    // Two solutions: use the smallest valid one, else fall back to the far one
+    F root = V::sqrt(discriminant);
+    F solution1 = V::div(V::sub(b, root), a);
+    F solution2 = V::div(V::add(b, root), a);
+    solution = V::min(solution1, solution2);
+    M tooClose = V::cmple(solution, minHitTime);
+    solution = V::select(tooClose, V::max(solution1, solution2), solution);
+    interiorPoint = V::mandnot(single, tooClose);
+
+    // Single solution: line touches the sphere
+    solution = V::select(single, V::div(b, a), solution);
+
+    return V::mandnot(V::cmple(solution, minHitTime), intersects);
+}
+
+template<class V>
+inline void testSphereBlock(const SphereStore &store, const SphereQuery &query, int base, SphereLanesHit<V> &best) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F solution;
+    M interiorPoint;
+    M valid = solveSphereBlock<V>(store, query, base, solution, interiorPoint);
+    if (!V::any(valid)) {
+        return;
+    }
+
+    // Keep the nearest. Lanes only ever see increasing slots, so the strict
+    // compare keeps the first of equally near spheres.
+    F slot = V::add(V::set1((float) base), V::load(s_laneIndex));
+    M take = V::mand(valid, V::cmplt(solution, best.distance));
+
+    best.distance = V::select(take, solution, best.distance);
+    best.slot = V::select(take, slot, best.slot);
+    best.interior = V::select(take, V::select(interiorPoint, V::set1(1.0f), V::set1(0.0f)), best.interior);
+}
+
+template<class V>
+void intersectSpheres(const SphereStore &store, const SphereQuery &query, SphereHit &hit) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    const F infinity = V::set1(INFINITY);
+
+    SphereLanesHit<V> even;
+    SphereLanesHit<V> odd;
+    even.distance = odd.distance = infinity;
+    even.slot = odd.slot = infinity;
+    even.interior = odd.interior = V::set1(0.0f);
+
+    for (int base = 0; base < store.paddedCount; base += 2 * V::WIDTH) {
+        testSphereBlock<V>(store, query, base, even);
+        testSphereBlock<V>(store, query, base + V::WIDTH, odd);
+    }
+    STATS_ADD(sphereTests, store.paddedCount);
+
+    // Horizontal min over both accumulators, ties going to the lowest slot
+    float nearest = V::hmin(V::min(even.distance, odd.distance));
+    hit.distance = -1;
+    hit.interiorPoint = false;
+    if (nearest == INFINITY) {
+        return;
+    }
+
+    F nearestLanes = V::set1(nearest);
+    M evenNearest = V::cmpeq(even.distance, nearestLanes);
+    M oddNearest = V::cmpeq(odd.distance, nearestLanes);
+    float slot = V::hmin(V::min(V::select(evenNearest, even.slot, infinity),
+                                V::select(oddNearest, odd.slot, infinity)));
+
+    float slots[2][PACKET_MAX_WIDTH];
+    float interior[2][PACKET_MAX_WIDTH];
+    V::store(slots[0], even.slot);
+    V::store(slots[1], odd.slot);
+    V::store(interior[0], even.interior);
+    V::store(interior[1], odd.interior);
+    for (int k = 0; k < 2; k++)
+        for (int i = 0; i < V::WIDTH; i++)
+            if (slots[k][i] == slot) {
+                hit.interiorPoint = interior[k][i] != 0.0f;
+            }
+
+    hit.distance = nearest;
+    hit.slot = (int) slot;
+}
+
+/**
+ * Any-hit test: whether some sphere is hit after query.minHitTime and before
+ * query.maxDistance. Returns the first such slot found, or -1.
+ */
+template<class V>
+int findOccluder(const SphereStore &store, const SphereQuery &query) {
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    const F maxDistance = V::set1(query.maxDistance);
+
+    for (int base = 0; base < store.paddedCount; base += V::WIDTH) {
+        F solution;
+        M interiorPoint;
+        M valid = solveSphereBlock<V>(store, query, base, solution, interiorPoint);
+        if (!V::any(valid)) {
+            continue;
+        }
+        M blocks = V::mand(valid, V::cmplt(solution, maxDistance));
+        if (!V::any(blocks)) {
+            continue;
+        }
+
+        float lanes[PACKET_MAX_WIDTH];
+        V::store(lanes, V::select(blocks, V::set1(1.0f), V::set1(0.0f)));
+        for (int i = 0; i < V::WIDTH; i++)
+            if (lanes[i] != 0.0f) {
+                STATS_ADD(sphereTests, base + V::WIDTH);
+                return base + i;
+            }
+    }
+    STATS_ADD(sphereTests, store.paddedCount);
+    return -1;
+}
+
+} // namespace
+
+#endif // __SPHERE_KERNEL_H__
@@ -0,0 +1,134 @@
+// Merges the partial images of one frame, rendered by separate jobs with
+// Raytracer --region, into a PPM image. The windows must cover the frame
+// exactly once. Rows are converted and written one at a time straight from
+// the mapped partial images, so memory does not grow with the frame; the
+// result is byte for byte the PPM a single render writes.
+//
+// Usage: merge_regions <output.ppm|-> <partial_image>...
+
+#include "partial_image.h"
+#include "simd.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+static void printUsage() {
+    cout << "Usage: merge_regions <output.ppm|-> <partial_image>..." << endl;
+}
+
+/**
+ * Move active on to row y: drop the windows that end above it, add those
+ * that start on it from byTop, and keep them in order from left to right.
+ * Returns false, saying where, unless they cover the row exactly once.
+ */
+static bool advanceRow(const vector<PartialImage> &images, const vector<const char *> &names,
+                       const vector<int> &byTop, size_t &next, int y, vector<int> &active, FILE *log) {
+    active.erase(remove_if(active.begin(), active.end(), [&](int i) { return images[i].header->y1 <= y; }),
+                 active.end());
+    while (next < byTop.size() && images[byTop[next]].header->y0 == y) {
+        active.push_back(byTop[next++]);
+    }
+    sort(active.begin(), active.end(), [&](int a, int b) { return images[a].header->x0 < images[b].header->x0; });
+
+    int x = 0;
+    for (size_t k = 0; k < active.size(); k++) {
+        const PartialImageHeader &header = *images[active[k]].header;
+        if (header.x0 < x) {
+            fprintf(log, "%s and %s overlap in row %d\n", names[active[k - 1]], names[active[k]], y);
+            return false;
+        }
+        if (header.x0 > x) {
+            break;
+        }
+        x = header.x1;
+    }
+    if (x < images[0].header->imageWidth) {
+        fprintf(log, "No partial image covers pixel (%d, %d)\n", x, y);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printUsage();
+        exit(1);
+    }
+    const char *outputFile = argv[1];
+    bool toStdout = strcmp(outputFile, "-") == 0;
+    FILE *log = toStdout ? stderr : stdout;
+
+    vector<const char *> names(argv + 2, argv + argc);
+    vector<PartialImage> images(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        if (!loadPartialImage(names[i], images[i])) {
+            exit(1);
+        }
+        if (images[i].header->imageWidth != images[0].header->imageWidth ||
+            images[i].header->imageHeight != images[0].header->imageHeight) {
+            fprintf(log, "%s is part of a %d x %d image, %s of a %d x %d one\n", names[i],
+                    images[i].header->imageWidth, images[i].header->imageHeight, names[0],
+                    images[0].header->imageWidth, images[0].header->imageHeight);
+            exit(1);
+        }
+    }
+    int width = images[0].header->imageWidth;
+    int height = images[0].header->imageHeight;
+
+    vector<int> byTop(images.size());
+    for (size_t i = 0; i < images.size(); i++) {
+        byTop[i] = (int) i;
+    }
+    sort(byTop.begin(), byTop.end(), [&](int a, int b) { return images[a].header->y0 < images[b].header->y0; });
+
+    // Check the whole frame is covered before writing anything
+    vector<int> active;
+    size_t next = 0;
+    for (int y = 0; y < height; y++) {
+        if (!advanceRow(images, names, byTop, next, y, active, log)) {
+            exit(1);
+        }
+    }
+
+    // Same conversion as the renderer's PPM encoder, so the kernel only changes the speed
+    g_simdKernels = selectSimdKernels("auto");
+
+    fprintf(log, "Saving image %s: %d x %d from %d partial images\n", outputFile, width, height,
+            (int) images.size());
+    FILE *fp = toStdout ? stdout : fopen(outputFile, "wb");
+    if (!fp) {
+        fprintf(log, "Unable to open file '%s'\n", outputFile);
+        exit(1);
+    }
+    fprintf(fp, "P6\n%d %d\n%d\n", width, height, 255);
+
+    vector<unsigned char> row((size_t) width * 3);
+    active.clear();
+    next = 0;
+    for (int y = 0; y < height; y++) {
+        advanceRow(images, names, byTop, next, y, active, log);
+        for (size_t k = 0; k < active.size(); k++) {
+            const PartialImage &image = images[active[k]];
+            quantizePixels((FramebufferFormat) image.header->framebufferFormat,
+                           partialImageRow(image, y - image.header->y0), image.header->x1 - image.header->x0,
+                           &row[(size_t) image.header->x0 * 3]);
+        }
+        fwrite(row.data(), 1, row.size(), fp);
+    }
+
+    bool written = !ferror(fp);
+    written = (toStdout ? fflush(fp) : fclose(fp)) == 0 && written;
+    if (!written) {
+        fprintf(log, "Unable to write file '%s'\n", outputFile);
+        exit(1);
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        unloadPartialImage(images[i]);
+    }
+    return 0;
+}
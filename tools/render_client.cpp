@@ -0,0 +1,234 @@
+// Sends a scene to a render service (Raytracer --serve) and reports how it
+// keeps up. Several connections send the same scene back to back, each
+// waiting for its image before sending the next request; the tool prints
+// renders/sec and the p50/p99 latency as the client sees it. With
+// --requests 1 --output FILE it is a plain one-shot client.
+//
+// Usage: render_client [--connections N] [--requests N | --seconds S] [--priority P]
+//                      [--timeout-ms MS] [--output FILE] <socket> <scene>
+
+#include "mapped_file.h"
+#include "render_service.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define STATUS_COUNT (RENDER_BAD_SCENE + 1)
+
+static const char *s_statusNames[STATUS_COUNT] = {"ok", "busy", "timeout", "bad request", "bad scene"};
+
+struct LoadTest {
+    const char *socketPath;
+    MappedFile scene;
+    int priority;
+    unsigned int timeoutMs;
+    long long requests;                 // 0 runs until the deadline
+    chrono::steady_clock::time_point deadline;
+    const char *outputFile;
+
+    atomic<long long> started;
+    mutex lock;
+    vector<double> latencies;           // Milliseconds, of answered requests
+    long long statusCounts[STATUS_COUNT];
+    long long failed;                   // No connection or no complete answer
+    double queueMs;
+    double renderMs;
+    vector<char> lastImage;
+};
+
+static int connectTo(const char *socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * Send one request and wait for its answer. Returns false if there is no
+ * complete answer.
+ */
+static bool renderOnce(LoadTest &test, RenderResponseHeader &response, vector<char> &image) {
+    int fd = connectTo(test.socketPath);
+    if (fd < 0) {
+        return false;
+    }
+
+    RenderRequestHeader request;
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, RENDER_REQUEST_MAGIC, sizeof(RENDER_REQUEST_MAGIC));
+    request.version = RENDER_SERVICE_VERSION;
+    request.priority = test.priority;
+    request.timeoutMs = test.timeoutMs;
+    request.sceneSize = test.scene.size;
+
+    bool answered = sendAll(fd, &request, sizeof(request)) &&
+                    (test.scene.size == 0 || sendAll(fd, test.scene.data, test.scene.size)) &&
+                    receiveAll(fd, &response, sizeof(response)) &&
+                    memcmp(response.magic, RENDER_RESPONSE_MAGIC, sizeof(RENDER_RESPONSE_MAGIC)) == 0 &&
+                    response.status >= 0 && response.status < STATUS_COUNT;
+    if (answered) {
+        image.resize((size_t) response.imageSize);
+        answered = image.empty() || receiveAll(fd, image.data(), image.size());
+    }
+    close(fd);
+    return answered;
+}
+
+static void runClient(LoadTest &test) {
+    RenderResponseHeader response;
+    vector<char> image;
+    while (true) {
+        if (test.requests > 0 ? test.started++ >= test.requests : chrono::steady_clock::now() >= test.deadline) {
+            return;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool answered = renderOnce(test, response, image);
+        double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        lock_guard<mutex> guard(test.lock);
+        if (!answered) {
+            test.failed++;
+            continue;
+        }
+        test.statusCounts[response.status]++;
+        test.latencies.push_back(latency);
+        if (response.status == RENDER_OK) {
+            test.queueMs += response.queueMs;
+            test.renderMs += response.renderMs;
+            test.lastImage.swap(image);
+        }
+    }
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+    return sorted[min(i, sorted.size() - 1)];
+}
+
+static void printUsage() {
+    cout << "Usage: render_client [--connections N] [--requests N | --seconds S] [--priority P]\n"
+         << "                     [--timeout-ms MS] [--output FILE] <socket> <scene>" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 1;
+    double seconds = 0;
+    LoadTest test;
+    test.socketPath = NULL;
+    test.priority = 0;
+    test.timeoutMs = 0;
+    test.requests = 0;
+    test.outputFile = NULL;
+    test.started = 0;
+    memset(test.statusCounts, 0, sizeof(test.statusCounts));
+    test.failed = 0;
+    test.queueMs = 0;
+    test.renderMs = 0;
+
+    const char *sceneFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--connections" && i + 1 < argc) {
+            connections = max(atoi(argv[++i]), 1);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            test.requests = max(atoll(argv[++i]), 1LL);
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (arg == "--priority" && i + 1 < argc) {
+            test.priority = atoi(argv[++i]);
+        } else if (arg == "--timeout-ms" && i + 1 < argc) {
+            test.timeoutMs = (unsigned int) atoi(argv[++i]);
+        } else if (arg == "--output" && i + 1 < argc) {
+            test.outputFile = argv[++i];
+        } else if (arg[0] != '-' && test.socketPath == NULL) {
+            test.socketPath = argv[i];
+        } else if (arg[0] != '-' && sceneFile == NULL) {
+            sceneFile = argv[i];
+        } else {
+            printUsage();
+            exit(1);
+        }
+    }
+    if (sceneFile == NULL) {
+        printUsage();
+        exit(1);
+    }
+    if (test.requests == 0 && seconds <= 0) {
+        test.requests = 1;
+    }
+    if (!mapFile(sceneFile, test.scene)) {
+        cout << "Could not open file " << sceneFile << endl;
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    test.deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    vector<thread> clients;
+    for (int c = 0; c < connections; c++) {
+        clients.push_back(thread(runClient, ref(test)));
+    }
+    for (thread &client : clients) {
+        client.join();
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    sort(test.latencies.begin(), test.latencies.end());
+    long long rendered = test.statusCounts[RENDER_OK];
+    cout << fixed << setprecision(1);
+    cout << "Requests: " << test.latencies.size() + test.failed << " in " << elapsed << " s over " << connections
+         << " connections" << endl;
+    for (int s = 0; s < STATUS_COUNT; s++) {
+        if (test.statusCounts[s] > 0) {
+            cout << "  " << s_statusNames[s] << ": " << test.statusCounts[s] << endl;
+        }
+    }
+    if (test.failed > 0) {
+        cout << "  no answer: " << test.failed << endl;
+    }
+    cout << "Renders/sec: " << (elapsed > 0 ? rendered / elapsed : 0.0) << endl;
+    cout << setprecision(2) << "Latency ms: p50 " << percentile(test.latencies, 0.5) << ", p99 "
+         << percentile(test.latencies, 0.99) << ", max " << (test.latencies.empty() ? 0 : test.latencies.back())
+         << endl;
+    if (rendered > 0) {
+        cout << "Service ms per render: " << test.queueMs / rendered << " queued, " << test.renderMs / rendered
+             << " rendering" << endl;
+    }
+
+    if (test.outputFile != NULL && !test.lastImage.empty()) {
+        FILE *fp = fopen(test.outputFile, "wb");
+        if (!fp) {
+            printf("Unable to open file '%s'\n", test.outputFile);
+            exit(1);
+        }
+        fwrite(test.lastImage.data(), 1, test.lastImage.size(), fp);
+        fclose(fp);
+    }
+    unmapFile(test.scene);
+    return rendered > 0 ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+// Converts scenes between the text format and the binary format that the
+// renderer can map without parsing. The output format defaults to the one
+// the input is not in.
+//
+// Usage: scene_convert [--text | --binary] <input> <output>
+
+#include "raytrace.h"
+#include "scene_file.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+static void printUsage() {
+    cout << "Usage: scene_convert [--text | --binary] <input> <output>" << endl;
+}
+
+int main(int argc, char *argv[]) {
+    const char *files[2] = {NULL, NULL};
+    int fileCount = 0;
+    int format = -1; // 0 text, 1 binary, -1 the other one
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--text") == 0) {
+            format = 0;
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            format = 1;
+        } else if (argv[i][0] != '-' && fileCount < 2) {
+            files[fileCount++] = argv[i];
+        } else {
+            printUsage();
+            exit(1);
+        }
+    }
+    if (fileCount != 2) {
+        printUsage();
+        exit(1);
+    }
+
+    loadFile(files[0]);
+    if (format == -1) {
+        format = g_spheres.isMapped() ? 0 : 1;
+    }
+
+    bool ok = format == 1 ? saveBinaryScene(files[1]) : saveTextScene(files[1]);
+    if (!ok) {
+        exit(1);
+    }
+    printf("Wrote %s scene %s: %d spheres, %d lights\n", format == 1 ? "binary" : "text", files[1],
+           (int) g_spheres.size(), (int) g_lights.size());
+    return 0;
+}
@@ -43,10 +43,7 @@ struct vec2 {
     vec2(float x, float y) :
             x(x), y(y) { }
 
-    vec2(const vec2 &v) {
-        x = v.x;
-        y = v.y;
-    }
+    vec2(const vec2 &v) = default;
 
     //
     //  --- Indexing Operator ---
@@ -189,11 +186,7 @@ struct vec3 {
     vec3(float x, float y, float z) :
             x(x), y(y), z(z) { }
 
-    vec3(const vec3 &v) {
-        x = v.x;
-        y = v.y;
-        z = v.z;
-    }
+    vec3(const vec3 &v) = default;
 
     vec3(const vec2 &v, const float f) {
         x = v.x;
@@ -355,12 +348,7 @@ struct vec4 {
     vec4(float x, float y, float z, float w) :
             x(x), y(y), z(z), w(w) { }
 
-    vec4(const vec4 &v) {
-        x = v.x;
-        y = v.y;
-        z = v.z;
-        w = v.w;
-    }
+    vec4(const vec4 &v) = default;
 
     vec4(const vec3 &v, const float w = 1.0) : w(w) {
         x = v.x;